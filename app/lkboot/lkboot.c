@@ -242,7 +242,7 @@ static void lkboot_init(const struct app_descriptor *app) {
 		ARCH_MMU_FLAG_UNCACHED) < 0) {
 		goto fail_alloc;
 	}
-	if (arch_mmu_query((u32) lkb_iobuffer, &lkb_iobuffer_phys, NULL) < 0) {
+	if (arch_mmu_query(&vmm_get_kernel_aspace()->arch_aspace, (u32) lkb_iobuffer, &lkb_iobuffer_phys, NULL) < 0) {
 		goto fail_alloc;
 	}
 	printf("lkboot: iobuffer %p (phys 0x%lx)\n", lkb_iobuffer, lkb_iobuffer_phys);
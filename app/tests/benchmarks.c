@@ -57,25 +57,6 @@ void bench_set_overhead(void)
 	free(buf);
 }
 
-void bench_memset(void)
-{
-	const uint BUFSIZE = 4096;
-	const uint ITER = 4096;
-	void *buf = malloc(BUFSIZE);
-	printf("buf %p\n", buf);
-
-	uint count = arch_cycle_count();
-	for (uint i = 0; i < ITER; i++) {
-		memset(buf, 0, BUFSIZE);
-	}
-	count = arch_cycle_count() - count;
-
-	printf("took %u cycles to memset a buffer of size %u %d times (%u bytes)\n",
-	       count, BUFSIZE, ITER, BUFSIZE * ITER);
-
-	free(buf);
-}
-
 #define bench_cset(type) \
 void bench_cset_##type(void) \
 { \
@@ -154,27 +135,72 @@ void bench_cset_stm(void)
 
 	free(buf);
 }
+#endif
 
-
-void bench_memcpy(void)
+void bench_memset(void)
 {
 	const uint BUFSIZE = 4096;
 	const uint ITER = 4096;
-	uint8_t *buf = malloc(BUFSIZE);
+	void *buf = malloc(BUFSIZE);
 	printf("buf %p\n", buf);
 
 	uint count = arch_cycle_count();
 	for (uint i = 0; i < ITER; i++) {
-		memcpy(buf, buf + BUFSIZE / 2, BUFSIZE / 2);
+		memset(buf, 0, BUFSIZE);
 	}
 	count = arch_cycle_count() - count;
 
-	printf("took %u cycles to memcpy a buffer of size %u %d times (%u bytes)\n",
-	       count, BUFSIZE / 2, ITER, BUFSIZE * ITER);
+	printf("took %u cycles to memset a buffer of size %u %d times (%u bytes)\n",
+	       count, BUFSIZE, ITER, BUFSIZE * ITER);
+
+	free(buf);
+}
+
+/* time memcpy, memmove and memset across the size classes the string routines
+ * switch strategy between, from a few bytes to well past the caches */
+void bench_memcpy(void)
+{
+	static const size_t sizes[] = { 8, 32, 128, 512, 4096, 65536, 1024*1024, 4*1024*1024 };
+	const size_t BUFSIZE = 8*1024*1024;
+	const size_t TOTAL = 16*1024*1024;
+	uint8_t *buf = malloc(BUFSIZE + 64);
+	if (!buf) {
+		printf("couldn't allocate a buffer of size %zu\n", BUFSIZE + 64);
+		return;
+	}
+	printf("buf %p\n", buf);
+
+	for (uint i = 0; i < countof(sizes); i++) {
+		size_t size = sizes[i];
+		uint iter = MAX(TOTAL / size, 1U);
+		uint8_t *src = buf + BUFSIZE / 2;
+
+		uint count = arch_cycle_count();
+		for (uint j = 0; j < iter; j++)
+			memcpy(buf, src, size);
+		uint copy = arch_cycle_count() - count;
+
+		count = arch_cycle_count();
+		for (uint j = 0; j < iter; j++)
+			memcpy(buf + 1, src + 3, size);
+		uint unaligned = arch_cycle_count() - count;
+
+		count = arch_cycle_count();
+		for (uint j = 0; j < iter; j++)
+			memmove(buf + 8, buf, size);
+		uint move = arch_cycle_count() - count;
+
+		count = arch_cycle_count();
+		for (uint j = 0; j < iter; j++)
+			memset(buf, 0, size);
+		uint set = arch_cycle_count() - count;
+
+		printf("%8zu bytes x %6u: memcpy %u, unaligned memcpy %u, overlapping memmove %u, memset %u cycles\n",
+		       size, iter, copy, unaligned, move, set);
+	}
 
 	free(buf);
 }
-#endif
 
 #if WITH_LIB_LIBM
 #include <math.h>
@@ -216,15 +242,15 @@ void benchmarks(void)
 {
 #if ARCH_ARM
 	bench_set_overhead();
-	bench_memset();
 	bench_cset_uint8_t();
 	bench_cset_uint16_t();
 	bench_cset_uint32_t();
 	bench_cset_uint64_t();
 	bench_cset_wide();
 	bench_cset_stm();
-	bench_memcpy();
 #endif
+	bench_memset();
+	bench_memcpy();
 #if WITH_LIB_LIBM
     bench_sincos();
 #endif
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Scheduler latency benchmarks, in the spirit of cyclictest.
+ *
+ * Every case collects a set of samples in ns and reports them the same way on
+ * every platform, one line of summary followed by a log2 histogram:
+ *
+ *   LAT case=<name> n=<samples> min_ns=<> avg_ns=<> max_ns=<> p99_ns=<>
+ *   LAT_HIST case=<name> lo_ns=<> hi_ns=<> count=<>
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <platform.h>
+
+#define LATENCY_DEFAULT_ITER 1000
+#define LATENCY_TIMER_DELAY_NS 1000000ULL /* 1ms */
+
+struct latency_samples {
+	uint32_t *sample; /* ns */
+	uint count;
+	uint max_count;
+};
+
+struct latency_ctx {
+	struct latency_samples *s;
+	uint iter;
+	event_t go;
+	event_t ready;
+	event_t ack;
+	mutex_t lock;
+	volatile bool done;
+	volatile lk_time_ns_t t0;
+};
+
+static void latency_record(struct latency_samples *s, lk_time_ns_t ns)
+{
+	if (s->count < s->max_count)
+		s->sample[s->count++] = (ns > UINT32_MAX) ? UINT32_MAX : ns;
+}
+
+static void latency_sort(uint32_t *a, uint n)
+{
+	/* shell sort, there's no qsort in libc */
+	for (uint gap = n / 2; gap > 0; gap /= 2) {
+		for (uint i = gap; i < n; i++) {
+			uint32_t temp = a[i];
+			uint j;
+			for (j = i; j >= gap && a[j - gap] > temp; j -= gap)
+				a[j] = a[j - gap];
+			a[j] = temp;
+		}
+	}
+}
+
+static void latency_report(const char *name, struct latency_samples *s)
+{
+	if (s->count == 0) {
+		printf("LAT case=%s n=0\n", name);
+		return;
+	}
+
+	latency_sort(s->sample, s->count);
+
+	uint64_t sum = 0;
+	uint hist[33];
+	memset(hist, 0, sizeof(hist));
+	for (uint i = 0; i < s->count; i++) {
+		uint32_t ns = s->sample[i];
+		sum += ns;
+		hist[ns ? 32 - __builtin_clz(ns) : 0]++;
+	}
+
+	/* the smallest sample at or above 99% of the rest */
+	uint p99 = (s->count * 99 + 99) / 100 - 1;
+
+	printf("LAT case=%s n=%u min_ns=%u avg_ns=%u max_ns=%u p99_ns=%u\n",
+	       name, s->count, s->sample[0], (uint32_t)(sum / s->count),
+	       s->sample[s->count - 1], s->sample[p99]);
+
+	for (uint b = 0; b < countof(hist); b++) {
+		if (hist[b] == 0)
+			continue;
+
+		uint32_t lo = b ? (1U << (b - 1)) : 0;
+		uint32_t hi = b ? (uint32_t)((1ULL << b) - 1) : 0;
+		printf("LAT_HIST case=%s lo_ns=%u hi_ns=%u count=%u\n", name, lo, hi, hist[b]);
+	}
+}
+
+static thread_t *latency_thread(const char *name, thread_start_routine entry, struct latency_ctx *ctx, int priority)
+{
+	thread_t *t = thread_create(name, entry, ctx, priority, DEFAULT_STACK_SIZE);
+	if (t)
+		thread_resume(t);
+	return t;
+}
+
+/* how late a thread wakes up after its sleep timer expires */
+static int timer_wakeup_thread(void *arg)
+{
+	struct latency_ctx *ctx = arg;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		lk_time_ns_t start = current_time_ns();
+		thread_sleep_ns(LATENCY_TIMER_DELAY_NS);
+		lk_time_ns_t delta = current_time_ns() - start;
+
+		latency_record(ctx->s, (delta > LATENCY_TIMER_DELAY_NS) ? delta - LATENCY_TIMER_DELAY_NS : 0);
+	}
+
+	return 0;
+}
+
+static void latency_timer_wakeup(struct latency_ctx *ctx)
+{
+	thread_t *t = latency_thread("lat timer", &timer_wakeup_thread, ctx, HIGH_PRIORITY);
+	if (t)
+		thread_join(t, NULL, INFINITE_TIME);
+}
+
+/* from event_signal() until the waiter is running */
+static int event_wake_thread(void *arg)
+{
+	struct latency_ctx *ctx = arg;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		/* the thread lock is held from flagging ready until we're blocked,
+		 * so the other side can't get going before then */
+		enter_critical_section();
+		event_signal(&ctx->ready, false);
+		event_wait(&ctx->go);
+		latency_record(ctx->s, current_time_ns() - ctx->t0);
+		exit_critical_section();
+
+		event_signal(&ctx->ack, false);
+	}
+
+	return 0;
+}
+
+static void latency_event_wake(struct latency_ctx *ctx)
+{
+	thread_t *t = latency_thread("lat event", &event_wake_thread, ctx, HIGH_PRIORITY);
+	if (!t)
+		return;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		/* make sure it's actually blocked, it may be on another cpu */
+		event_wait(&ctx->ready);
+
+		ctx->t0 = current_time_ns();
+		event_signal(&ctx->go, true);
+		event_wait(&ctx->ack);
+	}
+
+	thread_join(t, NULL, INFINITE_TIME);
+}
+
+/* from mutex_release() until the blocked waiter owns the mutex and is running */
+static int mutex_handoff_thread(void *arg)
+{
+	struct latency_ctx *ctx = arg;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		event_wait(&ctx->go);
+
+		/* same as the event case, nothing can release the mutex until we're
+		 * blocked on it. this also keeps mutex_acquire() from spinning. */
+		enter_critical_section();
+		event_signal(&ctx->ready, false);
+		mutex_acquire(&ctx->lock);
+		latency_record(ctx->s, current_time_ns() - ctx->t0);
+		exit_critical_section();
+
+		mutex_release(&ctx->lock);
+		event_signal(&ctx->ack, false);
+	}
+
+	return 0;
+}
+
+static void latency_mutex_handoff(struct latency_ctx *ctx)
+{
+	thread_t *t = latency_thread("lat mutex", &mutex_handoff_thread, ctx, HIGH_PRIORITY);
+	if (!t)
+		return;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		mutex_acquire(&ctx->lock);
+		event_signal(&ctx->go, true);
+
+		event_wait(&ctx->ready);
+
+		ctx->t0 = current_time_ns();
+		mutex_release(&ctx->lock);
+		event_wait(&ctx->ack);
+	}
+
+	thread_join(t, NULL, INFINITE_TIME);
+}
+
+/* two threads on the same cpu yielding back and forth, each sample is one switch */
+static int context_switch_thread(void *arg)
+{
+	struct latency_ctx *ctx = arg;
+
+	for (uint i = 0; i < ctx->iter; i++) {
+		lk_time_ns_t start = current_time_ns();
+		thread_yield();
+		latency_record(ctx->s, (current_time_ns() - start) / 2);
+	}
+	ctx->done = true;
+
+	return 0;
+}
+
+static int context_switch_partner_thread(void *arg)
+{
+	struct latency_ctx *ctx = arg;
+
+	while (!ctx->done)
+		thread_yield();
+
+	return 0;
+}
+
+static void latency_context_switch(struct latency_ctx *ctx)
+{
+	thread_t *t[2];
+	int cpu = arch_curr_cpu_num();
+
+	t[0] = thread_create("lat switch", &context_switch_thread, ctx, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+	t[1] = thread_create("lat switch partner", &context_switch_partner_thread, ctx, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+	if (!t[0] || !t[1])
+		return;
+
+	thread_set_pinned_cpu(t[0], cpu);
+	thread_set_pinned_cpu(t[1], cpu);
+	thread_resume(t[1]);
+	thread_resume(t[0]);
+
+	thread_join(t[0], NULL, INFINITE_TIME);
+	thread_join(t[1], NULL, INFINITE_TIME);
+}
+
+static const struct latency_case {
+	const char *name;
+	void (*run)(struct latency_ctx *ctx);
+} latency_cases[] = {
+	{ "timer_wakeup", &latency_timer_wakeup },
+	{ "event_wake", &latency_event_wake },
+	{ "mutex_handoff", &latency_mutex_handoff },
+	{ "context_switch", &latency_context_switch },
+};
+
+static void latency_run_case(const struct latency_case *c, uint iter)
+{
+	struct latency_samples s;
+	struct latency_ctx ctx;
+
+	s.sample = malloc(iter * sizeof(uint32_t));
+	if (!s.sample) {
+		printf("LAT case=%s error=%d\n", c->name, ERR_NO_MEMORY);
+		return;
+	}
+	s.count = 0;
+	s.max_count = iter;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.s = &s;
+	ctx.iter = iter;
+	event_init(&ctx.go, false, EVENT_FLAG_AUTOUNSIGNAL);
+	event_init(&ctx.ready, false, EVENT_FLAG_AUTOUNSIGNAL);
+	event_init(&ctx.ack, false, EVENT_FLAG_AUTOUNSIGNAL);
+	mutex_init(&ctx.lock);
+
+	c->run(&ctx);
+
+	latency_report(c->name, &s);
+
+	mutex_destroy(&ctx.lock);
+	event_destroy(&ctx.ack);
+	event_destroy(&ctx.ready);
+	event_destroy(&ctx.go);
+	free(s.sample);
+}
+
+int latency_tests(int argc, const cmd_args *argv)
+{
+	const char *name = (argc >= 2) ? argv[1].str : "all";
+	uint iter = (argc >= 3 && argv[2].u > 0) ? argv[2].u : LATENCY_DEFAULT_ITER;
+	bool found = false;
+
+	for (uint i = 0; i < countof(latency_cases); i++) {
+		if (strcmp(name, "all") && strcmp(name, latency_cases[i].name))
+			continue;
+
+		found = true;
+		latency_run_case(&latency_cases[i], iter);
+	}
+
+	if (!found) {
+		printf("usage: %s [all|case] [iterations]\n", argv[0].str);
+		printf("cases:");
+		for (uint i = 0; i < countof(latency_cases); i++)
+			printf(" %s", latency_cases[i].name);
+		printf("\n");
+		return ERR_INVALID_ARGS;
+	}
+
+	return NO_ERROR;
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
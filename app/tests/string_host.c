@@ -0,0 +1,114 @@
+/* Host side check of the generic C string routines in lib/libc/string
+ * against the host libc, built with something like:
+ *
+ * cc -O2 -Wall -idirafter ../../include -o string_host string_host.c
+ *
+ * Every buffer under test ends right at a PROT_NONE guard page, so any read
+ * past the end of the string that is not allowed faults immediately.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t (*ref_strlen)(const char *) = strlen;
+static void *(*ref_memchr)(const void *, int, size_t) = memchr;
+static char *(*ref_strchr)(const char *, int) = strchr;
+static int (*ref_memcmp)(const void *, const void *, size_t) = memcmp;
+static int (*ref_strcmp)(const char *, const char *) = strcmp;
+
+#define strlen lk_strlen
+#define memchr lk_memchr
+#define strchr lk_strchr
+#define memcmp lk_memcmp
+#define strcmp lk_strcmp
+#include "../../lib/libc/string/strlen.c"
+#include "../../lib/libc/string/memchr.c"
+#include "../../lib/libc/string/strchr.c"
+#include "../../lib/libc/string/memcmp.c"
+#include "../../lib/libc/string/strcmp.c"
+
+#define MAXLEN 512
+#define ITERATIONS 200000
+
+static size_t page_size;
+static int errors;
+
+#define sign(x) (((x) > 0) - ((x) < 0))
+#define check(cond, ...) \
+    do { if (!(cond)) { printf(__VA_ARGS__); errors++; } } while (0)
+
+/* a MAXLEN + page sized area whose end is followed by a guard page */
+static unsigned char *guarded_area(void)
+{
+    size_t len = page_size * 2 + ((MAXLEN + page_size - 1) & ~(page_size - 1));
+    unsigned char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    mprotect(p + len - page_size, page_size, PROT_NONE);
+    return p + len - page_size;
+}
+
+/* random non zero bytes, with an occasional run of a few distinct values */
+static void fill(unsigned char *p, size_t len)
+{
+    int narrow = rand() & 1;
+
+    for (size_t i = 0; i < len; i++)
+        p[i] = narrow ? 1 + rand() % 4 : 1 + rand() % 255;
+}
+
+int main(int argc, char **argv)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    unsigned char *end1 = guarded_area();
+    unsigned char *end2 = guarded_area();
+
+    printf("string routine tests\n");
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        size_t len = (rand() & 3) ? rand() % 64 : rand() % MAXLEN;
+        size_t slack = rand() % 3 ? 0 : rand() % 32;
+        unsigned char *a = end1 - len - 1 - slack;
+        unsigned char *b = end2 - len - 1 - ((rand() & 1) ? slack : rand() % 32);
+        int c = (rand() & 1) ? 0x100 * (rand() & 7) + 1 + rand() % 4 : rand();
+
+        /* strings, terminated somewhere before the guard page */
+        fill(a, len + 1 + slack);
+        a[len] = 0;
+        memmove(b, a, len + 1);
+        if (len && (rand() & 1))
+            b[rand() % len] = rand();
+
+        check(lk_strlen((char *)a) == ref_strlen((char *)a),
+              "strlen len %zu align %zu\n", len, (size_t)a % 8);
+        check(lk_strchr((char *)a, c) == ref_strchr((char *)a, c),
+              "strchr len %zu align %zu c %#x\n", len, (size_t)a % 8, c);
+        check(sign(lk_strcmp((char *)a, (char *)b)) == sign(ref_strcmp((char *)a, (char *)b)),
+              "strcmp len %zu align %zu/%zu\n", len, (size_t)a % 8, (size_t)b % 8);
+
+        /* raw memory, which may hold zeros and ends at the guard page */
+        size_t n = len + 1 + slack;
+        unsigned char *m = end1 - n;
+        for (size_t j = 0; j < n; j++)
+            m[j] = rand() % 8 ? m[j] : 0;
+        unsigned char *m2 = end2 - n;
+        memmove(m2, m, n);
+        if (rand() & 1)
+            m2[rand() % n] = rand();
+
+        check(lk_memchr(m, c, n) == ref_memchr(m, c, n),
+              "memchr len %zu align %zu c %#x\n", n, (size_t)m % 8, c);
+        check(sign(lk_memcmp(m, m2, n)) == sign(ref_memcmp(m, m2, n)),
+              "memcmp len %zu align %zu/%zu\n", n, (size_t)m % 8, (size_t)m2 % 8);
+    }
+
+    printf("%d errors\n", errors);
+    return errors ? 1 : 0;
+}
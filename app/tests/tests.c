@@ -38,6 +38,7 @@ STATIC_COMMAND("float_tests", "floating point test", (console_cmd)&float_tests)
 #endif
 STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
+STATIC_COMMAND("latency", "scheduler latency benchmarks", (console_cmd)&latency_tests)
 STATIC_COMMAND_END(tests);
 
 #endif
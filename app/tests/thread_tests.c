@@ -497,6 +497,89 @@ static void preempt_test(void)
 	printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+static volatile int deadline_leave_progress;
+static volatile bool deadline_leave_done;
+
+static int deadline_leave_companion(void *arg)
+{
+	while (!deadline_leave_done)
+		deadline_leave_progress++;
+
+	return 0;
+}
+
+static int deadline_leave_tester(void *arg)
+{
+	thread_t *t = get_current_thread();
+
+	/* 10ms of runtime every 50ms, then drop back to the priority class with
+	 * the budget timer still pending */
+	thread_set_deadline(t, 10000000ULL, 0, 50000000ULL);
+	spin(2000);
+	thread_set_deadline(t, 0, 0, 0);
+
+	/* run well past the old budget and a few periods. nothing should throttle
+	 * us, and the companion should get a share of the cpu through the quantum */
+	int start = deadline_leave_progress;
+	spin(300000);
+
+	printf("overruns %u (should be 0), companion progress %d (should be nonzero)\n",
+	       t->dl.overruns, deadline_leave_progress - start);
+
+	deadline_leave_done = true;
+
+	return 0;
+}
+
+static int deadline_wakeup_tester(void *arg)
+{
+	thread_t *t = get_current_thread();
+
+	/* 5ms of runtime every 20ms. use some of the budget, then sleep through
+	 * several deadlines */
+	thread_set_deadline(t, 5000000ULL, 0, 20000000ULL);
+	spin(1000);
+	thread_sleep(100);
+
+	/* coming back after the deadline should have started a fresh period with
+	 * a full budget, not left us with the stale deadline sorting ahead of
+	 * everyone else */
+	lk_time_ns_t now = current_time_ns();
+	lk_time_ns_t abs_deadline = t->dl.abs_deadline;
+	long long budget = t->dl.budget;
+
+	printf("deadline %s (should be current), budget %lld of 5000000 (should be close to all of it)\n",
+	       (abs_deadline > now && abs_deadline <= now + 20000000ULL) ? "current" : "stale", budget);
+
+	thread_set_deadline(t, 0, 0, 0);
+
+	return 0;
+}
+
+static void deadline_test(void)
+{
+	printf("testing leaving the deadline class while running\n");
+
+	deadline_leave_progress = 0;
+	deadline_leave_done = false;
+
+	thread_t *companion = thread_create("deadline companion", &deadline_leave_companion, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_t *tester = thread_create("deadline tester", &deadline_leave_tester, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_resume(companion);
+	thread_resume(tester);
+
+	thread_join(tester, NULL, INFINITE_TIME);
+	thread_join(companion, NULL, INFINITE_TIME);
+
+	printf("testing a deadline thread waking up after its deadline\n");
+
+	tester = thread_create("deadline wakeup", &deadline_wakeup_tester, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_resume(tester);
+	thread_join(tester, NULL, INFINITE_TIME);
+
+	printf("done with deadline test\n");
+}
+
 int thread_tests(void)
 {
 	mutex_test();
@@ -510,6 +593,8 @@ int thread_tests(void)
 
 	preempt_test();
 
+	deadline_test();
+
 	return 0;
 }
 
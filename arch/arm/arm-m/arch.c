@@ -24,6 +24,7 @@
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm.h>
+#include <arch/cpu_features.h>
 #include <kernel/thread.h>
 #include <kernel/debug.h>
 #include <platform.h>
@@ -96,6 +97,13 @@ void arch_quiesce(void)
 {
 }
 
+uint32_t arch_cpu_features(void)
+{
+	/* nothing optional that the kernel makes use of on cortex-m. The fpu of
+	 * the cortex-m4f is never switched on. */
+	return 0;
+}
+
 void arch_idle(void)
 {
 	__asm__ volatile("wfi");
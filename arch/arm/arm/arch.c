@@ -23,37 +23,84 @@
 #include <debug.h>
 #include <trace.h>
 #include <stdlib.h>
+#include <string.h>
 #include <err.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/mmu.h>
+#include <arch/mp.h>
+#include <arch/cpu_features.h>
+#include <bits.h>
 #include <arch/arm.h>
 #include <arch/arm/mmu.h>
 #include <platform.h>
 #include <target.h>
 #include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
-void arch_early_init(void)
+#if WITH_SMP
+/* secondary cpus spin in start.S until the boot cpu clears this */
+volatile int arm_boot_cpu_lock = 1;
+
+/* the kernel translation table plus an identity mapping of the boot code,
+ * used by secondary cpus to turn on their mmu */
+uint32_t arm_secondary_translation_table[4096] __ALIGNED(16384);
+
+extern uint32_t arm_kernel_translation_table[4096];
+extern void arm_reset(void);
+#endif
+
+static uint32_t cpu_features;
+
+static void arm_cpu_features_init(void)
 {
-	/* turn off the cache */
-	arch_disable_cache(UCACHE);
+#if ARM_WITH_VFP
+	/* the media and vfp feature registers are readable with the fpu itself
+	 * still disabled, as long as cpacr grants access to cp10/cp11 */
+	uint32_t mvfr0, mvfr1;
+	__asm__ volatile("vmrs	%0, MVFR0" : "=r"(mvfr0));
+	__asm__ volatile("vmrs	%0, MVFR1" : "=r"(mvfr1));
+
+	if (BITS_SHIFT(mvfr0, 7, 4) != 0)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_FPU);
+	if (BITS_SHIFT(mvfr1, 11, 8) != 0)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SIMD);
+#endif
 
-	/* set the vector base to our exception vectors so we dont need to double map at 0 */
 #if ARM_ISA_ARMV7
-	arm_write_vbar(KERNEL_BASE + KERNEL_LOAD_OFFSET);
+	/* the armv8 crypto and crc32 extensions, reads as zero on armv7 cores */
+	uint32_t isar5 = arm_read_id_isar5();
+
+	if (BITS_SHIFT(isar5, 7, 4) >= 1)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_AES);
+	if (BITS_SHIFT(isar5, 7, 4) >= 2)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_PMULL);
+	if (BITS_SHIFT(isar5, 11, 8) >= 1)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SHA1);
+	if (BITS_SHIFT(isar5, 15, 12) >= 1)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SHA2);
+	if (BITS_SHIFT(isar5, 19, 16) >= 1)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_CRC32);
 #endif
+}
 
-#if ARM_WITH_MMU
-	arm_mmu_init();
+uint32_t arch_cpu_features(void)
+{
+	return cpu_features;
+}
 
-	platform_init_mmu_mappings();
+/* per cpu setup, run on every cpu with the mmu and caches enabled */
+static void arm_basic_setup(void)
+{
+	/* set the vector base to our exception vectors so we dont need to double map at 0 */
+#if ARM_ISA_ARMV7
+	arm_write_vbar(KERNEL_BASE + KERNEL_LOAD_OFFSET);
 #endif
 
-	/* turn the cache back on */
-	arch_enable_cache(UCACHE);
-
 #if ARM_WITH_VFP
 	/* enable cp10 and cp11 */
 	uint32_t val = arm_read_cpacr();
@@ -80,10 +127,75 @@ void arch_early_init(void)
 #endif
 }
 
+void arch_early_init(void)
+{
+	/* turn off the cache */
+	arch_disable_cache(UCACHE);
+
+#if ARM_WITH_MMU
+	arm_mmu_init();
+
+	platform_init_mmu_mappings();
+#endif
+
+	/* turn the cache back on */
+	arch_enable_cache(UCACHE);
+
+	arm_basic_setup();
+
+	arm_cpu_features_init();
+}
+
 void arch_init(void)
 {
+#if WITH_SMP
+	arch_mp_init_percpu();
+
+	/* build the trampoline table for the secondary cpus */
+	paddr_t boot_pa;
+	if (arm_vtop((addr_t)&arm_reset, &boot_pa) < 0) {
+		panic("error translating boot code physical address\n");
+	}
+
+	memcpy(arm_secondary_translation_table, arm_kernel_translation_table,
+	       sizeof(arm_secondary_translation_table));
+	arm_secondary_translation_table[boot_pa / SECTION_SIZE] =
+		ROUNDDOWN(boot_pa, SECTION_SIZE) | MMU_KERNEL_L1_PTE_FLAGS;
+
+	/* the secondaries walk the tables and read the lock with their caches off */
+	arch_clean_cache_range((addr_t)arm_kernel_translation_table, sizeof(arm_kernel_translation_table));
+	arch_clean_cache_range((addr_t)arm_secondary_translation_table, sizeof(arm_secondary_translation_table));
+
+	LTRACEF("releasing secondary cpus\n");
+
+	arm_boot_cpu_lock = 0;
+	arch_clean_cache_range((addr_t)&arm_boot_cpu_lock, sizeof(arm_boot_cpu_lock));
+	DSB;
+	__asm__ volatile("sev");
+#endif
 }
 
+#if WITH_SMP
+void arm_secondary_entry(uint asm_cpu_num)
+{
+	/* the boot cpu has already set up the shared outer cache */
+	arm_enable_local_cache();
+
+#if ARM_WITH_MMU
+	arm_mmu_init_percpu();
+#endif
+
+	arm_basic_setup();
+
+	platform_init_secondary_cpu();
+	arch_mp_init_percpu();
+
+	LTRACEF("cpu num %u\n", asm_cpu_num);
+
+	lk_secondary_cpu_entry();
+}
+#endif
+
 void arch_quiesce(void)
 {
 #if ENABLE_CYCLE_COUNTER
@@ -166,8 +278,12 @@ void arch_chain_load(void *entry)
 	LTRACEF("loader address %p, phys 0x%lx, surrounding large page 0x%lx\n",
 			&arm_chain_load, loader_pa, loader_pa_section);
 
+	/* the identity mapping lands below KERNEL_ASPACE_BASE, which goes through
+	 * TTBR0, so drop any user aspace and put the kernel table back there */
+	arch_mmu_context_switch(NULL);
+
 	/* using large pages, map around the target location */
-	arch_mmu_map(loader_pa_section, loader_pa_section, (2 * SECTION_SIZE / PAGE_SIZE), 0);
+	arch_mmu_map(&vmm_get_kernel_aspace()->arch_aspace, loader_pa_section, loader_pa_section, (2 * SECTION_SIZE / PAGE_SIZE), 0);
 
 	LTRACEF("disabling instruction/data cache\n");
 	arch_disable_cache(UCACHE);
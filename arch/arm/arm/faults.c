@@ -25,6 +25,9 @@
 #include <arch/arm.h>
 #include <kernel/thread.h>
 #include <platform.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 static void dump_mode_regs(uint32_t spsr)
 {
@@ -161,15 +164,58 @@ fpu:
 #endif
 }
 
+/* leave at least this much of a thread's stack for an abort handler to run on */
+#define ARM_ABORT_SVC_STACK_MIN 1024
+
+/* called by the abort entry code, in abort mode on the abort stack, with the
+ * svc stack pointer the fault was taken with. says whether it's safe to build
+ * the frame there and run the handler, rather than take a second abort on an
+ * overflowed stack and recurse. */
+bool arm_abort_svc_stack_ok(vaddr_t sp)
+{
+	thread_t *t = get_current_thread();
+	if (!t || !t->stack)
+		return false;
+
+	vaddr_t base = (vaddr_t)t->stack;
+	return sp > base + ARM_ABORT_SVC_STACK_MIN && sp <= base + t->stack_size;
+}
+
+#if WITH_KERNEL_VM
+/* give the vmm a shot at a translation fault, returns true if it fixed it up */
+static bool arm_vm_translation_fault(struct arm_fault_frame *frame, vaddr_t far, uint pf_flags)
+{
+	/* filling in the page may block, which is only safe if the faulting
+	 * context could have blocked as well, and we aren't stuck on the abort
+	 * stack because its own stack was bad */
+	if (in_critical_section() || (frame->spsr & (1<<7)) ||
+	        (read_cpsr() & MODE_MASK) != MODE_SVC)
+		return false;
+
+	arch_enable_ints();
+	status_t err = vmm_page_fault_handler(far, pf_flags);
+	arch_disable_ints();
+
+	return err >= 0;
+}
+#endif
+
 void arm_data_abort_handler(struct arm_fault_frame *frame)
 {
 	uint32_t fsr = arm_read_dfsr();
 	uint32_t far = arm_read_dfar();
 
 	uint32_t fault_status = (BIT(fsr, 10) ? (1<<4) : 0) |  BITS(fsr, 3, 0);
+	bool write = !!BIT(fsr, 11);
+
+#if WITH_KERNEL_VM
+	if (fault_status == 0b00101 || fault_status == 0b00111) {
+		if (arm_vm_translation_fault(frame, far, write ? VMM_PF_FLAG_WRITE : 0))
+			return;
+	}
+#endif
 
 	dprintf(CRITICAL, "\n\ndata abort, ");
-	bool write = !!BIT(fsr, 11);
 
 	/* decode the fault status (from table B3-23) */
 	switch (fault_status) {
@@ -228,6 +274,13 @@ void arm_prefetch_abort_handler(struct arm_fault_frame *frame)
 
 	uint32_t fault_status = (BIT(fsr, 10) ? (1<<4) : 0) |  BITS(fsr, 3, 0);
 
+#if WITH_KERNEL_VM
+	if (fault_status == 0b00101 || fault_status == 0b00111) {
+		if (arm_vm_translation_fault(frame, far, VMM_PF_FLAG_INSTRUCTION))
+			return;
+	}
+#endif
+
 	dprintf(CRITICAL, "\n\nprefetch abort, ");
 
 	/* decode the fault status (from table B3-23) */
@@ -40,13 +40,39 @@
 
 #define IS_SECTION_ALIGNED(x) IS_ALIGNED(x, SECTION_SIZE)
 #define IS_SUPERSECTION_ALIGNED(x) IS_ALIGNED(x, SUPERSECTION_SIZE)
+#define IS_LARGE_PAGE_ALIGNED(x) IS_ALIGNED(x, LARGE_PAGE_SIZE)
 
 /* locals */
-static void arm_mmu_map_section(addr_t paddr, addr_t vaddr, uint flags);
-static void arm_mmu_unmap_section(addr_t vaddr);
+static void arm_mmu_map_section(uint32_t *table, addr_t paddr, addr_t vaddr, uint flags);
+static void arm_mmu_unmap_section(uint32_t *table, addr_t vaddr);
+static void arm_mmu_map_supersection(uint32_t *table, addr_t paddr, addr_t vaddr, uint flags);
+static void arm_mmu_unmap_supersection(uint32_t *table, addr_t vaddr);
 
 /* the main translation table */
 uint32_t arm_kernel_translation_table[4096] __ALIGNED(16384) __SECTION(".bss.prebss.translation_table");
+static paddr_t arm_kernel_translation_table_phys;
+
+/* TTBR1 always holds the kernel table and translates everything from
+ * KERNEL_ASPACE_BASE up. TTBR0 translates the range below it through the
+ * active user aspace's table, which is just large enough to cover that range. */
+STATIC_ASSERT((KERNEL_ASPACE_BASE & (KERNEL_ASPACE_BASE - 1)) == 0);
+STATIC_ASSERT(KERNEL_ASPACE_BASE >= 32 * MB && KERNEL_ASPACE_BASE <= 2048U * MB);
+
+#define TTBCR_N (32 - __builtin_ctz(KERNEL_ASPACE_BASE))
+#define USER_TT_SIZE ((KERNEL_ASPACE_BASE / SECTION_SIZE) * sizeof(uint32_t))
+#define USER_TT_PAGES (ROUNDUP(USER_TT_SIZE, PAGE_SIZE) / PAGE_SIZE)
+#define USER_TT_ALIGN_LOG2 MAX(14 - TTBCR_N, PAGE_SIZE_SHIFT)
+
+/* asid allocator. asid 0 is never handed out and is what CONTEXTIDR holds
+ * while no user aspace is loaded. once all of them are used up a new
+ * generation starts, the tlbs are flushed and every aspace that isn't
+ * running somewhere has to pick up a fresh asid on its next switch. */
+#define ASID_COUNT 256
+
+static spin_lock_t asid_lock;
+static uint32_t asid_map[ASID_COUNT / 32] = { 1 };
+static uint asid_generation = 1;
+static arch_aspace_t *active_aspace[SMP_MAX_CPUS];
 
 /* convert user level mmu flags to flags that go in L1 descriptors */
 static uint32_t mmu_flags_to_l1_arch_flags(uint flags)
@@ -55,6 +81,9 @@ static uint32_t mmu_flags_to_l1_arch_flags(uint flags)
     switch (flags & ARCH_MMU_FLAG_CACHE_MASK) {
         case ARCH_MMU_FLAG_CACHED:
             arch_flags |= MMU_MEMORY_L1_TYPE_NORMAL_WRITE_BACK_ALLOCATE;
+#if WITH_SMP
+            arch_flags |= MMU_MEMORY_L1_SECTION_SHAREABLE;
+#endif
             break;
         case ARCH_MMU_FLAG_UNCACHED:
             arch_flags |= MMU_MEMORY_L1_TYPE_STRONGLY_ORDERED;
@@ -94,6 +123,9 @@ static uint32_t mmu_flags_to_l2_arch_flags(uint flags)
     switch (flags & ARCH_MMU_FLAG_CACHE_MASK) {
         case ARCH_MMU_FLAG_CACHED:
             arch_flags |= MMU_MEMORY_L2_TYPE_NORMAL_WRITE_BACK_ALLOCATE;
+#if WITH_SMP
+            arch_flags |= MMU_MEMORY_L2_SHAREABLE;
+#endif
             break;
         case ARCH_MMU_FLAG_UNCACHED:
             arch_flags |= MMU_MEMORY_L2_TYPE_STRONGLY_ORDERED;
@@ -126,7 +158,60 @@ static uint32_t mmu_flags_to_l2_arch_flags(uint flags)
     return arch_flags;
 }
 
-static void arm_mmu_map_section(addr_t paddr, addr_t vaddr, uint flags)
+/* 64K large page descriptors keep TEX in bits [14:12] instead of [8:6] */
+static uint32_t l2_small_to_large_arch_flags(uint32_t arch_flags)
+{
+    uint32_t tex = (arch_flags & MMU_MEMORY_L2_TEX_MASK) >> MMU_MEMORY_L2_TEX_SHIFT;
+
+    return (arch_flags & ~MMU_MEMORY_L2_TEX_MASK) | (tex << MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT);
+}
+
+static uint32_t l2_large_to_small_arch_flags(uint32_t l2_entry)
+{
+    uint32_t tex = (l2_entry >> MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT) & 0x7;
+
+    return (l2_entry & (MMU_MEMORY_L2_AP_MASK | MMU_MEMORY_L2_TYPE_MASK | MMU_MEMORY_L2_SHAREABLE | MMU_MEMORY_L2_NON_GLOBAL) & ~MMU_MEMORY_L2_TEX_MASK) |
+        (tex << MMU_MEMORY_L2_TEX_SHIFT);
+}
+
+/* convert the bits of a L2 small page descriptor back to user level mmu flags */
+static uint l2_arch_flags_to_mmu_flags(uint32_t l2_entry)
+{
+    uint flags = 0;
+
+    switch (l2_entry & MMU_MEMORY_L2_TYPE_MASK) {
+        case MMU_MEMORY_L2_TYPE_STRONGLY_ORDERED:
+            flags |= ARCH_MMU_FLAG_UNCACHED;
+            break;
+        case MMU_MEMORY_L2_TYPE_DEVICE_SHARED:
+        case MMU_MEMORY_L2_TYPE_DEVICE_NON_SHARED:
+            flags |= ARCH_MMU_FLAG_UNCACHED_DEVICE;
+            break;
+    }
+    switch (l2_entry & MMU_MEMORY_L2_AP_MASK) {
+        case MMU_MEMORY_L2_AP_P_NA_U_NA:
+            // XXX no access, what to return?
+            break;
+        case MMU_MEMORY_L2_AP_P_RW_U_NA:
+            break;
+        case MMU_MEMORY_L2_AP_P_RW_U_RO:
+            flags |= ARCH_MMU_FLAG_PERM_USER | ARCH_MMU_FLAG_PERM_RO; // XXX should it be rw anyway since kernel can rw it?
+            break;
+        case MMU_MEMORY_L2_AP_P_RW_U_RW:
+            flags |= ARCH_MMU_FLAG_PERM_USER;
+            break;
+    }
+
+    return flags;
+}
+
+/* supersections are optional in the short descriptor format, ID_MMFR3 says if we have them */
+static bool arm_mmu_has_supersections(void)
+{
+    return ((arm_read_id_mmfr3() >> 28) & 0xf) != 0xf;
+}
+
+static void arm_mmu_map_section(uint32_t *table, addr_t paddr, addr_t vaddr, uint flags)
 {
     int index;
 
@@ -144,17 +229,63 @@ static void arm_mmu_map_section(addr_t paddr, addr_t vaddr, uint flags)
      * (0<<5): Domain = 0
      *  flags: TEX, CB and AP bit settings provided by the caller.
      */
-    arm_kernel_translation_table[index] = (paddr & ~(MB-1)) | (MMU_MEMORY_DOMAIN_MEM << 5) | MMU_MEMORY_L1_DESCRIPTOR_SECTION | flags;
+    table[index] = (paddr & ~(MB-1)) | (MMU_MEMORY_DOMAIN_MEM << 5) | MMU_MEMORY_L1_DESCRIPTOR_SECTION | flags;
 }
 
-static void arm_mmu_unmap_section(addr_t vaddr)
+static void arm_mmu_unmap_section(uint32_t *table, addr_t vaddr)
 {
     DEBUG_ASSERT(IS_SECTION_ALIGNED(vaddr));
 
     uint index = vaddr / SECTION_SIZE;
-    arm_kernel_translation_table[index] = 0;
+    table[index] = 0;
+}
+
+static void arm_mmu_map_supersection(uint32_t *table, addr_t paddr, addr_t vaddr, uint flags)
+{
+    LTRACEF("pa 0x%lx va 0x%lx flags 0x%x\n", paddr, vaddr, flags);
+
+    DEBUG_ASSERT(IS_SUPERSECTION_ALIGNED(paddr));
+    DEBUG_ASSERT(IS_SUPERSECTION_ALIGNED(vaddr));
+    DEBUG_ASSERT((flags & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION);
+
+    /* a supersection is the same descriptor repeated in 16 consecutive L1 entries.
+     * the domain field holds extended address bits here, so leave it zero */
+    uint index = vaddr / SECTION_SIZE;
+    for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++)
+        table[index + i] = MMU_MEMORY_L1_SUPERSECTION_ADDR(paddr) | flags;
+}
+
+static void arm_mmu_unmap_supersection(uint32_t *table, addr_t vaddr)
+{
+    DEBUG_ASSERT(IS_SUPERSECTION_ALIGNED(vaddr));
+
+    uint index = vaddr / SECTION_SIZE;
+    for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++)
+        table[index + i] = 0;
+}
+
+/* drop any tlb entry for vaddr left over from the passed aspace */
+static void arm_mmu_invalidate_va(arch_aspace_t *aspace, vaddr_t vaddr)
+{
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
+        arm_invalidate_tlb_mva(vaddr);
+    } else if (aspace->asid_generation == asid_generation) {
+        /* an aspace from an older generation can't have entries left,
+         * they all went away in the flush that started the current one */
+        arm_invalidate_tlb_mva_asid(vaddr, aspace->asid);
+    }
+}
+
+/* user aspaces only cover the TTBR0 range below the kernel */
+static bool arm_mmu_range_valid(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
+{
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL)
+        return true;
+
+    if (vaddr >= KERNEL_ASPACE_BASE)
+        return false;
 
-    arm_invalidate_tlb_mva(vaddr);
+    return count <= (KERNEL_ASPACE_BASE - vaddr) / PAGE_SIZE;
 }
 
 void arm_mmu_init(void)
@@ -169,13 +300,162 @@ void arm_mmu_init(void)
             DEBUG_ASSERT(IS_SECTION_ALIGNED(size));
 
             while (size > 0) {
-                arm_mmu_unmap_section(va);
+                arm_mmu_unmap_section(arm_kernel_translation_table, va);
+                arm_invalidate_tlb_mva(va);
                 va += MB;
                 size -= MB;
             }
         }
         map++;
     }
+
+    arm_vtop((vaddr_t)arm_kernel_translation_table, &arm_kernel_translation_table_phys);
+
+    arm_mmu_init_percpu();
+}
+
+void arm_mmu_init_percpu(void)
+{
+    /* hand the kernel's half of the address space to TTBR1. TTBR0 still points
+     * at the kernel table, which has nothing mapped below KERNEL_ASPACE_BASE,
+     * until a user aspace is switched in. */
+    arm_write_ttbr1(arm_kernel_translation_table_phys | MMU_TTBR_FLAGS);
+    ISB;
+    arm_write_ttbcr(TTBCR_N);
+    arm_write_contextidr(0);
+    ISB;
+}
+
+static void arm_mmu_asid_rollover_locked(void)
+{
+    asid_generation++;
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;
+
+    /* aspaces loaded on a cpu right now keep their asid into the new generation */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        arch_aspace_t *aspace = active_aspace[i];
+        if (aspace) {
+            aspace->asid_generation = asid_generation;
+            asid_map[aspace->asid / 32] |= 1U << (aspace->asid % 32);
+        }
+    }
+
+    arm_invalidate_tlb_global();
+}
+
+static void arm_mmu_asid_assign_locked(arch_aspace_t *aspace)
+{
+    for (;;) {
+        if (aspace->asid_generation == asid_generation)
+            return;
+
+        for (uint i = 0; i < countof(asid_map); i++) {
+            if (asid_map[i] != 0xffffffff) {
+                uint bit = __builtin_ctz(~asid_map[i]);
+
+                asid_map[i] |= 1U << bit;
+                aspace->asid = i * 32 + bit;
+                aspace->asid_generation = asid_generation;
+                LTRACEF("aspace %p asid %u generation %u\n", aspace, aspace->asid, asid_generation);
+                return;
+            }
+        }
+
+        arm_mmu_asid_rollover_locked();
+    }
+}
+
+status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags)
+{
+    LTRACEF("aspace %p base 0x%lx size 0x%zx flags 0x%x\n", aspace, base, size, flags);
+
+    DEBUG_ASSERT(aspace);
+
+    aspace->base = base;
+    aspace->size = size;
+    aspace->flags = flags;
+    aspace->asid = 0;
+    aspace->asid_generation = 0;
+    list_initialize(&aspace->pt_page_list);
+
+    if (flags & ARCH_ASPACE_FLAG_KERNEL) {
+        aspace->tt_virt = arm_kernel_translation_table;
+        aspace->tt_phys = arm_kernel_translation_table_phys;
+    } else {
+        if (base + size < base || base + size > KERNEL_ASPACE_BASE)
+            return ERR_INVALID_ARGS;
+
+        paddr_t pa;
+        if (pmm_alloc_contiguous(USER_TT_PAGES, USER_TT_ALIGN_LOG2, &pa, &aspace->pt_page_list) == 0)
+            return ERR_NO_MEMORY;
+
+        aspace->tt_virt = paddr_to_kvaddr(pa);
+        aspace->tt_phys = pa;
+        memset(aspace->tt_virt, 0, USER_TT_SIZE);
+    }
+
+    LTRACEF("tt_virt %p tt_phys 0x%lx\n", aspace->tt_virt, aspace->tt_phys);
+
+    return NO_ERROR;
+}
+
+status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
+{
+    LTRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+    spin_lock_saved_state_t state;
+    spin_lock_save(&asid_lock, &state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        DEBUG_ASSERT(active_aspace[i] != aspace);
+
+    /* flush whatever is left under our asid and hand it back */
+    if (aspace->asid_generation == asid_generation) {
+        arm_invalidate_tlb_asid(aspace->asid);
+        asid_map[aspace->asid / 32] &= ~(1U << (aspace->asid % 32));
+        aspace->asid_generation = 0;
+    }
+
+    spin_unlock_restore(&asid_lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the top level table and all the L2 tables */
+    pmm_free(&aspace->pt_page_list);
+
+    return NO_ERROR;
+}
+
+void arch_mmu_context_switch(arch_aspace_t *aspace)
+{
+    LTRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(!aspace || (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+    spin_lock_saved_state_t state;
+    spin_lock_save(&asid_lock, &state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint asid = 0;
+    if (aspace) {
+        arm_mmu_asid_assign_locked(aspace);
+        asid = aspace->asid;
+    }
+    active_aspace[arch_curr_cpu_num()] = aspace;
+
+    /* park TTBR0 on the kernel table while the asid changes, so no table walk
+     * can tag entries from the old table with the new asid */
+    arm_write_ttbr0(arm_kernel_translation_table_phys | MMU_TTBR_FLAGS);
+    ISB;
+    arm_write_contextidr(asid);
+    ISB;
+    if (aspace) {
+        arm_write_ttbr0(aspace->tt_phys | MMU_TTBR_FLAGS);
+        ISB;
+    }
+
+    spin_unlock_restore(&asid_lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 void arch_disable_mmu(void)
@@ -183,28 +463,33 @@ void arch_disable_mmu(void)
     arm_write_sctlr(arm_read_sctlr() & ~(1<<0)); // mmu disabled
 }
 
-status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
+status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
 {
-    //LTRACEF("vaddr 0x%lx\n", vaddr);
+    //LTRACEF("aspace %p vaddr 0x%lx\n", aspace, vaddr);
+
+    DEBUG_ASSERT(aspace);
+    if (!arm_mmu_range_valid(aspace, vaddr, 0))
+        return ERR_OUT_OF_RANGE;
 
     /* Get the index into the translation table */
     uint index = vaddr / MB;
 
     /* decode it */
-    uint32_t tt_entry = arm_kernel_translation_table[index];
+    uint32_t tt_entry = aspace->tt_virt[index];
     switch (tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) {
         case MMU_MEMORY_L1_DESCRIPTOR_INVALID:
             return ERR_NOT_FOUND;
         case MMU_MEMORY_L1_DESCRIPTOR_SECTION:
-            if (tt_entry & (1<<18)) {
-                /* supersection */
-                PANIC_UNIMPLEMENTED;
+            if (paddr) {
+                if (tt_entry & (1<<18)) {
+                    /* supersection */
+                    *paddr = MMU_MEMORY_L1_SUPERSECTION_ADDR(tt_entry) + (vaddr & (SUPERSECTION_SIZE - 1));
+                } else {
+                    /* section */
+                    *paddr = MMU_MEMORY_L1_SECTION_ADDR(tt_entry) + (vaddr & (SECTION_SIZE - 1));
+                }
             }
 
-            /* section */
-            if (paddr)
-                *paddr = MMU_MEMORY_L1_SECTION_ADDR(tt_entry) + (vaddr & (SECTION_SIZE - 1));
-
             if (flags) {
                 *flags = 0;
                 switch (tt_entry & MMU_MEMORY_L1_TYPE_MASK) {
@@ -243,38 +528,19 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
                 case MMU_MEMORY_L2_DESCRIPTOR_INVALID:
                     return ERR_NOT_FOUND;
                 case MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE:
-                    PANIC_UNIMPLEMENTED;
+                    if (paddr)
+                        *paddr = MMU_MEMORY_L2_LARGE_PAGE_ADDR(l2_entry) + (vaddr & (LARGE_PAGE_SIZE - 1));
+
+                    if (flags)
+                        *flags = l2_arch_flags_to_mmu_flags(l2_large_to_small_arch_flags(l2_entry));
                     break;
                 case MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE:
                 case MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE_XN:
                     if (paddr)
-                        *paddr = MMU_MEMORY_L2_SMALL_PAGE_ADDR(l2_entry);
-
-                    if (flags) {
-                        *flags = 0;
-                        switch (l2_entry & MMU_MEMORY_L2_TYPE_MASK) {
-                            case MMU_MEMORY_L2_TYPE_STRONGLY_ORDERED:
-                                *flags |= ARCH_MMU_FLAG_UNCACHED;
-                                break;
-                            case MMU_MEMORY_L2_TYPE_DEVICE_SHARED:
-                            case MMU_MEMORY_L2_TYPE_DEVICE_NON_SHARED:
-                                *flags |= ARCH_MMU_FLAG_UNCACHED_DEVICE;
-                                break;
-                        }
-                        switch (l2_entry & MMU_MEMORY_L2_AP_MASK) {
-                            case MMU_MEMORY_L2_AP_P_NA_U_NA:
-                                // XXX no access, what to return?
-                                break;
-                            case MMU_MEMORY_L2_AP_P_RW_U_NA:
-                                break;
-                            case MMU_MEMORY_L2_AP_P_RW_U_RO:
-                                *flags |= ARCH_MMU_FLAG_PERM_USER | ARCH_MMU_FLAG_PERM_RO; // XXX should it be rw anyway since kernel can rw it?
-                                break;
-                            case MMU_MEMORY_L2_AP_P_RW_U_RW:
-                                *flags |= ARCH_MMU_FLAG_PERM_USER;
-                                break;
-                        }
-                    }
+                        *paddr = MMU_MEMORY_L2_SMALL_PAGE_ADDR(l2_entry) + (vaddr & (PAGE_SIZE - 1));
+
+                    if (flags)
+                        *flags = l2_arch_flags_to_mmu_flags(l2_entry);
                     break;
             }
 
@@ -287,9 +553,13 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
     return NO_ERROR;
 }
 
-int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
+int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
-    LTRACEF("vaddr 0x%lx paddr 0x%lx count %u flags 0x%x\n", vaddr, paddr, count, flags);
+    LTRACEF("aspace %p vaddr 0x%lx paddr 0x%lx count %u flags 0x%x\n", aspace, vaddr, paddr, count, flags);
+
+    DEBUG_ASSERT(aspace);
+    if (!arm_mmu_range_valid(aspace, vaddr, count))
+        return ERR_OUT_OF_RANGE;
 
     /* paddr and vaddr must be aligned */
     DEBUG_ASSERT(IS_PAGE_ALIGNED(vaddr));
@@ -300,18 +570,37 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
     if (count == 0)
         return NO_ERROR;
 
+    /* everything in a user aspace is tagged with its asid */
+    uint l1_ng = 0;
+    uint l2_ng = 0;
+    if ((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0) {
+        l1_ng = MMU_MEMORY_L1_SECTION_NON_GLOBAL;
+        l2_ng = MMU_MEMORY_L2_NON_GLOBAL;
+    }
+
     /* see what kind of mapping we can use */
     int mapped = 0;
     while (count > 0) {
-        if (IS_SECTION_ALIGNED(vaddr) && IS_SECTION_ALIGNED(paddr) && count >= SECTION_SIZE / PAGE_SIZE) {
+        if (IS_SUPERSECTION_ALIGNED(vaddr) && IS_SUPERSECTION_ALIGNED(paddr) &&
+                count >= SUPERSECTION_SIZE / PAGE_SIZE && arm_mmu_has_supersections()) {
+            /* we can use a supersection, which takes a single TLB entry for 16MB */
+            uint arch_flags = mmu_flags_to_l1_arch_flags(flags) | l1_ng |
+                MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION;
+
+            arm_mmu_map_supersection(aspace->tt_virt, paddr, vaddr, arch_flags);
+            count -= SUPERSECTION_SIZE / PAGE_SIZE;
+            mapped += SUPERSECTION_SIZE / PAGE_SIZE;
+            vaddr += SUPERSECTION_SIZE;
+            paddr += SUPERSECTION_SIZE;
+        } else if (IS_SECTION_ALIGNED(vaddr) && IS_SECTION_ALIGNED(paddr) && count >= SECTION_SIZE / PAGE_SIZE) {
             /* we can use a section */
 
             /* compute the arch flags for L1 sections */
-            uint arch_flags = mmu_flags_to_l1_arch_flags(flags) |
+            uint arch_flags = mmu_flags_to_l1_arch_flags(flags) | l1_ng |
                 MMU_MEMORY_L1_DESCRIPTOR_SECTION;
 
             /* map it */
-            arm_mmu_map_section(paddr, vaddr, arch_flags);
+            arm_mmu_map_section(aspace->tt_virt, paddr, vaddr, arch_flags);
             count -= SECTION_SIZE / PAGE_SIZE;
             mapped += SECTION_SIZE / PAGE_SIZE;
             vaddr += SECTION_SIZE;
@@ -319,7 +608,7 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
         } else {
             /* will have to use a L2 mapping */
             uint l1_index = vaddr / SECTION_SIZE;
-            uint32_t tt_entry = arm_kernel_translation_table[l1_index];
+            uint32_t tt_entry = aspace->tt_virt[l1_index];
 
             LTRACEF("tt_entry 0x%x\n", tt_entry);
             switch (tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) {
@@ -329,7 +618,7 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
                     break;
                 case MMU_MEMORY_L1_DESCRIPTOR_INVALID: {
                     /* alloc and put in a L2 page table */
-                    uint32_t *l2_table = pmm_alloc_kpage();
+                    uint32_t *l2_table = pmm_alloc_kpages(1, &aspace->pt_page_list);
                     if (!l2_table) {
                         TRACEF("failed to allocate pagetable\n");
                         goto done;
@@ -349,11 +638,11 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 
                     /* put it in the adjacent 4 entries filling in 1K page tables at once */
                     l1_index = ROUNDDOWN(l1_index, 4);
-                    arm_kernel_translation_table[l1_index] = l2_pa | MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
-                    arm_kernel_translation_table[l1_index + 1] = (l2_pa + 1024) | MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
-                    arm_kernel_translation_table[l1_index + 2] = (l2_pa + 2048) |  MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
-                    arm_kernel_translation_table[l1_index + 3] = (l2_pa + 3072) |  MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
-                    tt_entry = arm_kernel_translation_table[l1_index];
+                    aspace->tt_virt[l1_index] = l2_pa | MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
+                    aspace->tt_virt[l1_index + 1] = (l2_pa + 1024) | MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
+                    aspace->tt_virt[l1_index + 2] = (l2_pa + 2048) |  MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
+                    aspace->tt_virt[l1_index + 3] = (l2_pa + 3072) |  MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
+                    tt_entry = aspace->tt_virt[vaddr / SECTION_SIZE];
 
                     /* fallthrough */
                 }
@@ -363,14 +652,30 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 
                     DEBUG_ASSERT(l2_table);
 
-                    // XXX handle 64K pages here
+                    uint l2_index = (vaddr % SECTION_SIZE) / PAGE_SIZE;
+
+                    if (IS_LARGE_PAGE_ALIGNED(vaddr) && IS_LARGE_PAGE_ALIGNED(paddr) &&
+                            count >= LARGE_PAGE_SIZE / PAGE_SIZE) {
+                        /* compute the arch flags for L2 64K pages */
+                        uint arch_flags = l2_small_to_large_arch_flags(mmu_flags_to_l2_arch_flags(flags)) | l2_ng |
+                            MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE;
+
+                        /* a large page is the same descriptor repeated in 16 consecutive entries */
+                        for (uint i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; i++)
+                            l2_table[l2_index + i] = paddr | arch_flags;
+
+                        count -= LARGE_PAGE_SIZE / PAGE_SIZE;
+                        mapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+                        vaddr += LARGE_PAGE_SIZE;
+                        paddr += LARGE_PAGE_SIZE;
+                        break;
+                    }
 
                     /* compute the arch flags for L2 4K pages */
-                    uint arch_flags = mmu_flags_to_l2_arch_flags(flags) |
+                    uint arch_flags = mmu_flags_to_l2_arch_flags(flags) | l2_ng |
                         MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE;
 
                     /* add the entry */
-                    uint l2_index = (vaddr % SECTION_SIZE) / PAGE_SIZE;
                     l2_table[l2_index] = paddr | arch_flags;
 
                     count--;
@@ -389,26 +694,47 @@ done:
     return mapped;
 }
 
-int arch_mmu_unmap(vaddr_t vaddr, uint count)
+int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 {
+    LTRACEF("aspace %p vaddr 0x%lx count %u\n", aspace, vaddr, count);
+
+    DEBUG_ASSERT(aspace);
     DEBUG_ASSERT(IS_PAGE_ALIGNED(vaddr));
     if (!IS_PAGE_ALIGNED(vaddr))
         return ERR_INVALID_ARGS;
+    if (!arm_mmu_range_valid(aspace, vaddr, count))
+        return ERR_OUT_OF_RANGE;
 
     int unmapped = 0;
     while (count > 0) {
         uint l1_index = vaddr / SECTION_SIZE;
-        uint32_t tt_entry = arm_kernel_translation_table[l1_index];
+        uint32_t tt_entry = aspace->tt_virt[l1_index];
 
         switch (tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) {
             case MMU_MEMORY_L1_DESCRIPTOR_INVALID:
                 /* this top level page is not mapped, move on to the next one */
                 goto next_page;
             case MMU_MEMORY_L1_DESCRIPTOR_SECTION:
+                if (tt_entry & (1<<18)) {
+                    /* supersection */
+                    if (IS_SUPERSECTION_ALIGNED(vaddr) && count >= SUPERSECTION_SIZE / PAGE_SIZE) {
+                        arm_mmu_unmap_supersection(aspace->tt_virt, vaddr);
+                        arm_mmu_invalidate_va(aspace, vaddr);
+
+                        vaddr += SUPERSECTION_SIZE;
+                        count -= SUPERSECTION_SIZE / PAGE_SIZE;
+                        unmapped += SUPERSECTION_SIZE / PAGE_SIZE;
+                        goto next;
+                    }
+
+                    // XXX handle unmapping just part of a supersection
+                    PANIC_UNIMPLEMENTED;
+                }
+
                 if (IS_SECTION_ALIGNED(vaddr) && count >= SECTION_SIZE / PAGE_SIZE) {
                     /* we're asked to remove at least all of this section, so just zero it out */
-                    // XXX test for supersection
-                    arm_mmu_unmap_section(vaddr);
+                    arm_mmu_unmap_section(aspace->tt_virt, vaddr);
+                    arm_mmu_invalidate_va(aspace, vaddr);
 
                     vaddr += SECTION_SIZE;
                     count -= SECTION_SIZE / PAGE_SIZE;
@@ -420,8 +746,38 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
                     PANIC_UNIMPLEMENTED;
                 }
                 break;
+            case MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE: {
+                uint32_t *l2_table = paddr_to_kvaddr(MMU_MEMORY_L1_PAGE_TABLE_ADDR(tt_entry));
+                uint l2_index = (vaddr % SECTION_SIZE) / PAGE_SIZE;
+
+                switch (l2_table[l2_index] & MMU_MEMORY_L2_DESCRIPTOR_MASK) {
+                    case MMU_MEMORY_L2_DESCRIPTOR_INVALID:
+                        goto next_page;
+                    case MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE:
+                        if (IS_LARGE_PAGE_ALIGNED(vaddr) && count >= LARGE_PAGE_SIZE / PAGE_SIZE) {
+                            for (uint i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; i++)
+                                l2_table[l2_index + i] = 0;
+                            arm_mmu_invalidate_va(aspace, vaddr);
+
+                            vaddr += LARGE_PAGE_SIZE;
+                            count -= LARGE_PAGE_SIZE / PAGE_SIZE;
+                            unmapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+                            goto next;
+                        }
+
+                        // XXX handle unmapping just part of a large page
+                        PANIC_UNIMPLEMENTED;
+                        break;
+                    default:
+                        /* small page */
+                        l2_table[l2_index] = 0;
+                        arm_mmu_invalidate_va(aspace, vaddr);
+                        unmapped++;
+                        goto next_page;
+                }
+                break;
+            }
             default:
-                // XXX not implemented supersections or L2 tables
                 PANIC_UNIMPLEMENTED;
         }
 
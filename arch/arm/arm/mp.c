@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/mp.h>
+
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <platform/interrupts.h>
+
+#if WITH_DEV_INTERRUPT_ARM_GIC
+#include <dev/interrupt/arm_gic.h>
+#else
+#error need other implementation of interrupt controller that can ipi
+#endif
+
+#define LOCAL_TRACE 0
+
+/* the top two software generated interrupts are reserved for ipis */
+#define GIC_IPI_BASE (14)
+
+/* set by the irq glue to track that a cpu is inside a handler */
+bool __arm_in_handler[SMP_MAX_CPUS];
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+	uint gic_ipi_num = ipi + GIC_IPI_BASE;
+
+	/* filter out targets outside of the range of cpus we care about */
+	target &= ((1UL << SMP_MAX_CPUS) - 1);
+	if (target != 0) {
+		LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
+		arm_gic_sgi(gic_ipi_num, 0, target);
+	}
+
+	return NO_ERROR;
+}
+
+static enum handler_return arm_ipi_generic_handler(void *arg)
+{
+	LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+	return INT_NO_RESCHEDULE;
+}
+
+static enum handler_return arm_ipi_reschedule_handler(void *arg)
+{
+	LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+	return mp_mbx_reschedule_irq();
+}
+
+void arch_mp_init_percpu(void)
+{
+	/* the handler table is shared, but the sgi enables are banked per cpu */
+	register_int_handler(MP_IPI_GENERIC + GIC_IPI_BASE, &arm_ipi_generic_handler, 0);
+	register_int_handler(MP_IPI_RESCHEDULE + GIC_IPI_BASE, &arm_ipi_reschedule_handler, 0);
+
+	unmask_interrupt(MP_IPI_GENERIC + GIC_IPI_BASE);
+	unmask_interrupt(MP_IPI_RESCHEDULE + GIC_IPI_BASE);
+}
+
+/* called from arm_irq in exceptions.S before and after platform_irq */
+void arm_irq_enter(void)
+{
+	inc_critical_section();
+	__arm_in_handler[arch_curr_cpu_num()] = true;
+}
+
+void arm_irq_exit(enum handler_return ret)
+{
+	__arm_in_handler[arch_curr_cpu_num()] = false;
+
+	/* reschedule if the handler returns nonzero. we may come back on another cpu */
+	if (ret != INT_NO_RESCHEDULE)
+		thread_preempt();
+
+	dec_critical_section();
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
@@ -26,6 +26,9 @@
 #include <debug.h>
 #include <kernel/thread.h>
 #include <arch/arm.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 struct context_switch_frame {
 	vaddr_t r4;
@@ -90,6 +93,13 @@ void arch_context_switch(thread_t *oldthread, thread_t *newthread)
     arm_fpu_thread_swap(oldthread, newthread);
 #endif
 
+#if WITH_KERNEL_VM
+	/* user mappings are tagged with an asid, so this is just a TTBR0 and
+	 * CONTEXTIDR update and leaves the tlb alone */
+	if (oldthread->aspace != newthread->aspace)
+		vmm_context_switch(oldthread->aspace, newthread->aspace);
+#endif
+
 	arm_context_switch(&oldthread->arch.sp, newthread->arch.sp);
 
 }
@@ -84,12 +84,28 @@ static inline bool arch_fiqs_disabled(void)
 	return !!state;
 }
 
+static inline uint arch_curr_cpu_num(void)
+{
+#if WITH_SMP
+	/* on the cortex-a9 mpcore the cpu number is the low byte of the affinity */
+	return arm_read_mpidr() & 0xff;
+#else
+	return 0;
+#endif
+}
+
 static inline bool arch_in_int_handler(void)
 {
 	/* set by the interrupt glue to track that the cpu is inside a handler */
+#if WITH_SMP
+	extern bool __arm_in_handler[SMP_MAX_CPUS];
+
+	return __arm_in_handler[arch_curr_cpu_num()];
+#else
 	extern bool __arm_in_handler;
 
 	return __arm_in_handler;
+#endif
 }
 
 static inline int atomic_add(volatile int *ptr, int val)
@@ -52,6 +52,12 @@ void arm_context_switch(vaddr_t *old_sp, vaddr_t new_sp);
 
 void arm_chain_load(paddr_t entry) __NO_RETURN;
 
+#if WITH_SMP
+/* secondary cpu bring up, see start.S */
+void arm_enable_local_cache(void);
+void arm_secondary_entry(uint asm_cpu_num) __NO_RETURN;
+#endif
+
 static inline uint32_t read_cpsr(void)
 {
 	uint32_t cpsr;
@@ -144,6 +150,8 @@ GEN_CP15_REG_FUNCS(tpidrprw, 0, c13, c0, 4);
 /* armv7+ */
 GEN_CP15_REG_FUNCS(midr, 0, c0, c0, 0);
 GEN_CP15_REG_FUNCS(mpidr, 0, c0, c0, 5);
+GEN_CP15_REG_FUNCS(id_mmfr3, 0, c0, c1, 7);
+GEN_CP15_REG_FUNCS(id_isar5, 0, c0, c2, 5);
 GEN_CP15_REG_FUNCS(vbar, 0, c12, c0, 0);
 
 GEN_CP15_REG_FUNCS(ats1cpr, 0, c7, c8, 0);
@@ -27,6 +27,7 @@
 #define MB                (1024U*1024U)
 #define SECTION_SIZE      MB
 #define SUPERSECTION_SIZE (16 * MB)
+#define LARGE_PAGE_SIZE   (64 * 1024U)
 
 #if defined(ARM_ISA_ARMV6) | defined(ARM_ISA_ARMV7)
 
@@ -114,6 +115,8 @@
 
 #define MMU_MEMORY_L2_CB_SHIFT              2
 #define MMU_MEMORY_L2_TEX_SHIFT             6
+#define MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT  12
+#define MMU_MEMORY_L2_TEX_MASK              (0x7 << MMU_MEMORY_L2_TEX_SHIFT)
 
 #define MMU_MEMORY_NON_CACHEABLE            0
 #define MMU_MEMORY_WRITE_BACK_ALLOCATE      1
@@ -125,12 +128,14 @@
 #define MMU_MEMORY_SET_L2_CACHEABLE_MEM     (0x4 << MMU_MEMORY_L2_TEX_SHIFT)
 
 #define MMU_MEMORY_L1_SECTION_ADDR(x)       ((x) & ~((1<<20)-1))
+#define MMU_MEMORY_L1_SUPERSECTION_ADDR(x)  ((x) & ~((1<<24)-1))
 #define MMU_MEMORY_L1_PAGE_TABLE_ADDR(x)    ((x) & ~((1<<10)-1))
 
 #define MMU_MEMORY_L2_SMALL_PAGE_ADDR(x)    ((x) & ~((1<<12)-1))
 #define MMU_MEMORY_L2_LARGE_PAGE_ADDR(x)    ((x) & ~((1<<16)-1))
 
 #define MMU_MEMORY_TTBR_RGN(x)              (((x) & 0x3) << 3)
+#define MMU_MEMORY_TTBR_S                   (1 << 1)
 /* IRGN[1:0] is encoded as: IRGN[0] in TTBRx[6], and IRGN[1] in TTBRx[0] */
 #define MMU_MEMORY_TTBR_IRGN(x)             ((((x) & 0x1) << 6) | \
                                             ((((x) >> 1) & 0x1) << 0))
@@ -147,13 +152,26 @@
     (MMU_MEMORY_TTBR_RGN(MMU_MEMORY_WRITE_BACK_ALLOCATE) |\
      MMU_MEMORY_TTBR_IRGN(MMU_MEMORY_WRITE_BACK_ALLOCATE))
 
+/* Table walks are shareable on smp, matching what start.S loads into TTBR0 */
+#if WITH_SMP
+#define MMU_TTBR_FLAGS (MMU_TTBRx_FLAGS | MMU_MEMORY_TTBR_S)
+#else
+#define MMU_TTBR_FLAGS MMU_TTBRx_FLAGS
+#endif
+
 /* Section mapping, TEX[2:0]=001, CB=11, S=1, AP[2:0]=001 */
+#if WITH_SMP
+#define MMU_KERNEL_L1_PTE_FLAGS \
+    (MMU_MEMORY_L1_DESCRIPTOR_SECTION | \
+     MMU_MEMORY_L1_TYPE_NORMAL_WRITE_BACK_ALLOCATE | \
+     MMU_MEMORY_L1_AP_P_RW_U_NA | \
+     MMU_MEMORY_L1_SECTION_SHAREABLE)
+#else
 #define MMU_KERNEL_L1_PTE_FLAGS \
     (MMU_MEMORY_L1_DESCRIPTOR_SECTION | \
      MMU_MEMORY_L1_TYPE_NORMAL_WRITE_BACK_ALLOCATE | \
      MMU_MEMORY_L1_AP_P_RW_U_NA)
-/* XXX add with smp to above */
-//     MMU_MEMORY_L1_SECTION_SHAREABLE |
+#endif
 
 #define MMU_INITIAL_MAP_STRONGLY_ORDERED \
     (MMU_MEMORY_L1_DESCRIPTOR_SECTION | \
@@ -177,24 +195,47 @@
 __BEGIN_CDECLS
 
 void arm_mmu_init(void);
+void arm_mmu_init_percpu(void);
 status_t arm_vtop(addr_t va, addr_t *pa);
 
-/* tlb routines */
+/* tlb routines, broadcast to the inner shareable domain on smp */
 static inline void arm_invalidate_tlb_global(void) {
     CF;
+#if WITH_SMP
+    arm_write_tlbiallis(0);
+#else
     arm_write_tlbiall(0);
+#endif
     DSB;
 }
 
 static inline void arm_invalidate_tlb_mva(vaddr_t va) {
     CF;
+#if WITH_SMP
+    arm_write_tlbimvais(va & 0xfffff000);
+#else
     arm_write_tlbimva(va & 0xfffff000);
+#endif
+    DSB;
+}
+
+static inline void arm_invalidate_tlb_mva_asid(vaddr_t va, uint8_t asid) {
+    CF;
+#if WITH_SMP
+    arm_write_tlbimvais((va & 0xfffff000) | asid);
+#else
+    arm_write_tlbimva((va & 0xfffff000) | asid);
+#endif
     DSB;
 }
 
 static inline void arm_invalidate_tlb_asid(uint8_t asid) {
     CF;
+#if WITH_SMP
+    arm_write_tlbiasidis(asid);
+#else
     arm_write_tlbiasid(asid);
+#endif
     DSB;
 }
 
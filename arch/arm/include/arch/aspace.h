@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+struct arch_aspace {
+    /* L1 translation table, covers the whole 4GB for the kernel aspace
+     * and only the TTBR0 range below KERNEL_ASPACE_BASE for user ones */
+    uint32_t *tt_virt;
+    paddr_t tt_phys;
+
+    vaddr_t base;
+    size_t size;
+    uint flags;
+
+    /* hardware asid tagging this aspace's non global tlb entries, valid
+     * only while asid_generation matches the allocator's */
+    uint asid;
+    uint asid_generation;
+
+    /* pages holding the translation tables */
+    struct list_node pt_page_list;
+};
+
+__END_CDECLS
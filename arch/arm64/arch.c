@@ -24,10 +24,45 @@
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm64.h>
+#include <arch/cpu_features.h>
+#include <bits.h>
 #include <platform.h>
 
+static uint32_t cpu_features;
+
+static void arm64_cpu_features_init(void)
+{
+    uint64_t pfr0 = ARM64_READ_SYSREG(id_aa64pfr0_el1);
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    /* fp and advsimd read as 0xf when not implemented */
+    if (BITS_SHIFT(pfr0, 19, 16) != 0xf)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_FPU);
+    if (BITS_SHIFT(pfr0, 23, 20) != 0xf)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SIMD);
+
+    /* aes is 1 for the aes instructions, 2 if pmull is there as well */
+    if (BITS_SHIFT(isar0, 7, 4) >= 1)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_AES);
+    if (BITS_SHIFT(isar0, 7, 4) >= 2)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_PMULL);
+    if (BITS_SHIFT(isar0, 11, 8) >= 1)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SHA1);
+    if (BITS_SHIFT(isar0, 15, 12) >= 1)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SHA2);
+    if (BITS_SHIFT(isar0, 19, 16) >= 1)
+        cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_CRC32);
+}
+
+uint32_t arch_cpu_features(void)
+{
+    return cpu_features;
+}
+
 void arch_early_init(void)
 {
+    arm64_cpu_features_init();
+
     /* set the vector base */
     ARM64_WRITE_SYSREG(VBAR_EL1, (uint64_t)&arm64_exception_base);
 
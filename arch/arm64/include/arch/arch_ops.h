@@ -197,6 +197,15 @@ static inline uint32_t arch_cycle_count(void)
 #endif
 }
 
+static inline uint arch_curr_cpu_num(void)
+{
+#if WITH_SMP
+    return ARM64_READ_SYSREG(mpidr_el1) & 0xff;
+#else
+    return 0;
+#endif
+}
+
 /* use the cpu local thread context pointer to store current_thread */
 static inline struct thread *get_current_thread(void)
 {
@@ -23,6 +23,7 @@
 #include <debug.h>
 #include <arch.h>
 #include <arch/ops.h>
+#include <arch/cpu_features.h>
 #include <arch/x86.h>
 #include <arch/x86/mmu.h>
 #include <arch/x86/descriptor.h>
@@ -31,9 +32,58 @@
 #include <string.h>
 
 static tss_t system_tss;
+static uint32_t cpu_features;
+
+static void x86_cpu_features_init(void)
+{
+	uint32_t max_leaf, a, b, c, d;
+	uint32_t ecx1, edx1, ebx7 = 0;
+
+	cpuid(0, 0, &max_leaf, &b, &c, &d);
+	if (max_leaf < 1)
+		return;
+
+	cpuid(1, 0, &a, &b, &ecx1, &edx1);
+	if (max_leaf >= 7)
+		cpuid(7, 0, &a, &ebx7, &c, &d);
+
+	/* these only use the general purpose registers */
+	if (ebx7 & (1 << 9))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_ERMS);
+	if (ecx1 & (1 << 20))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_CRC32);
+
+	/* the rest need the fpu and sse state, which is only ours to use if
+	 * it has been turned on */
+	if (!(x86_get_cr4() & X86_CR4_OSFXSR))
+		return;
+
+	if (edx1 & (1 << 0))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_FPU);
+	if (edx1 & (1 << 26))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SIMD);
+	if (ecx1 & (1 << 1))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_PMULL);
+	if (ecx1 & (1 << 25))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_AES);
+	if (ebx7 & (1 << 29))
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_SHA1) | CPU_FEATURE_BIT(CPU_FEATURE_SHA2);
+
+	/* avx also needs the ymm state enabled in xcr0 */
+	if ((ebx7 & (1 << 5)) && (ecx1 & (1 << 27)) && (x86_get_cr4() & X86_CR4_OSXSAVE) &&
+	        (x86_xgetbv(0) & 0x6) == 0x6)
+		cpu_features |= CPU_FEATURE_BIT(CPU_FEATURE_AVX2);
+}
+
+uint32_t arch_cpu_features(void)
+{
+	return cpu_features;
+}
 
 void arch_early_init(void)
 {
+	x86_cpu_features_init();
+
 	x86_mmu_init();
 
 	platform_init_mmu_mappings();
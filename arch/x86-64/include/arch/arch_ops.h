@@ -97,6 +97,12 @@ static inline uint32_t arch_cycle_count(void)
 	return timestamp;
 }
 
+/* only the boot cpu is brought up */
+static inline uint arch_curr_cpu_num(void)
+{
+	return 0;
+}
+
 /* use a global pointer to store the current_thread */
 extern struct thread *_current_thread;
 
@@ -77,6 +77,9 @@ typedef struct {
 #define X86_CR0_CD      0x40000000 /* cache disable */
 #define X86_CR0_PG      0x80000000 /* enable paging */
 
+#define X86_CR4_OSFXSR  0x00000200 /* os supports fxsave/fxrstor and sse */
+#define X86_CR4_OSXSAVE 0x00040000 /* os supports xsave and xcr0 */
+
 static inline void set_in_cr0(uint32_t mask)
 {
 	__asm__ __volatile__ (
@@ -118,6 +121,42 @@ static inline uint32_t x86_get_cr2(void)
 	return rv;
 }
 
+static inline uint32_t x86_get_cr4(void)
+{
+	uint32_t rv;
+
+	__asm__ __volatile__ (
+	    "movl %%cr4, %0"
+	    : "=r" (rv)
+	);
+
+	return rv;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ (
+	    "cpuid"
+	    : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+	    : "a" (leaf), "c" (subleaf)
+	);
+}
+
+/* only valid once cpuid reports osxsave */
+static inline uint64_t x86_xgetbv(uint32_t index)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__ (
+	    "xgetbv"
+	    : "=a" (low), "=d" (high)
+	    : "c" (index)
+	);
+
+	return ((uint64_t)high << 32) | low;
+}
+
 #define rdtsc(low,high) \
      __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high))
 
@@ -70,7 +70,6 @@ static platform_timer_callback t_callback;
 static addr_t scu_control_base;
 
 static lk_time_t periodic_interval;
-static lk_time_t oneshot_interval;
 static uint32_t timer_freq;
 static uint32_t timer_freq_usec_conversion;
 static uint32_t timer_freq_msec_conversion;
@@ -106,6 +105,15 @@ lk_time_t current_time(void)
     return time;
 }
 
+lk_time_ns_t current_time_ns(void)
+{
+    uint64_t ticks = get_global_val();
+
+    /* split the conversion to keep the multiply from overflowing */
+    return (ticks / timer_freq_usec_conversion) * 1000 +
+           ((ticks % timer_freq_usec_conversion) * 1000) / timer_freq_usec_conversion;
+}
+
 status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
 {
     LTRACEF("callback %p, arg %p, interval %lu\n", callback, arg, interval);
@@ -131,17 +139,32 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval)
 {
-    LTRACEF("callback %p, arg %p, timeout %lu\n", callback, arg, interval);
+    return platform_set_oneshot_timer_ns(callback, arg, (lk_time_ns_t)interval * 1000000);
+}
+
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval)
+{
+    LTRACEF("callback %p, arg %p, timeout %llu ns\n", callback, arg, interval);
+
+    /* the private timer runs off the same clock as the global timer */
+    uint64_t ticks = interval / 1000 * timer_freq_usec_conversion +
+                     (interval % 1000) * timer_freq_usec_conversion / 1000;
+
+    /* the load register is only 32 bits, if the deadline is further out than
+     * that the timer code will just see nothing has expired and rearm */
+    if (ticks > UINT32_MAX)
+        ticks = UINT32_MAX;
+    else if (ticks == 0)
+        ticks = 1;
 
     enter_critical_section();
 
     t_callback = callback;
-    oneshot_interval = interval;
 
     // disable timer
     TIMREG(TIMER_CONTROL) = 0;
 
-    TIMREG(TIMER_LOAD) = ((uint64_t)timer_freq_msec_conversion * interval);
+    TIMREG(TIMER_LOAD) = ticks;
     TIMREG(TIMER_CONTROL) = (1<<2) | (1<<0) | (1<<0); // irq enable, oneshot, enable
 
     unmask_interrupt(CPU_PRIV_TIMER_INT);
@@ -38,6 +38,8 @@ static platform_timer_callback t_callback;
 struct fp_32_64 cntpct_per_ms;
 struct fp_32_64 ms_per_cntpct;
 struct fp_32_64 us_per_cntpct;
+struct fp_32_64 cntpct_per_ns;
+struct fp_32_64 ns_per_cntpct;
 
 static uint64_t lk_time_to_cntpct(lk_time_t lk_time)
 {
@@ -54,6 +56,16 @@ static lk_bigtime_t cntpct_to_lk_bigtime(uint64_t cntpct)
 	return u64_mul_u64_fp32_64(cntpct, us_per_cntpct);
 }
 
+static uint64_t lk_time_ns_to_cntpct(lk_time_ns_t lk_time_ns)
+{
+	return u64_mul_u64_fp32_64(lk_time_ns, cntpct_per_ns);
+}
+
+static lk_time_ns_t cntpct_to_lk_time_ns(uint64_t cntpct)
+{
+	return u64_mul_u64_fp32_64(cntpct, ns_per_cntpct);
+}
+
 static uint32_t read_cntfrq(void)
 {
 	uint32_t cntfrq;
@@ -108,18 +120,29 @@ static enum handler_return platform_tick(void *arg)
 	}
 }
 
-status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+static void arm_generic_timer_set_oneshot(platform_timer_callback callback, uint64_t cntpct_interval)
 {
-	uint64_t cntpct_interval = lk_time_to_cntpct(interval);
-
-	ASSERT(arg == NULL);
-
 	t_callback = callback;
 	if (cntpct_interval <= INT_MAX)
 		write_cntp_tval(cntpct_interval);
 	else
 		write_cntp_cval(read_cntpct() + cntpct_interval);
 	write_cntp_ctl(1);
+}
+
+status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+	ASSERT(arg == NULL);
+
+	arm_generic_timer_set_oneshot(callback, lk_time_to_cntpct(interval));
+	return 0;
+}
+
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval)
+{
+	ASSERT(arg == NULL);
+
+	arm_generic_timer_set_oneshot(callback, lk_time_ns_to_cntpct(interval));
 	return 0;
 }
 
@@ -138,6 +161,11 @@ lk_time_t current_time(void)
 	return cntpct_to_lk_time(read_cntpct());
 }
 
+lk_time_ns_t current_time_ns(void)
+{
+	return cntpct_to_lk_time_ns(read_cntpct());
+}
+
 void arm_generic_timer_init_secondary_cpu(void)
 {
 }
@@ -226,6 +254,8 @@ static void arm_generic_timer_init_conversion_factors(uint32_t cntfrq)
 	fp_32_64_div_32_32(&cntpct_per_ms, cntfrq, 1000);
 	fp_32_64_div_32_32(&ms_per_cntpct, 1000, cntfrq);
 	fp_32_64_div_32_32(&us_per_cntpct, 1000 * 1000, cntfrq);
+	fp_32_64_div_32_32(&cntpct_per_ns, cntfrq, 1000 * 1000 * 1000);
+	fp_32_64_div_32_32(&ns_per_cntpct, 1000 * 1000 * 1000, cntfrq);
 	LTRACEF("cntpct_per_ms: %08x.%08x%08x\n", cntpct_per_ms.l0, cntpct_per_ms.l32, cntpct_per_ms.l64);
 	LTRACEF("ms_per_cntpct: %08x.%08x%08x\n", ms_per_cntpct.l0, ms_per_cntpct.l32, ms_per_cntpct.l64);
 	LTRACEF("us_per_cntpct: %08x.%08x%08x\n", us_per_cntpct.l0, us_per_cntpct.l32, us_per_cntpct.l64);
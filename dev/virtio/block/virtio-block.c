@@ -28,12 +28,18 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <malloc.h>
+#include <arch/defines.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/vm.h>
+#include <kernel/dma.h>
 
 #define LOCAL_TRACE 0
 
+/* most buffers a read can be scattered across before it gets bounced */
+#define VIRTIO_BLK_MAX_SEGMENTS 16
+
 struct virtio_blk_config {
     uint64_t capacity;
     uint32_t size_max;
@@ -69,6 +75,18 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+/* per device state. the request header and the status byte the device
+ * writes back each get a cache line of their own in memory set aside at
+ * init, so a read only has to map the caller's buffer */
+struct virtio_block_dev {
+    struct virtio_blk_req *blk_req;
+    volatile uint8_t *blk_response;
+    paddr_t blk_req_pa;
+    paddr_t blk_response_pa;
+};
+
+#define VIRTIO_BLK_HDR_SIZE     (2 * CACHE_LINE)
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 
 static event_t *curr_event;
@@ -84,6 +102,28 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     LTRACEF("seg_max  0x%x\n", config->seg_max);
     LTRACEF("blk_size 0x%x\n", config->blk_size);
 
+    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    if (!bdev)
+        return ERR_NO_MEMORY;
+
+    paddr_t pa;
+#if WITH_KERNEL_VM
+    uint8_t *hdr = dma_alloc_coherent(VIRTIO_BLK_HDR_SIZE, &pa);
+#else
+    uint8_t *hdr = memalign(CACHE_LINE, VIRTIO_BLK_HDR_SIZE);
+    pa = (paddr_t)hdr;
+#endif
+    if (!hdr) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+
+    bdev->blk_req = (struct virtio_blk_req *)hdr;
+    bdev->blk_req_pa = pa;
+    bdev->blk_response = hdr + CACHE_LINE;
+    bdev->blk_response_pa = pa + CACHE_LINE;
+    dev->priv = bdev;
+
     /* allocate a virtio ring */
     virtio_alloc_ring(dev, 0, 128);
 
@@ -127,58 +167,61 @@ ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, si
 {
     uint16_t i;
     struct vring_desc *desc;
-    paddr_t pa;
 
     LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
+    struct virtio_block_dev *bdev = dev->priv;
+
     /* set up the request */
-    struct virtio_blk_req blk_req;
-    blk_req.type = VIRTIO_BLK_T_IN;
-    blk_req.ioprio = 0;
-    blk_req.sector = offset / 512;
+    bdev->blk_req->type = VIRTIO_BLK_T_IN;
+    bdev->blk_req->ioprio = 0;
+    bdev->blk_req->sector = offset / 512;
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+#if WITH_KERNEL_VM
+    /* the request and response are already where the device can see them,
+     * buf goes straight through if it is cache line aligned */
+    dma_segment_t buf_segs[VIRTIO_BLK_MAX_SEGMENTS];
+    dma_map_t buf_map;
+    ssize_t err;
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    err = dma_map_buf(&buf_map, buf, len, DMA_FROM_DEVICE, buf_segs, countof(buf_segs));
+    if (err < 0)
+        return err;
 
-    /* set up the descriptor pointing to the head */
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_req, &pa, NULL);
-    desc->addr = (uint64_t)pa;
+    uint buf_seg_count = buf_map.segment_count;
 #else
-    desc->addr = (uint64_t)(uintptr_t)&blk_req;
+    dma_segment_t buf_segs[1] = { { (paddr_t)buf, len } };
+    uint buf_seg_count = 1;
 #endif
-    desc->len = sizeof(blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-    virtio_dump_desc(desc);
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+    /* put together a transfer */
+    desc = virtio_alloc_desc_chain(dev, 0, 2 + buf_seg_count, &i);
+    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
 #if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)buf, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
+    if (!desc) {
+        dma_unmap_buf(&buf_map);
+        return ERR_NO_MEMORY;
+    }
 #endif
-    desc->len = len;
-    desc->flags |= VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+
+    /* set up the descriptor pointing to the head */
+    desc->addr = (uint64_t)bdev->blk_req_pa;
+    desc->len = sizeof(struct virtio_blk_req);
+    desc->flags |= VRING_DESC_F_NEXT;
     virtio_dump_desc(desc);
 
+    /* set up the descriptors pointing to the buffer */
+    for (uint seg = 0; seg < buf_seg_count; seg++) {
+        desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+        desc->addr = (uint64_t)buf_segs[seg].paddr;
+        desc->len = buf_segs[seg].len;
+        desc->flags |= VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+        virtio_dump_desc(desc);
+    }
+
     /* set up the descriptor pointing to the response */
-    uint8_t blk_response;
     desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_response, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)&blk_response;
-#endif
+    desc->addr = (uint64_t)bdev->blk_response_pa;
     desc->len = 1;
     desc->flags = VRING_DESC_F_WRITE;
     virtio_dump_desc(desc);
@@ -197,7 +240,11 @@ ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, si
     /* wait for the transfer to complete */
     event_wait(&event);
 
-    LTRACEF("status 0x%hhx\n", blk_response);
+#if WITH_KERNEL_VM
+    dma_unmap_buf(&buf_map);
+#endif
+
+    LTRACEF("status 0x%hhx\n", *bdev->blk_response);
 
     return len;
 }
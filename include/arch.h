@@ -33,6 +33,9 @@ void arch_init(void);
 void arch_quiesce(void);
 void arch_chain_load(void *entry) __NO_RETURN;
 
+/* called from arch code on each secondary cpu once it is ready to schedule threads */
+void lk_secondary_cpu_entry(void) __NO_RETURN;
+
 __END_CDECLS
 
 /* arch specific bits */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <lk/init.h>
+
+__BEGIN_CDECLS
+
+/* Optional cpu features, as far as the kernel can actually use them. A
+ * feature that depends on register state the kernel never enables, like the
+ * SSE and AVX state on x86, isn't reported even if the cpu has it.
+ */
+enum cpu_feature {
+    CPU_FEATURE_FPU,        /* hardware floating point */
+    CPU_FEATURE_SIMD,       /* NEON/AdvSIMD, SSE2 */
+    CPU_FEATURE_ERMS,       /* x86 enhanced rep movsb/stosb */
+    CPU_FEATURE_AVX2,
+    CPU_FEATURE_CRC32,      /* ARMv8 crc32, x86 SSE4.2 crc32 */
+    CPU_FEATURE_PMULL,      /* carry-less multiply: ARMv8 pmull, x86 pclmulqdq */
+    CPU_FEATURE_AES,
+    CPU_FEATURE_SHA1,
+    CPU_FEATURE_SHA2,
+};
+
+#define CPU_FEATURE_BIT(f) (1u << (f))
+
+/* bitmap of CPU_FEATURE_BIT()s, probed on the boot cpu by arch_early_init().
+ * Reads as 0 before then. */
+uint32_t arch_cpu_features(void);
+
+static inline bool arch_cpu_has_feature(enum cpu_feature f)
+{
+    return arch_cpu_features() & CPU_FEATURE_BIT(f);
+}
+
+/* Point _ptr at the implementation _resolver picks for the features of this
+ * cpu. The binding happens once, right after arch_early_init() and before
+ * the heap or any other thread is up, so _ptr is never seen changing. _ptr
+ * must be statically initialized to a generic version that works anywhere,
+ * for anything called earlier than that.
+ *
+ * typedef uint32_t (*foo_func)(uint32_t);
+ * static foo_func foo_impl = foo_generic;
+ *
+ * static foo_func foo_resolve(uint32_t features)
+ * {
+ *     return (features & CPU_FEATURE_BIT(CPU_FEATURE_CRC32)) ? foo_crc : foo_generic;
+ * }
+ * CPU_DISPATCH(foo, foo_impl, foo_resolve);
+ */
+#define CPU_DISPATCH(_name, _ptr, _resolver) \
+    static void _cpu_dispatch_##_name(uint level) \
+    { \
+        _ptr = _resolver(arch_cpu_features()); \
+    } \
+    LK_INIT_HOOK(cpu_dispatch_##_name, _cpu_dispatch_##_name, LK_INIT_LEVEL_ARCH_EARLY)
+
+__END_CDECLS
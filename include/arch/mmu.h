@@ -37,9 +37,21 @@ __BEGIN_CDECLS
 #define ARCH_MMU_FLAG_PERM_RO           (1<<3)
 #define ARCH_MMU_FLAG_PERM_NO_EXECUTE   (1<<4) /* applicable for x86 Arches */
 
-int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags);
-int arch_mmu_unmap(vaddr_t vaddr, uint count);
-status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags);
+/* per address space arch state, defined by the arch in <arch/aspace.h> */
+typedef struct arch_aspace arch_aspace_t;
+
+#define ARCH_ASPACE_FLAG_KERNEL         (1<<0)
+
+status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags);
+status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace);
+
+int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags);
+int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count);
+status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags);
+
+/* load the translation tables of the passed address space on the current cpu.
+ * NULL switches back to the kernel only mappings. */
+void arch_mmu_context_switch(arch_aspace_t *aspace);
 
 void arch_disable_mmu(void);
 
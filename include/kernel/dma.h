@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <compiler.h>
+#include <list.h>
+
+__BEGIN_CDECLS
+
+/* a physically contiguous piece of a buffer, as the device sees it */
+typedef struct dma_segment {
+    paddr_t paddr;
+    size_t len;
+} dma_segment_t;
+
+/* which way the data moves */
+#define DMA_TO_DEVICE     0x1
+#define DMA_FROM_DEVICE   0x2
+#define DMA_BIDIRECTIONAL (DMA_TO_DEVICE | DMA_FROM_DEVICE)
+
+/* state of a buffer handed over to a device */
+typedef struct dma_map {
+    void *buf;
+    size_t len;
+    uint dir;
+
+    /* contiguous copy the transfer goes through instead of buf, if any */
+    void *bounce;
+    struct list_node bounce_pages;
+
+    uint segment_count;
+    dma_segment_t *segments;
+} dma_map_t;
+
+/* allocate uncached, physically contiguous memory for descriptor rings and
+ * the like. the physical address is returned in *pa. */
+void *dma_alloc_coherent(size_t size, paddr_t *pa) __NONNULL((2));
+void dma_free_coherent(void *ptr);
+
+/* hand len bytes at buf over to a device, filling out up to max_segments
+ * physical segments for it. buf may be any mapped kernel buffer, or one in the
+ * current thread's address space. it is copied through a contiguous bounce
+ * buffer if it takes more than max_segments, or if the device writes to it
+ * and it shares a cache line with something else.
+ * The cpu must not touch buf until dma_unmap_buf is called.
+ */
+status_t dma_map_buf(dma_map_t *map, void *buf, size_t len, uint dir, dma_segment_t *segments, uint max_segments)
+    __NONNULL((1, 2, 5));
+
+/* take a buffer back from the device once the transfer is done */
+void dma_unmap_buf(dma_map_t *map) __NONNULL((1));
+
+__END_CDECLS
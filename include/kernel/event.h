@@ -65,6 +65,7 @@ typedef struct event {
 void event_init(event_t *, bool initial, uint flags);
 void event_destroy(event_t *);
 status_t event_wait_timeout(event_t *, lk_time_t); /* wait on the event with a timeout */
+status_t event_wait_timeout_ns(event_t *, lk_time_ns_t); /* same, with the timeout in ns */
 status_t event_signal(event_t *, bool reschedule);
 status_t event_unsignal(event_t *);
 
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_MP_H
+#define __KERNEL_MP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+typedef uint32_t mp_cpu_mask_t;
+
+#define MP_CPU_ALL_BUT_LOCAL (UINT32_MAX)
+
+/* inter processor interrupts */
+typedef enum {
+	MP_IPI_GENERIC,
+	MP_IPI_RESCHEDULE,
+} mp_ipi_t;
+
+void mp_init(void);
+
+/* poke the cpus in the mask to run the scheduler */
+void mp_reschedule(mp_cpu_mask_t target);
+
+/* mark the calling cpu as available to the scheduler */
+void mp_set_curr_cpu_active(bool active);
+
+/* called from the arch ipi handler when a reschedule ipi arrives */
+enum handler_return mp_mbx_reschedule_irq(void);
+
+/* global mp state to track what the cpus are up to */
+struct mp_state {
+	volatile mp_cpu_mask_t active_cpus;
+
+	/* only safely accessible with the thread lock held */
+	mp_cpu_mask_t idle_cpus;
+};
+
+extern struct mp_state mp;
+
+static inline mp_cpu_mask_t mp_get_active_mask(void)
+{
+	return mp.active_cpus;
+}
+
+static inline mp_cpu_mask_t mp_get_idle_mask(void)
+{
+	return mp.idle_cpus;
+}
+
+static inline void mp_set_cpu_idle(uint cpu)
+{
+	mp.idle_cpus |= 1UL << cpu;
+}
+
+static inline void mp_set_cpu_busy(uint cpu)
+{
+	mp.idle_cpus &= ~(1UL << cpu);
+}
+
+__END_CDECLS
+
+#endif
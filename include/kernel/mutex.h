@@ -30,38 +30,57 @@
 
 #define MUTEX_MAGIC 'mutx'
 
+/* set in the holder word when there are threads queued on the mutex, forcing
+ * the release through the slow path so the mutex can be handed over */
+#define MUTEX_FLAG_CONTENDED 0x1
+
 typedef struct mutex {
 	uint32_t magic;
-	thread_t *holder;
-	int count;
+	volatile uintptr_t val; /* holding thread_t pointer | MUTEX_FLAG_CONTENDED, 0 if free */
 	wait_queue_t wait;
+	struct list_node held_node; /* in the holder's held_mutexes list */
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
 { \
 	.magic = MUTEX_MAGIC, \
-	.holder = NULL, \
-	.count = 0, \
+	.val = 0, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+	.held_node = LIST_INITIAL_CLEARED_VALUE, \
 }
 
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - Waiters are woken highest priority first, and the holder inherits the
+ *   priority of its most important waiter, transitively through any mutex
+ *   the holder is itself blocked on.
+ * - An uncontended acquire or release is a single compare and swap, where the
+ *   architecture has one. Only contention goes through the wait queue.
 */
 
 void mutex_init(mutex_t *);
 void mutex_destroy(mutex_t *);
 status_t mutex_acquire_timeout(mutex_t *, lk_time_t); /* try to acquire the mutex with a timeout value */
+status_t mutex_acquire_timeout_ns(mutex_t *, lk_time_ns_t); /* same, with the timeout in ns */
 status_t mutex_release(mutex_t *);
 
 static inline status_t mutex_acquire(mutex_t *m) {
 	return mutex_acquire_timeout(m, INFINITE_TIME);
 }
 
+/* highest priority of any thread waiting on a mutex held by t, -1 if none.
+ * for use by the scheduler, must be called in a critical section */
+int mutex_inherited_priority(thread_t *t);
+
+/* the thread holding the mutex, or NULL */
+static inline thread_t *mutex_holder(const mutex_t *m) {
+	return (thread_t *)(m->val & ~(uintptr_t)MUTEX_FLAG_CONTENDED);
+}
+
 /* does the current thread hold the mutex? */
 static bool is_mutex_held(mutex_t *m) {
-	return m->holder == get_current_thread();
+	return mutex_holder(m) == get_current_thread();
 }
 
 #endif
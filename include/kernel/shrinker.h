@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_SHRINKER_H
+#define __KERNEL_SHRINKER_H
+
+#include <sys/types.h>
+#include <list.h>
+
+/* A shrinker is a hook a subsystem sitting on memory it could do without,
+ * like a cache, registers so the pmm and the heap can ask for some of it
+ * back before failing an allocation.
+ */
+typedef struct shrinker {
+	struct list_node node;
+	const char *name;
+
+	/* rough number of bytes shrink() could give back right now */
+	size_t (*count)(struct shrinker *);
+
+	/* give back around target bytes, returns how many were given back */
+	size_t (*shrink)(struct shrinker *, size_t target);
+
+	void *arg;
+} shrinker_t;
+
+#define SHRINKER_INITIAL_VALUE(s, _name, _count, _shrink, _arg) \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.name = _name, \
+	.count = _count, \
+	.shrink = _shrink, \
+	.arg = _arg, \
+}
+
+/* Rules for Shrinkers:
+ * - Shrinkers are called in thread context, from whatever thread ran out of
+ *   memory, possibly with arbitrary locks held. A shrinker must not allocate
+ *   memory or block on a lock that may be held around an allocation, its
+ *   own included. Use a try lock and give back nothing if it's busy.
+ * - Shrinkers are called most recently registered first, so caches set up
+ *   on top of the heap give their memory back before the heap hands its
+ *   free pages to the pmm.
+ */
+
+void shrinker_register(shrinker_t *);
+void shrinker_unregister(shrinker_t *);
+
+/* ask the registered shrinkers for bytes worth of memory, returns how much
+ * was given back. Returns 0 right away if called from inside a shrinker. */
+size_t shrinker_reclaim(size_t bytes);
+
+#endif
+
@@ -30,6 +30,7 @@
 #include <arch/ops.h>
 #include <arch/thread.h>
 #include <kernel/wait.h>
+#include <kernel/timer.h>
 #include <debug.h>
 
 enum thread_state {
@@ -52,28 +53,78 @@ enum thread_tls_list {
 #define THREAD_FLAG_FREE_STACK 0x2
 #define THREAD_FLAG_FREE_STRUCT 0x4
 #define THREAD_FLAG_REAL_TIME 0x8
+#define THREAD_FLAG_IDLE 0x10
+#define THREAD_FLAG_DEADLINE 0x20
 
 #define THREAD_MAGIC 'thrd'
 
+/* thread level statistics */
+#if LK_DEBUGLEVEL > 1
+#define THREAD_STATS 1
+#else
+#define THREAD_STATS 0
+#endif
+
 typedef struct thread {
 	int magic;
 	struct list_node thread_list_node;
 
 	/* active bits */
 	struct list_node queue_node;
-	int priority;
+	int priority; /* effective priority, may be boosted by priority inheritance */
+	int base_priority; /* priority the thread was created with or set to */
 	enum thread_state state;
 	int saved_critical_section_count;
 	int remaining_quantum;
 	unsigned int flags;
+	int curr_cpu; /* cpu the thread is running on, -1 if not running */
+	int last_cpu; /* cpu the thread last ran on, -1 if it has never run */
+	int pinned_cpu; /* cpu the thread is bound to, -1 if free to migrate */
 
 	/* if blocked, a pointer to the wait queue */
 	struct wait_queue *blocking_wait_queue;
 	status_t wait_queue_block_ret;
 
+	/* priority inheritance: mutexes held and the one we're blocked on, if any */
+	struct list_node held_mutexes;
+	struct mutex *blocking_mutex;
+
+	/* deadline scheduling class, valid if THREAD_FLAG_DEADLINE is set */
+	struct thread_deadline {
+		lk_time_ns_t runtime; /* budget per period */
+		lk_time_ns_t deadline; /* relative to the start of each period */
+		lk_time_ns_t period;
+		lk_time_ns_t release; /* start of the current period */
+		lk_time_ns_t abs_deadline;
+		long long budget; /* left in this period */
+		bool throttled; /* out of budget or done, waiting for the next period */
+		uint cpu; /* cpu it was admitted on */
+		uint utilization; /* runtime / period, in parts per million */
+		uint overruns; /* periods it ran out of budget in */
+		uint misses; /* periods it finished after its deadline */
+		timer_t timer; /* starts the next period */
+	} dl;
+
+#if THREAD_STATS
+	/* cpu time accounting, in current_time_hires() units */
+	struct thread_specific_stats {
+		lk_bigtime_t total_run_time;
+		lk_bigtime_t last_run_timestamp;
+		lk_bigtime_t total_wait_time; /* ready and waiting for a cpu */
+		lk_bigtime_t last_ready_timestamp;
+		uint context_switches; /* times switched to */
+		uint preempts;
+	} stats;
+#endif
+
 	/* architecture stuff */
 	struct arch_thread arch;
 
+#if WITH_KERNEL_VM
+	/* user address space the thread runs in, NULL if it only uses the kernel's */
+	struct vmm_aspace *aspace;
+#endif
+
 	/* stack stuff */
 	void *stack;
 	size_t stack_size;
@@ -120,21 +171,38 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_ns(lk_time_ns_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+void thread_set_pinned_cpu(thread_t *t, int cpu);
+bool thread_is_on_cpu(thread_t *t); /* lockless hint */
+
+/* earliest deadline first scheduling class. deadline threads run ahead of all
+ * priority based threads, each gets runtime ns of cpu every period ns, due
+ * deadline ns into the period. a runtime of 0 puts the thread back in the
+ * priority class. fails with ERR_BUSY if the cpus can't fit it. */
+status_t thread_set_deadline(thread_t *t, lk_time_ns_t runtime, lk_time_ns_t deadline, lk_time_ns_t period);
+status_t thread_deadline_wait_next_period(void); /* done with this period's work */
+
+/* secondary cpu bring up, called once per cpu from lk_secondary_cpu_entry() */
+void thread_secondary_cpu_init_early(void);
+void thread_secondary_cpu_entry(void) __NO_RETURN;
 
 void dump_thread(thread_t *t);
 void dump_all_threads(void);
+void dump_deadline_threads(void);
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
+void thread_set_effective_priority(thread_t *t, int priority); /* used by priority inheritance */
 
-/* called on every timer tick for the scheduler to do quantum expiration */
+/* called on every periodic timer tick for the scheduler to do quantum expiration.
+ * platforms with PLATFORM_HAS_DYNAMIC_TIMER are tickless and don't use it */
 enum handler_return thread_timer_tick(void);
 
 /* the current thread */
@@ -142,6 +210,40 @@ thread_t *get_current_thread(void);
 void set_current_thread(thread_t *);
 
 /* critical sections */
+#if WITH_SMP
+/* On SMP the critical section count is tracked per cpu, and the outermost
+ * critical section also holds the global thread lock. Everything that used to
+ * be serialized by disabling interrupts on the one cpu (the run queues, wait
+ * queues, timers, etc) is serialized against the other cpus by this lock.
+ * The lock is handed across a context switch along with the count.
+ */
+extern int cpu_critical_section_count[SMP_MAX_CPUS];
+extern spin_lock_t thread_lock;
+
+#define critical_section_count (cpu_critical_section_count[arch_curr_cpu_num()])
+
+static inline __ALWAYS_INLINE void enter_critical_section(void)
+{
+	CF;
+	if (critical_section_count == 0) {
+		arch_disable_ints();
+		spin_lock(&thread_lock);
+	}
+	critical_section_count++;
+	CF;
+}
+
+static inline __ALWAYS_INLINE void exit_critical_section(void)
+{
+	CF;
+	critical_section_count--;
+	if (critical_section_count == 0) {
+		spin_unlock(&thread_lock);
+		arch_enable_ints();
+	}
+	CF;
+}
+#else
 extern int critical_section_count;
 
 static inline __ALWAYS_INLINE void enter_critical_section(void)
@@ -161,6 +263,7 @@ static inline __ALWAYS_INLINE void exit_critical_section(void)
 		arch_enable_ints();
 	CF;
 }
+#endif
 
 static inline __ALWAYS_INLINE bool in_critical_section(void)
 {
@@ -169,8 +272,22 @@ static inline __ALWAYS_INLINE bool in_critical_section(void)
 }
 
 /* only used by interrupt glue */
+#if WITH_SMP
+static inline void inc_critical_section(void)
+{
+	if (critical_section_count++ == 0)
+		spin_lock(&thread_lock);
+}
+
+static inline void dec_critical_section(void)
+{
+	if (--critical_section_count == 0)
+		spin_unlock(&thread_lock);
+}
+#else
 static inline void inc_critical_section(void) { critical_section_count++; }
 static inline void dec_critical_section(void) { critical_section_count--; }
+#endif
 
 /* thread local storage */
 static inline __ALWAYS_INLINE uint32_t tls_get(uint entry)
@@ -186,16 +303,12 @@ static inline __ALWAYS_INLINE uint32_t tls_set(uint entry, uint32_t val)
 }
 
 /* thread level statistics */
-#if LK_DEBUGLEVEL > 1
-#define THREAD_STATS 1
-#else
-#define THREAD_STATS 0
-#endif
 #if THREAD_STATS
 struct thread_stats {
 	lk_bigtime_t idle_time;
 	lk_bigtime_t last_idle_timestamp;
 	int reschedules;
+	int reschedule_ipis; /* mp code increments this */
 	int context_switches;
 	int preempts;
 	int yields;
@@ -204,9 +317,23 @@ struct thread_stats {
 	int timers; /* timer code increment this */
 };
 
-extern struct thread_stats thread_stats;
+extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+
+/* a snapshot of a thread's cpu usage, from thread_get_usage() */
+struct thread_usage {
+	thread_t *t;
+	char name[32];
+	int priority;
+	const char *state;
+	lk_bigtime_t run_time;
+	lk_bigtime_t wait_time;
+	uint context_switches;
+	uint preempts;
+};
+
+size_t thread_get_usage(struct thread_usage *usage, size_t count); /* returns the number of threads */
 
-#define THREAD_STATS_INC(name) do { thread_stats.name++; } while(0)
+#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
 
 #else
 
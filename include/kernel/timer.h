@@ -35,10 +35,15 @@ typedef enum handler_return (*timer_callback)(struct timer *, lk_time_t now, voi
 
 typedef struct timer {
 	int magic;
-	struct list_node node;
 
-	lk_time_t scheduled_time;
-	lk_time_t periodic_time;
+	/* links in the timer queue, a pairing heap ordered by scheduled_time */
+	struct timer *heap_child; /* first child */
+	struct timer *heap_next;  /* next sibling */
+	struct timer *heap_prev;  /* previous sibling, or the parent if first child */
+
+	lk_time_ns_t scheduled_time;
+	lk_time_ns_t periodic_time;
+	uint32_t seq; /* when it was queued, so same time timers fire in order */
 
 	timer_callback callback;
 	void *arg;
@@ -47,9 +52,12 @@ typedef struct timer {
 #define TIMER_INITIAL_VALUE(t) \
 { \
 	.magic = TIMER_MAGIC, \
-	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.heap_child = NULL, \
+	.heap_next = NULL, \
+	.heap_prev = NULL, \
 	.scheduled_time = 0, \
 	.periodic_time = 0, \
+	.seq = 0, \
 	.callback = NULL, \
 	.arg = NULL, \
 }
@@ -58,12 +66,24 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Timers are dispatched from a 10ms periodic tick, or on platforms with
+ *   PLATFORM_HAS_DYNAMIC_TIMER from a one shot timer programmed for the next event
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
+void timer_set_oneshot_ns(timer_t *, lk_time_ns_t delay, timer_callback, void *arg);
+void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+/* convert a delay in ms to ns. INFINITE_TIME maps to INFINITE_TIME_NS and
+ * anything too large to represent saturates to it */
+static inline lk_time_ns_t timer_ms_to_ns(lk_time_t ms)
+{
+	if (ms == INFINITE_TIME || ms >= INFINITE_TIME_NS / 1000000)
+		return INFINITE_TIME_NS;
+	return (lk_time_ns_t)ms * 1000000;
+}
+
 #endif
 
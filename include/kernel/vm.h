@@ -44,6 +44,7 @@
 #include <stdlib.h>
 #include <arch.h>
 #include <arch/mmu.h>
+#include <arch/aspace.h>
 
 __BEGIN_CDECLS
 
@@ -75,10 +76,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* size of the free block this page heads, pmm internal */
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_FREE_HEAD (0x2) /* first page of a free block, pmm internal */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -90,12 +93,27 @@ typedef struct vm_page {
 
 STATIC_ASSERT(KERNEL_ASPACE_BASE + (KERNEL_ASPACE_SIZE - 1) > KERNEL_ASPACE_BASE);
 
+/* user address spaces, everything below the kernel's except the zero page */
+#ifndef USER_ASPACE_BASE
+#define USER_ASPACE_BASE ((vaddr_t)0x00001000UL)
+#endif
+#ifndef USER_ASPACE_SIZE
+#define USER_ASPACE_SIZE ((vaddr_t)KERNEL_ASPACE_BASE - USER_ASPACE_BASE)
+#endif
+
 static inline bool is_kernel_address(vaddr_t va)
 {
     return (va >= KERNEL_ASPACE_BASE && va <= (KERNEL_ASPACE_BASE + KERNEL_ASPACE_SIZE));
 }
 
 /* physical allocator */
+
+/* free pages are managed as power of two sized blocks of up to
+ * 2^PMM_MAX_ORDER pages, large enough for a 1080p 32bpp framebuffer */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 11
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -109,7 +127,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_lists[PMM_MAX_ORDER + 1]; /* free blocks, by order */
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -151,9 +169,17 @@ void *pmm_alloc_kpages(uint count, struct list_node *list);
     /* Helper routine for pmm_alloc_kpages. */
 static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
+    /* Free a run of pages allocated with pmm_alloc_kpages, or any part of one.
+     * Returns the number of pages freed.
+     */
+uint pmm_free_kpages(void *ptr, uint count);
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
+/* virtual to physical, for addresses in the kernel address space */
+paddr_t vaddr_to_paddr(void *va);
+
 /* virtual allocator */
 typedef struct vmm_aspace {
     struct list_node node;
@@ -165,8 +191,13 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
+
+    arch_aspace_t arch_aspace;
 } vmm_aspace_t;
 
+#define VMM_ASPACE_FLAG_KERNEL 0x1
+
 typedef struct vmm_region {
     struct list_node node;
     char name[32];
@@ -178,10 +209,19 @@ typedef struct vmm_region {
     size_t  size;
 
     struct list_node page_list;
+
+    /* avl tree of the aspace's regions sorted by base, each node tracking the
+     * free space just before it and the largest such gap in its subtree */
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    uint tree_height;
+    size_t gap_before;
+    size_t max_gap;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_COMMIT_ON_DEMAND 0x4
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -189,6 +229,23 @@ static inline vmm_aspace_t *vmm_get_kernel_aspace(void) {
     return &_kernel_aspace;
 }
 
+/* create a new user address space with its own translation tables */
+status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
+    __NONNULL((1));
+
+/* tear down a user address space, freeing all of its regions. it must not be
+   active on any thread */
+status_t vmm_free_aspace(vmm_aspace_t *aspace)
+    __NONNULL((1));
+
+/* make aspace the address space of the current thread, NULL leaves it with
+   just the kernel's */
+void vmm_set_active_aspace(vmm_aspace_t *aspace);
+
+/* called by the arch context switch code when the incoming thread runs in
+   a different address space than the outgoing one */
+void vmm_context_switch(vmm_aspace_t *oldaspace, vmm_aspace_t *newaspace);
+
 /* reserve a chunk of address space to prevent allocations from that space */
 status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size, vaddr_t vaddr)
     __NONNULL((1));
@@ -209,6 +266,35 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
 
+    /* For vmm_alloc. Only reserve the address space, pages are allocated and zeroed
+     * the first time they are touched. The first touch of a page must not happen
+     * inside a critical section or with interrupts disabled, prefault those with
+     * vmm_commit_range. */
+#define VMM_FLAG_COMMIT_ON_DEMAND 0x2
+
+/* free a region, unmapping it and returning any pages that back it to the pmm.
+ * vaddr may be any address inside the region, the whole region is freed.
+ * returns ERR_NOT_FOUND if nothing is mapped there and ERR_INVALID_ARGS for
+ * regions made by vmm_reserve_space, which can't be freed. */
+status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
+    __NONNULL((1));
+
+/* back a range of a demand committed region with zeroed pages ahead of use */
+status_t vmm_commit_range(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size)
+    __NONNULL((1));
+
+/* unmap and free the pages behind a range of a demand committed region. the
+   range reads back as zeros the next time it is touched. */
+status_t vmm_decommit_range(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size)
+    __NONNULL((1));
+
+/* called by the arch fault handlers on a translation fault. returns NO_ERROR if
+   the fault was resolved and the faulting instruction can be restarted. */
+status_t vmm_page_fault_handler(vaddr_t addr, uint flags);
+
+#define VMM_PF_FLAG_WRITE       0x1
+#define VMM_PF_FLAG_INSTRUCTION 0x2
+
 __END_CDECLS
 
 #endif // !ASSEMBLY
@@ -59,14 +59,16 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
 
 /*
  * block on a wait queue.
+ * waiters are kept in priority order, first come first served within a priority.
  * return status is whatever the caller of wait_queue_wake_*() specifies.
  * a timeout other than INFINITE_TIME will set abort after the specified time
  * and return ERR_TIMED_OUT. a timeout of 0 will immediately return.
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
+status_t wait_queue_block_ns(wait_queue_t *, lk_time_ns_t timeout);
 
 /*
- * release one or more threads from the wait queue.
+ * release one or more threads from the wait queue, highest priority first.
  * reschedule = should the system reschedule if any is released.
  * wait_queue_error = what wait_queue_block() should return for the blocking thread.
  */
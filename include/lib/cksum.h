@@ -22,6 +22,9 @@ unsigned short update_crc16(unsigned short crc, const unsigned char *buf, unsign
 
 unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len);
 
+/* the same, with the Castagnoli polynomial (iSCSI, ext4 metadata) */
+unsigned long crc32c(unsigned long crc, const unsigned char *buf, unsigned int len);
+
 unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len);
 
 __END_CDECLS
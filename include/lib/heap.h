@@ -42,6 +42,10 @@ void heap_add_block(void *, size_t);
 
 void heap_get_stats(struct heap_stats *ptr);
 
+/* hand whole free pages back to the system until no more than keep bytes
+ * are left free in the heap. Returns the number of bytes handed back. */
+size_t heap_trim(size_t keep);
+
 /* critical section time delayed free */
 void heap_delayed_free(void *);
 
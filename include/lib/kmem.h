@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __LIB_KMEM_H
+#define __LIB_KMEM_H
+
+#include <stddef.h>
+#include <list.h>
+#include <sys/types.h>
+#include <kernel/mutex.h>
+
+/* Fixed size object caches.
+ *
+ * Objects are carved out of page sized slabs taken straight from the pmm,
+ * with a free list per slab, so allocation and free are O(1) and objects
+ * of one type stay packed together. A slab that drains completely is handed
+ * back to the pmm once the cache already holds a spare empty slab. Without
+ * the kernel vm there is no pmm, and caches pass through to the heap while
+ * still keeping their stats.
+ *
+ * Caches may be created at run time with kmem_cache_create() or declared
+ * statically with KMEM_CACHE_INITIAL_VALUE(), in which case they set
+ * themselves up on first use. Only safe to use from thread context.
+ */
+
+typedef struct kmem_cache {
+	struct list_node node; /* in the global cache list */
+	const char *name;
+	size_t size;           /* object size as requested */
+	size_t align;
+	size_t obj_size;       /* object stride within a slab */
+	uint obj_per_slab;
+	bool initialized;
+	bool allocated;        /* from kmem_cache_create() */
+	mutex_t lock;
+
+	/* slabs with some, no, and only free objects */
+	struct list_node partial_list;
+	struct list_node full_list;
+	struct list_node empty_list;
+
+	/* stats */
+	uint slab_count;
+	uint empty_count;
+	uint active_objs;
+	uint peak_objs;
+	ulong alloc_count;
+	ulong free_count;
+	ulong fail_count;
+} kmem_cache_t;
+
+#define KMEM_CACHE_INITIAL_VALUE(c, _name, _size, _align) \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.name = (_name), \
+	.size = (_size), \
+	.align = (_align), \
+	.lock = MUTEX_INITIAL_VALUE((c).lock), \
+	.partial_list = LIST_INITIAL_VALUE((c).partial_list), \
+	.full_list = LIST_INITIAL_VALUE((c).full_list), \
+	.empty_list = LIST_INITIAL_VALUE((c).empty_list), \
+}
+
+/* align of 0 means pointer alignment. With the kernel vm an object must fit
+ * in a single slab, create and init fail with NULL and ERR_INVALID_ARGS
+ * otherwise. */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+status_t kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size, size_t align);
+
+/* all objects must have been freed */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* print every cache's stats */
+void kmem_cache_dump(void);
+
+#endif
+
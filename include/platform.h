@@ -48,6 +48,7 @@ typedef enum {
 
 lk_time_t current_time(void);
 lk_bigtime_t current_time_hires(void);
+lk_time_ns_t current_time_ns(void);
 
 /* super early platform initialization, before almost everything */
 void platform_early_init(void);
@@ -55,6 +56,9 @@ void platform_early_init(void);
 /* later init, after the kernel has come up */
 void platform_init(void);
 
+/* per cpu platform initialization, run on each secondary cpu as it comes up */
+void platform_init_secondary_cpu(void);
+
 /* called by the arch init code to get the platform to set up any mmu mappings it may need */
 void platform_init_mmu_mappings(void);
 
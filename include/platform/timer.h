@@ -31,6 +31,7 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval);
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval);
 void     platform_stop_timer(void);
 #endif
 
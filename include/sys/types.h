@@ -48,7 +48,9 @@ typedef int kobj_id;
 
 typedef unsigned long lk_time_t;
 typedef unsigned long long lk_bigtime_t;
+typedef unsigned long long lk_time_ns_t; /* 64bit nanoseconds, does not wrap */
 #define INFINITE_TIME ULONG_MAX
+#define INFINITE_TIME_NS ULLONG_MAX
 
 #define TIME_GTE(a, b) ((long)((a) - (b)) >= 0)
 #define TIME_LTE(a, b) ((long)((a) - (b)) <= 0)
@@ -33,9 +33,12 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/mp.h>
 #include <err.h>
 #include <platform.h>
 
@@ -45,6 +48,7 @@
 static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
+static int cmd_top(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
 
 STATIC_COMMAND_START
@@ -54,6 +58,7 @@ STATIC_COMMAND("threads", "list kernel threads", &cmd_threads)
 #if THREAD_STATS
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
+STATIC_COMMAND("top", "per thread cpu usage", &cmd_top)
 #endif
 #if WITH_KERNEL_EVLOG
 STATIC_COMMAND("kevlog", "dump kernel event log", &cmd_kevlog)
@@ -73,43 +78,67 @@ static int cmd_threads(int argc, const cmd_args *argv)
 #if THREAD_STATS
 static int cmd_threadstats(int argc, const cmd_args *argv)
 {
-	printf("thread stats:\n");
-	printf("\ttotal idle time: %lld\n", thread_stats.idle_time);
-	printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats.idle_time);
-	printf("\treschedules: %d\n", thread_stats.reschedules);
-	printf("\tcontext_switches: %d\n", thread_stats.context_switches);
-	printf("\tpreempts: %d\n", thread_stats.preempts);
-	printf("\tyields: %d\n", thread_stats.yields);
-	printf("\tinterrupts: %d\n", thread_stats.interrupts);
-	printf("\ttimer interrupts: %d\n", thread_stats.timer_ints);
-	printf("\ttimers: %d\n", thread_stats.timers);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!(mp_get_active_mask() & (1UL << i)))
+			continue;
+
+#if WITH_SMP
+		printf("thread stats (cpu %u):\n", i);
+#else
+		printf("thread stats:\n");
+#endif
+		printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
+		printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
+		printf("\treschedules: %d\n", thread_stats[i].reschedules);
+#if WITH_SMP
+		printf("\treschedule_ipis: %d\n", thread_stats[i].reschedule_ipis);
+#endif
+		printf("\tcontext_switches: %d\n", thread_stats[i].context_switches);
+		printf("\tpreempts: %d\n", thread_stats[i].preempts);
+		printf("\tyields: %d\n", thread_stats[i].yields);
+		printf("\tinterrupts: %d\n", thread_stats[i].interrupts);
+		printf("\ttimer interrupts: %d\n", thread_stats[i].timer_ints);
+		printf("\ttimers: %d\n", thread_stats[i].timers);
+	}
+
+	dump_deadline_threads();
 
 	return 0;
 }
 
 static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
 {
-	static struct thread_stats old_stats;
-	static lk_bigtime_t last_idle_time;
-
-	lk_bigtime_t idle_time = thread_stats.idle_time;
-	if (get_current_thread()->priority == IDLE_PRIORITY) {
-		idle_time += current_time_hires() - thread_stats.last_idle_timestamp;
+	static struct thread_stats old_stats[SMP_MAX_CPUS];
+	static lk_bigtime_t last_idle_time[SMP_MAX_CPUS];
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!(mp_get_active_mask() & (1UL << i)))
+			continue;
+
+		lk_bigtime_t idle_time = thread_stats[i].idle_time;
+		if (mp_get_idle_mask() & (1UL << i)) {
+			idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
+		}
+		lk_bigtime_t delta_time = idle_time - last_idle_time[i];
+		lk_bigtime_t busy_time = 1000000ULL - (delta_time > 1000000ULL ? 1000000ULL : delta_time);
+
+		uint busypercent = (busy_time * 10000) / (1000000);
+
+//		printf("idle_time %lld, busytime %lld\n", idle_time - last_idle_time[i], busy_time);
+#if WITH_SMP
+		printf("LOAD: cpu %u ", i);
+#else
+		printf("LOAD: ");
+#endif
+		printf("%d.%02d%%, cs %d, ints %d, timer ints %d, timers %d\n", busypercent / 100, busypercent % 100,
+		       thread_stats[i].context_switches - old_stats[i].context_switches,
+		       thread_stats[i].interrupts - old_stats[i].interrupts,
+		       thread_stats[i].timer_ints - old_stats[i].timer_ints,
+		       thread_stats[i].timers - old_stats[i].timers);
+
+		old_stats[i] = thread_stats[i];
+		last_idle_time[i] = idle_time;
 	}
-	lk_bigtime_t delta_time = idle_time - last_idle_time;
-	lk_bigtime_t busy_time = 1000000ULL - (delta_time > 1000000ULL ? 1000000ULL : delta_time);
-
-	uint busypercent = (busy_time * 10000) / (1000000);
-
-//	printf("idle_time %lld, busytime %lld\n", idle_time - last_idle_time, busy_time);
-	printf("LOAD: %d.%02d%%, cs %d, ints %d, timer ints %d, timers %d\n", busypercent / 100, busypercent % 100,
-	       thread_stats.context_switches - old_stats.context_switches,
-	       thread_stats.interrupts - old_stats.interrupts,
-	       thread_stats.timer_ints - old_stats.timer_ints,
-	       thread_stats.timers - old_stats.timers);
-
-	old_stats = thread_stats;
-	last_idle_time = idle_time;
 
 	return INT_NO_RESCHEDULE;
 }
@@ -136,6 +165,80 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 	return 0;
 }
 
+#define TOP_MAX_THREADS 64
+
+/* find a thread's usage in the previous snapshot, by pointer and name since the struct may have been recycled */
+static const struct thread_usage *top_find_prev(const struct thread_usage *prev, size_t count, const struct thread_usage *u)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (prev[i].t == u->t && !strcmp(prev[i].name, u->name))
+			return &prev[i];
+	}
+	return NULL;
+}
+
+static int cmd_top(int argc, const cmd_args *argv)
+{
+	lk_time_t window = (argc >= 2 && argv[1].u > 0) ? argv[1].u : 1000;
+	uint iterations = (argc >= 3 && argv[2].u > 0) ? argv[2].u : 1;
+
+	struct thread_usage *prev = malloc(sizeof(struct thread_usage) * TOP_MAX_THREADS);
+	struct thread_usage *curr = malloc(sizeof(struct thread_usage) * TOP_MAX_THREADS);
+	lk_bigtime_t *delta = malloc(sizeof(lk_bigtime_t) * TOP_MAX_THREADS);
+	uint *order = malloc(sizeof(uint) * TOP_MAX_THREADS);
+	if (!prev || !curr || !delta || !order) {
+		printf("out of memory\n");
+		goto out;
+	}
+
+	size_t prev_count = MIN(thread_get_usage(prev, TOP_MAX_THREADS), TOP_MAX_THREADS);
+	lk_bigtime_t prev_time = current_time_hires();
+
+	for (uint iter = 0; iter < iterations; iter++) {
+		thread_sleep(window);
+
+		size_t count = MIN(thread_get_usage(curr, TOP_MAX_THREADS), TOP_MAX_THREADS);
+		lk_bigtime_t now = current_time_hires();
+		lk_bigtime_t elapsed = MAX(now - prev_time, 1ULL);
+
+		/* cpu time used by each thread over the window, sorted most first */
+		for (uint i = 0; i < count; i++) {
+			const struct thread_usage *p = top_find_prev(prev, prev_count, &curr[i]);
+			delta[i] = curr[i].run_time - (p ? p->run_time : 0);
+
+			uint j;
+			for (j = i; j > 0 && delta[order[j - 1]] < delta[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		printf("%zu threads, %llu us window\n", count, elapsed);
+		printf("   cpu%%    run(us)   wait(us)     cs preempt pri state name\n");
+		for (uint i = 0; i < count; i++) {
+			const struct thread_usage *u = &curr[order[i]];
+			uint percent = (delta[order[i]] * 10000) / elapsed;
+
+			printf("%3u.%02u%% %10llu %10llu %6u %7u %3d %-5s %s\n",
+			       percent / 100, percent % 100, u->run_time, u->wait_time,
+			       u->context_switches, u->preempts, u->priority, u->state, u->name);
+		}
+
+		struct thread_usage *temp = prev;
+		prev = curr;
+		curr = temp;
+		prev_count = count;
+		prev_time = now;
+	}
+
+out:
+	free(order);
+	free(delta);
+	free(curr);
+	free(prev);
+
+	return 0;
+}
+
 #endif // THREAD_STATS
 
 #endif // WITH_LIB_CONSOLE
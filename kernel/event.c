@@ -44,6 +44,7 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 
 /**
  * @brief  Initialize an event object
@@ -96,6 +97,16 @@ void event_destroy(event_t *e)
  *         other values on other errors.
  */
 status_t event_wait_timeout(event_t *e, lk_time_t timeout)
+{
+	return event_wait_timeout_ns(e, timer_ms_to_ns(timeout));
+}
+
+/**
+ * @brief  Wait for event to be signaled, timeout specified in ns
+ *
+ * Same as event_wait_timeout(), with INFINITE_TIME_NS to wait indefinitely.
+ */
+status_t event_wait_timeout_ns(event_t *e, lk_time_ns_t timeout)
 {
 	status_t ret = NO_ERROR;
 
@@ -111,7 +122,7 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 		}
 	} else {
 		/* unsignalled, block here */
-		ret = wait_queue_block(&e->wait, timeout);
+		ret = wait_queue_block_ns(&e->wait, timeout);
 		if (ret < 0)
 			goto err;
 	}
@@ -25,12 +25,17 @@
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/mp.h>
 
 void kernel_init(void)
 {
 	// if enabled, configure the kernel's event log
 	kernel_evlog_init();
 
+	// initialize the mp state for the boot cpu
+	dprintf(SPEW, "initializing mp\n");
+	mp_init();
+
 	// initialize the threading system
 	dprintf(SPEW, "initializing threads\n");
 	thread_init();
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/mp.h>
+
+#include <stdlib.h>
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <arch/mp.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/* a global state structure shared by all of the cpus */
+struct mp_state mp;
+
+void mp_init(void)
+{
+	/* the boot cpu is up and running the scheduler */
+	mp_set_curr_cpu_active(true);
+}
+
+void mp_reschedule(mp_cpu_mask_t target)
+{
+#if WITH_SMP
+	uint local_cpu = arch_curr_cpu_num();
+
+	LTRACEF("local %u, target 0x%x\n", local_cpu, target);
+
+	/* mask out cpus that are not active and the local cpu */
+	target &= mp.active_cpus;
+	target &= ~(1UL << local_cpu);
+	if (!target)
+		return;
+
+	arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
+#endif
+}
+
+void mp_set_curr_cpu_active(bool active)
+{
+	mp_cpu_mask_t mask = 1UL << arch_curr_cpu_num();
+
+	if (active)
+		atomic_or((volatile int *)&mp.active_cpus, mask);
+	else
+		atomic_and((volatile int *)&mp.active_cpus, ~mask);
+}
+
+enum handler_return mp_mbx_reschedule_irq(void)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	LTRACEF("cpu %u\n", cpu);
+
+	THREAD_STATS_INC(reschedule_ipis);
+
+	return (mp.active_cpus & (1UL << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
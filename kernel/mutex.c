@@ -34,7 +34,143 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
+
+/* use the compiler's atomics on the holder word wherever they don't turn into
+ * a library call, otherwise everything goes through the critical section */
+#if (__SIZEOF_POINTER__ == 4 && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)) || \
+    (__SIZEOF_POINTER__ == 8 && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8))
+#define MUTEX_FAST_PATH 1
+#else
+#define MUTEX_FAST_PATH 0
+#endif
+
+/* how many times to poll a mutex whose holder is running on another cpu
+ * before giving up and going to sleep on it */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
+
+static inline bool mutex_cmpxchg(mutex_t *m, uintptr_t oldval, uintptr_t newval)
+{
+#if MUTEX_FAST_PATH
+	return __atomic_compare_exchange_n(&m->val, &oldval, newval, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+#else
+	/* only ever called in a critical section */
+	if (m->val != oldval)
+		return false;
+	m->val = newval;
+	return true;
+#endif
+}
+
+static inline void mutex_set_val(mutex_t *m, uintptr_t val)
+{
+#if MUTEX_FAST_PATH
+	__atomic_store_n(&m->val, val, __ATOMIC_RELEASE);
+#else
+	m->val = val;
+#endif
+}
+
+/* the wait queue is kept in priority order, so the head is the most important waiter */
+static int mutex_top_waiter_priority(mutex_t *m)
+{
+	thread_t *t = list_peek_head_type(&m->wait.list, thread_t, queue_node);
+
+	return t ? t->priority : -1;
+}
+
+int mutex_inherited_priority(thread_t *t)
+{
+	mutex_t *m;
+	int priority = -1;
+
+	/* only contended mutexes are on the list, the rest have no waiters to inherit from */
+	list_for_every_entry(&t->held_mutexes, m, mutex_t, held_node)
+		priority = MAX(priority, mutex_top_waiter_priority(m));
+
+	return priority;
+}
+
+/* recompute the priority of t from scratch, and keep going down the chain of
+ * holders if t is itself blocked on a mutex and its priority changed */
+static void mutex_update_priority_chain(thread_t *t)
+{
+	while (t) {
+		int priority = MAX(t->base_priority, mutex_inherited_priority(t));
+		if (priority == t->priority)
+			break;
+
+		thread_set_effective_priority(t, priority);
+		t = t->blocking_mutex ? mutex_holder(t->blocking_mutex) : NULL;
+	}
+}
+
+/* the current thread is about to block on m, lend its priority to the holder
+ * and on down the chain of mutexes the holders are blocked on */
+static void mutex_boost_priority_chain(mutex_t *m, int priority)
+{
+	thread_t *holder;
+
+	while (m && (holder = mutex_holder(m)) && holder->priority < priority) {
+		thread_set_effective_priority(holder, priority);
+		m = holder->blocking_mutex;
+	}
+}
+
+/* a waiter left the queue without getting the mutex, if it was the last one
+ * the mutex stops being contended and the holder may not need its boost anymore */
+static void mutex_waiter_gone(mutex_t *m)
+{
+	uintptr_t val = m->val;
+	thread_t *holder = mutex_holder(m);
+
+	if (!holder)
+		return;
+
+	if ((val & MUTEX_FLAG_CONTENDED) && list_is_empty(&m->wait.list)) {
+		list_delete(&m->held_node);
+
+		/* the holder can't change while the flag is set, it has to come
+		 * through the critical section to release */
+		mutex_set_val(m, (uintptr_t)holder);
+	}
+
+	mutex_update_priority_chain(holder);
+}
+
+#if WITH_SMP && MUTEX_FAST_PATH
+/* if the holder is running on another cpu it's likely to let go soon, so poll
+ * for a bit rather than paying for going to sleep and being woken back up */
+static bool mutex_spin(mutex_t *m, thread_t *current_thread)
+{
+	/* don't sit on the thread lock while we wait */
+	if (in_critical_section())
+		return false;
+
+	for (int i = 0; i < MUTEX_SPIN_COUNT; i++) {
+		uintptr_t val = m->val;
+
+		if (val == 0) {
+			if (mutex_cmpxchg(m, 0, (uintptr_t)current_thread))
+				return true;
+			continue;
+		}
+
+		/* once there are waiters, the mutex gets handed to them, not grabbed */
+		if (val & MUTEX_FLAG_CONTENDED)
+			return false;
+
+		if (!thread_is_on_cpu((thread_t *)val))
+			return false;
+	}
+
+	return false;
+}
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -55,14 +191,19 @@ void mutex_destroy(mutex_t *m)
 	DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
 #if LK_DEBUGLEVEL > 0
-	if (unlikely(m->holder != 0 && get_current_thread() != m->holder))
+	thread_t *holder = mutex_holder(m);
+	if (unlikely(holder != 0 && get_current_thread() != holder))
 		panic("mutex_destroy: thread %p (%s) tried to release mutex %p it doesn't own. owned by %p (%s)\n",
-		      get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
+		      get_current_thread(), get_current_thread()->name, m, holder, holder->name);
 #endif
 
 	enter_critical_section();
+	if (m->val & MUTEX_FLAG_CONTENDED) {
+		list_delete(&m->held_node);
+		mutex_update_priority_chain(mutex_holder(m));
+	}
 	m->magic = 0;
-	m->count = 0;
+	m->val = 0;
 	wait_queue_destroy(&m->wait, true);
 	exit_critical_section();
 }
@@ -78,40 +219,93 @@ void mutex_destroy(mutex_t *m)
  * other values on error
  */
 status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
+{
+	return mutex_acquire_timeout_ns(m, timer_ms_to_ns(timeout));
+}
+
+/**
+ * @brief  Mutex wait with timeout specified in ns
+ *
+ * Same as mutex_acquire_timeout(), with INFINITE_TIME_NS to wait indefinitely.
+ */
+status_t mutex_acquire_timeout_ns(mutex_t *m, lk_time_ns_t timeout)
 {
 	DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
+	thread_t *current_thread = get_current_thread();
+
 #if LK_DEBUGLEVEL > 0
-	if (unlikely(get_current_thread() == m->holder))
+	if (unlikely(current_thread == mutex_holder(m)))
 		panic("mutex_acquire_timeout: thread %p (%s) tried to acquire mutex %p it already owns.\n",
-		      get_current_thread(), get_current_thread()->name, m);
+		      current_thread, current_thread->name, m);
+#endif
+
+#if MUTEX_FAST_PATH
+	if (likely(mutex_cmpxchg(m, 0, (uintptr_t)current_thread)))
+		return NO_ERROR;
+
+#if WITH_SMP
+	if (timeout != 0 && mutex_spin(m, current_thread))
+		return NO_ERROR;
+#endif
 #endif
 
 	enter_critical_section();
 
 	status_t ret = NO_ERROR;
-	if (unlikely(++m->count > 1)) {
-		ret = wait_queue_block(&m->wait, timeout);
-		if (unlikely(ret < NO_ERROR)) {
-			/* if the acquisition timed out, back out the acquire and exit */
-			if (likely(ret == ERR_TIMED_OUT)) {
-				/*
-				 * race: the mutex may have been destroyed after the timeout,
-				 * but before we got scheduled again which makes messing with the
-				 * count variable dangerous.
-				 */
-				m->count--;
-			}
-			/* if there was a general error, it may have been destroyed out from
-			 * underneath us, so just exit (which is really an invalid state anyway)
+	for (;;) {
+		uintptr_t val = m->val;
+
+		/* release hands the mutex straight to a waiter, so if it's free here
+		 * nobody is queued and it's ours for the taking */
+		if (val == 0) {
+			if (mutex_cmpxchg(m, 0, (uintptr_t)current_thread))
+				goto out;
+			continue;
+		}
+
+		if (timeout == 0) {
+			ret = ERR_TIMED_OUT;
+			goto out;
+		}
+
+		if (val & MUTEX_FLAG_CONTENDED)
+			break;
+
+		/* mark it contended so the holder's release comes through here, and
+		 * track it on the holder for priority inheritance */
+		if (mutex_cmpxchg(m, val, val | MUTEX_FLAG_CONTENDED)) {
+			list_add_tail(&((thread_t *)val)->held_mutexes, &m->held_node);
+			break;
+		}
+	}
+
+	current_thread->blocking_mutex = m;
+	mutex_boost_priority_chain(m, current_thread->priority);
+
+	ret = wait_queue_block_ns(&m->wait, timeout);
+
+	current_thread->blocking_mutex = NULL;
+	if (unlikely(ret < NO_ERROR)) {
+		/* if the acquisition timed out, back out the acquire and exit */
+		if (likely(ret == ERR_TIMED_OUT)) {
+			/*
+			 * race: the mutex may have been destroyed after the timeout,
+			 * but before we got scheduled again which makes messing with the
+			 * mutex dangerous.
 			 */
-			goto err;
+			mutex_waiter_gone(m);
 		}
+		/* if there was a general error, it may have been destroyed out from
+		 * underneath us, so just exit (which is really an invalid state anyway)
+		 */
+		goto out;
 	}
 
-	m->holder = get_current_thread();
+	/* mutex_release() handed us the mutex directly */
+	DEBUG_ASSERT(mutex_holder(m) == current_thread);
 
-err:
+out:
 	exit_critical_section();
 	return ret;
 }
@@ -123,18 +317,41 @@ status_t mutex_release(mutex_t *m)
 {
 	DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
+	thread_t *current_thread = get_current_thread();
+
 #if LK_DEBUGLEVEL > 0
-	if (unlikely(get_current_thread() != m->holder)) {
+	if (unlikely(current_thread != mutex_holder(m))) {
+		thread_t *holder = mutex_holder(m);
 		panic("mutex_release: thread %p (%s) tried to release mutex %p it doesn't own. owned by %p (%s)\n",
-		      get_current_thread(), get_current_thread()->name, m, m->holder, m->holder ? m->holder->name : "none");
+		      current_thread, current_thread->name, m, holder, holder ? holder->name : "none");
 	}
 #endif
 
+#if MUTEX_FAST_PATH
+	/* fails if anyone has queued up behind us */
+	if (likely(mutex_cmpxchg(m, (uintptr_t)current_thread, 0)))
+		return NO_ERROR;
+#endif
+
 	enter_critical_section();
 
-	m->holder = 0;
+	if (m->val & MUTEX_FLAG_CONTENDED)
+		list_delete(&m->held_node);
+
+	/* hand the mutex straight to the most important waiter, so nobody can
+	 * slip in ahead of it and it starts out with the right inherited priority */
+	thread_t *t = list_peek_head_type(&m->wait.list, thread_t, queue_node);
+	if (t && m->wait.count > 1) {
+		list_add_tail(&t->held_mutexes, &m->held_node);
+		mutex_set_val(m, (uintptr_t)t | MUTEX_FLAG_CONTENDED);
+	} else {
+		mutex_set_val(m, (uintptr_t)t);
+	}
 
-	if (unlikely(--m->count >= 1)) {
+	/* drop whatever we had inherited through this mutex */
+	mutex_update_priority_chain(current_thread);
+
+	if (t) {
 		/* release a thread */
 		wait_queue_wake_one(&m->wait, true, NO_ERROR);
 	}
@@ -142,4 +359,3 @@ status_t mutex_release(mutex_t *m)
 	exit_critical_section();
 	return NO_ERROR;
 }
-
@@ -11,13 +11,26 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/mutex.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
+	$(LOCAL_DIR)/shrinker.c \
 
 ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
 endif
 
+# platforms that can bring up more than one cpu set WITH_SMP and SMP_MAX_CPUS
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 2
+GLOBAL_DEFINES += \
+	WITH_SMP=1 \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+else
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=1
+endif
+
 include make/module.mk
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Registry of memory shrinkers.
+ *
+ * Subsystems holding memory they could do without register a shrinker. When
+ * the pmm or the heap can't satisfy an allocation, or the pmm runs low, the
+ * shrinkers are asked to give some back before the allocation fails.
+ */
+
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <kernel/shrinker.h>
+
+#define LOCAL_TRACE 0
+
+static struct list_node shrinker_list = LIST_INITIAL_VALUE(shrinker_list);
+static mutex_t shrinker_lock = MUTEX_INITIAL_VALUE(shrinker_lock);
+
+/**
+ * @brief  Add a shrinker to the registry
+ *
+ * The shrinker may be called as soon as this returns.
+ */
+void shrinker_register(shrinker_t *s)
+{
+	DEBUG_ASSERT(s);
+	DEBUG_ASSERT(s->count && s->shrink);
+	DEBUG_ASSERT(!list_in_list(&s->node));
+
+	LTRACEF("shrinker %p (%s)\n", s, s->name);
+
+	mutex_acquire(&shrinker_lock);
+	list_add_head(&shrinker_list, &s->node);
+	mutex_release(&shrinker_lock);
+}
+
+/**
+ * @brief  Remove a shrinker from the registry
+ *
+ * Once this returns the shrinker is not running and won't be called again.
+ */
+void shrinker_unregister(shrinker_t *s)
+{
+	DEBUG_ASSERT(s);
+
+	LTRACEF("shrinker %p (%s)\n", s, s->name);
+
+	mutex_acquire(&shrinker_lock);
+	list_delete(&s->node);
+	mutex_release(&shrinker_lock);
+}
+
+/**
+ * @brief  Ask the registered shrinkers to give back memory
+ *
+ * Shrinkers are asked in turn for whatever is still missing until bytes
+ * have been given back or every shrinker has had a go. Only one thread
+ * reclaims at a time, the others wait for it and then have their own go.
+ *
+ * @return  The number of bytes given back, which may be more or less than
+ * asked for.
+ */
+size_t shrinker_reclaim(size_t bytes)
+{
+	LTRACEF("bytes 0x%zx\n", bytes);
+
+	/* a shrinker ran out of memory itself, don't go around again */
+	if (mutex_holder(&shrinker_lock) == get_current_thread())
+		return 0;
+
+	mutex_acquire(&shrinker_lock);
+
+	size_t reclaimed = 0;
+	shrinker_t *s;
+	list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+		if (reclaimed >= bytes)
+			break;
+
+		if (s->count(s) == 0)
+			continue;
+
+		size_t freed = s->shrink(s, bytes - reclaimed);
+		LTRACEF("shrinker %p (%s) gave back 0x%zx\n", s, s->name, freed);
+
+		reclaimed += freed;
+	}
+
+	mutex_release(&shrinker_lock);
+
+	LTRACEF("reclaimed 0x%zx of 0x%zx\n", reclaimed, bytes);
+
+	return reclaimed;
+}
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+
+static int cmd_shrink(int argc, const cmd_args *argv)
+{
+	if (argc < 2) {
+		printf("usage:\n");
+		printf("\t%s info\n", argv[0].str);
+		printf("\t%s reclaim <bytes>\n", argv[0].str);
+		return -1;
+	}
+
+	if (strcmp(argv[1].str, "info") == 0) {
+		mutex_acquire(&shrinker_lock);
+
+		shrinker_t *s;
+		list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+			printf("\t%p %-16s can give back 0x%zx\n", s, s->name, s->count(s));
+		}
+
+		mutex_release(&shrinker_lock);
+	} else if (strcmp(argv[1].str, "reclaim") == 0) {
+		if (argc < 3) {
+			printf("not enough arguments\n");
+			return -1;
+		}
+
+		size_t reclaimed = shrinker_reclaim(argv[2].u);
+		printf("reclaimed 0x%zx bytes\n", reclaimed);
+	} else {
+		printf("unrecognized command\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("shrink", "memory shrinkers", &cmd_shrink)
+STATIC_COMMAND_END(shrink);
+
+#endif
+
@@ -34,12 +34,16 @@
 #include <assert.h>
 #include <list.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <err.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
+#include <kernel/mutex.h>
 #include <kernel/debug.h>
+#include <kernel/mp.h>
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
@@ -49,34 +53,199 @@
 #endif
 
 #if THREAD_STATS
-struct thread_stats thread_stats;
+struct thread_stats thread_stats[SMP_MAX_CPUS];
 #endif
 
 /* global thread list */
 static struct list_node thread_list;
 
+#if WITH_SMP
+/* the per cpu critical section counts and the lock the outermost one holds */
+int cpu_critical_section_count[SMP_MAX_CPUS];
+spin_lock_t thread_lock;
+#else
 /* the global critical section count */
 int critical_section_count;
+#endif
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one set per cpu */
+static struct list_node run_queue[SMP_MAX_CPUS][NUM_PRIORITIES];
+static uint32_t run_queue_bitmap[SMP_MAX_CPUS];
 
 /* the bootstrap thread (statically allocated) */
 static thread_t bootstrap_thread;
 
-/* the idle thread */
-static thread_t *idle_thread;
+/* the idle threads, one per cpu. they are never in a run queue, a cpu
+ * switches to its idle thread when it finds nothing else to run */
+static thread_t *idle_threads[SMP_MAX_CPUS];
+
+#if WITH_SMP
+/* the thread each cpu is running, for scheduling decisions made on other cpus */
+static thread_t *cpu_current_thread[SMP_MAX_CPUS];
+
+/* statically allocated threads to cover the secondary cpus' boot state */
+static thread_t secondary_bootstrap_threads[SMP_MAX_CPUS - 1];
+#endif
+
+/* The deadline class: a queue per cpu sorted by absolute deadline, the share of
+ * each cpu admitted to it, and the timer enforcing the budget of the deadline
+ * thread running on each cpu. */
+#ifndef DEADLINE_MAX_UTILIZATION
+#define DEADLINE_MAX_UTILIZATION 950000 /* parts per million of a cpu */
+#endif
+
+static struct list_node deadline_queue[SMP_MAX_CPUS];
+static uint deadline_utilization[SMP_MAX_CPUS];
+static timer_t deadline_budget_timer[SMP_MAX_CPUS];
+static thread_t *deadline_running[SMP_MAX_CPUS];
+static lk_time_ns_t deadline_start[SMP_MAX_CPUS];
+
+/* Caches of dead threads' structs and stacks, so creating a thread usually
+ * doesn't have to go to the heap. Stacks are cached per size, each bucket is
+ * claimed by the first size freed into it. Protected by the critical section
+ * rather than a mutex, since an exiting thread releases its own. */
+#ifndef THREAD_CACHE_MAX
+#define THREAD_CACHE_MAX 8 /* per cache */
+#endif
+#ifndef THREAD_CACHE_WARM
+#define THREAD_CACHE_WARM 0 /* structs and default sized stacks to preallocate */
+#endif
+#define THREAD_STACK_CACHE_BUCKETS 4
+
+static struct list_node thread_struct_cache = LIST_INITIAL_VALUE(thread_struct_cache);
+static uint thread_struct_cache_count;
+
+static struct thread_stack_cache {
+	size_t size; /* 0 if unclaimed */
+	struct list_node list;
+	uint count;
+} thread_stack_cache[THREAD_STACK_CACHE_BUCKETS];
 
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+static void thread_deadline_stop(uint cpu, lk_time_ns_t now);
+static void thread_deadline_start(thread_t *t, uint cpu, lk_time_ns_t now);
+static void thread_deadline_leave(thread_t *t);
+static void thread_deadline_wakeup(thread_t *t);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
-static timer_t preempt_timer;
+/* tickless: the quantum is in ms and ended by a one shot preemption timer */
+#define THREAD_QUANTUM 50
+
+/* preemption timers, one per cpu, and when the running thread's quantum started */
+static timer_t preempt_timer[SMP_MAX_CPUS];
+static lk_time_t quantum_start[SMP_MAX_CPUS];
+
+static enum handler_return thread_preempt_timer_tick(timer_t *timer, lk_time_t now, void *arg);
+static void thread_quantum_stop(thread_t *t, uint cpu, lk_time_t now);
+static void thread_quantum_start(thread_t *t, uint cpu, lk_time_t now);
+#else
+/* the quantum is counted down by the 10ms periodic timer tick */
+#define THREAD_QUANTUM 5
 #endif
 
+static bool thread_is_idle(thread_t *t)
+{
+	return !!(t->flags & THREAD_FLAG_IDLE);
+}
+
+static bool thread_is_deadline(thread_t *t)
+{
+	return !!(t->flags & THREAD_FLAG_DEADLINE);
+}
+
+/* pick the cpu whose run queue a newly runnable thread should go into */
+static uint thread_pick_cpu(thread_t *t)
+{
+#if WITH_SMP
+	if (t->pinned_cpu >= 0)
+		return t->pinned_cpu;
+
+	/* a thread being put back by the cpu it's running on stays there */
+	if (t->curr_cpu >= 0)
+		return t->curr_cpu;
+
+	mp_cpu_mask_t active = mp_get_active_mask();
+	mp_cpu_mask_t idle = mp_get_idle_mask() & active;
+
+	/* prefer an idle cpu, starting with the one it last ran on since the cache may still be warm */
+	if (idle) {
+		if (t->last_cpu >= 0 && (idle & (1UL << t->last_cpu)))
+			return t->last_cpu;
+		return __builtin_ctz(idle);
+	}
+
+	/* otherwise go after the cpu running the least important thread, if it's less important than us */
+	int cpu = -1;
+	int lowest = t->priority;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		thread_t *curr = cpu_current_thread[i];
+
+		if ((active & (1UL << i)) && curr && !thread_is_deadline(curr) && curr->priority < lowest) {
+			lowest = curr->priority;
+			cpu = i;
+		}
+	}
+	if (cpu >= 0)
+		return cpu;
+
+	/* everyone is busy with more important work, queue up where we were last */
+	if (t->last_cpu >= 0 && (active & (1UL << t->last_cpu)))
+		return t->last_cpu;
+
+	return arch_curr_cpu_num();
+#else
+	return 0;
+#endif
+}
+
+/* let a remote cpu know it has been handed a thread it should consider running */
+static void thread_kick_cpu(thread_t *t, uint cpu)
+{
+#if WITH_SMP
+	if (cpu == arch_curr_cpu_num())
+		return;
+
+	thread_t *curr = cpu_current_thread[cpu];
+	bool preempt;
+	if (!curr)
+		preempt = true;
+	else if (thread_is_deadline(t))
+		preempt = !thread_is_deadline(curr) || t->dl.abs_deadline < curr->dl.abs_deadline;
+	else
+		preempt = !thread_is_deadline(curr) && t->priority > curr->priority;
+
+	if ((mp_get_idle_mask() & (1UL << cpu)) || preempt) {
+		/* mark it busy now so the next wakeup looks elsewhere */
+		mp_set_cpu_busy(cpu);
+		mp_reschedule(1UL << cpu);
+	}
+#endif
+}
+
+/* deadline threads go in their cpu's deadline queue, in order of absolute deadline */
+static void insert_in_deadline_queue(thread_t *t)
+{
+	/* a throttled thread sits out until the next period starts */
+	if (t->dl.throttled)
+		return;
+
+	uint cpu = t->dl.cpu;
+	thread_t *temp;
+
+	list_for_every_entry(&deadline_queue[cpu], temp, thread_t, queue_node) {
+		if (temp->dl.abs_deadline > t->dl.abs_deadline) {
+			list_add_before(&temp->queue_node, &t->queue_node);
+			thread_kick_cpu(t, cpu);
+			return;
+		}
+	}
+	list_add_tail(&deadline_queue[cpu], &t->queue_node);
+
+	thread_kick_cpu(t, cpu);
+}
+
 /* run queue manipulation */
 static void insert_in_run_queue_head(thread_t *t)
 {
@@ -87,8 +256,25 @@ static void insert_in_run_queue_head(thread_t *t)
 	ASSERT(in_critical_section());
 #endif
 
-	list_add_head(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	/* the idle threads live outside of the run queues */
+	if (thread_is_idle(t))
+		return;
+
+#if THREAD_STATS
+	t->stats.last_ready_timestamp = current_time_hires();
+#endif
+
+	if (thread_is_deadline(t)) {
+		insert_in_deadline_queue(t);
+		return;
+	}
+
+	uint cpu = thread_pick_cpu(t);
+
+	list_add_head(&run_queue[cpu][t->priority], &t->queue_node);
+	run_queue_bitmap[cpu] |= (1<<t->priority);
+
+	thread_kick_cpu(t, cpu);
 }
 
 static void insert_in_run_queue_tail(thread_t *t)
@@ -100,14 +286,209 @@ static void insert_in_run_queue_tail(thread_t *t)
 	ASSERT(in_critical_section());
 #endif
 
-	list_add_tail(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	/* the idle threads live outside of the run queues */
+	if (thread_is_idle(t))
+		return;
+
+#if THREAD_STATS
+	t->stats.last_ready_timestamp = current_time_hires();
+#endif
+
+	if (thread_is_deadline(t)) {
+		insert_in_deadline_queue(t);
+		return;
+	}
+
+	uint cpu = thread_pick_cpu(t);
+
+	list_add_tail(&run_queue[cpu][t->priority], &t->queue_node);
+	run_queue_bitmap[cpu] |= (1<<t->priority);
+
+	thread_kick_cpu(t, cpu);
+}
+
+static void remove_from_run_queue(thread_t *t)
+{
+#if THREAD_CHECKS
+	ASSERT(t->state == THREAD_READY);
+	ASSERT(list_in_list(&t->queue_node));
+	ASSERT(in_critical_section());
+#endif
+
+	list_delete(&t->queue_node);
+
+	/* we don't track which cpu's queue it was on, so fix up any bitmap it may have emptied */
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (list_is_empty(&run_queue[i][t->priority]))
+			run_queue_bitmap[i] &= ~(1<<t->priority);
+	}
+}
+
+/* wait queues are sorted by priority, put the thread behind everyone at least as important */
+static void insert_in_wait_queue(wait_queue_t *wait, thread_t *t)
+{
+	thread_t *temp;
+
+	list_for_every_entry(&wait->list, temp, thread_t, queue_node) {
+		if (temp->priority < t->priority) {
+			list_add_before(&temp->queue_node, &t->queue_node);
+			return;
+		}
+	}
+	list_add_tail(&wait->list, &t->queue_node);
+}
+
+static int run_queue_top_priority(uint cpu)
+{
+	if (run_queue_bitmap[cpu] == 0)
+		return -1;
+
+	return HIGHEST_PRIORITY - __builtin_clz(run_queue_bitmap[cpu]) - (32 - NUM_PRIORITIES);
+}
+
+/* find the next thread for a cpu to run, taking it from another cpu's
+ * run queue if that one has more important work waiting */
+static thread_t *get_top_thread(uint cpu)
+{
+	thread_t *newthread = NULL;
+	uint queue_cpu = cpu;
+
+	// at the moment, can't deal with more than 32 priority levels
+	ASSERT(NUM_PRIORITIES <= 32);
+
+	/* the deadline class always goes first */
+	newthread = list_remove_head_type(&deadline_queue[cpu], thread_t, queue_node);
+	if (newthread)
+		return newthread;
+
+	int next_queue = run_queue_top_priority(cpu);
+	//dprintf(SPEW, "bitmap 0x%x, next %d\n", run_queue_bitmap[cpu], next_queue);
+
+	if (next_queue >= 0)
+		newthread = list_peek_head_type(&run_queue[cpu][next_queue], thread_t, queue_node);
+
+#if WITH_SMP
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (i == cpu)
+			continue;
+
+		int remote_queue = run_queue_top_priority(i);
+		if (remote_queue <= next_queue)
+			continue;
+
+		/* only threads that aren't bound to their cpu can move */
+		thread_t *t;
+		list_for_every_entry(&run_queue[i][remote_queue], t, thread_t, queue_node) {
+			if (t->pinned_cpu < 0) {
+				newthread = t;
+				next_queue = remote_queue;
+				queue_cpu = i;
+				break;
+			}
+		}
+	}
+#endif
+
+	if (!newthread)
+		return idle_threads[cpu];
+
+	list_delete(&newthread->queue_node);
+	if (list_is_empty(&run_queue[queue_cpu][next_queue]))
+		run_queue_bitmap[queue_cpu] &= ~(1<<next_queue);
+
+	return newthread;
+}
+
+static thread_t *thread_struct_alloc(void)
+{
+	enter_critical_section();
+	thread_t *t = list_remove_head_type(&thread_struct_cache, thread_t, thread_list_node);
+	if (t)
+		thread_struct_cache_count--;
+	exit_critical_section();
+
+	if (!t)
+		t = malloc(sizeof(thread_t));
+
+	return t;
+}
+
+/* must be called in a critical section. the thread may still be running on
+ * its way out, nobody can pick it back up until the critical section is dropped
+ * on the other side of the context switch. */
+static bool thread_struct_cache_put(thread_t *t)
+{
+	if (thread_struct_cache_count >= THREAD_CACHE_MAX)
+		return false;
+
+	list_add_head(&thread_struct_cache, &t->thread_list_node);
+	thread_struct_cache_count++;
+	return true;
+}
+
+static struct thread_stack_cache *thread_stack_cache_bucket(size_t size, bool claim)
+{
+	for (uint i = 0; i < THREAD_STACK_CACHE_BUCKETS; i++) {
+		if (thread_stack_cache[i].size == size)
+			return &thread_stack_cache[i];
+	}
+
+	if (claim) {
+		for (uint i = 0; i < THREAD_STACK_CACHE_BUCKETS; i++) {
+			if (thread_stack_cache[i].size == 0) {
+				thread_stack_cache[i].size = size;
+				return &thread_stack_cache[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void *thread_stack_alloc(size_t size)
+{
+	void *stack = NULL;
+
+	enter_critical_section();
+	struct thread_stack_cache *c = thread_stack_cache_bucket(size, false);
+	if (c) {
+		stack = list_remove_head(&c->list);
+		if (stack)
+			c->count--;
+	}
+	exit_critical_section();
+
+	if (!stack)
+		stack = malloc(size);
+
+	return stack;
+}
+
+/* must be called in a critical section, same rules as thread_struct_cache_put().
+ * the free stack is linked through its lowest address, which a thread still
+ * on its way out isn't using. */
+static bool thread_stack_cache_put(void *stack, size_t size)
+{
+	if (size < sizeof(struct list_node))
+		return false;
+
+	struct thread_stack_cache *c = thread_stack_cache_bucket(size, true);
+	if (!c || c->count >= THREAD_CACHE_MAX)
+		return false;
+
+	list_add_head(&c->list, (struct list_node *)stack);
+	c->count++;
+	return true;
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
 {
 	memset(t, 0, sizeof(thread_t));
 	t->magic = THREAD_MAGIC;
+	t->curr_cpu = -1;
+	t->last_cpu = -1;
+	t->pinned_cpu = -1;
+	list_initialize(&t->held_mutexes);
 	strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -143,7 +524,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 	unsigned int flags = 0;
 
 	if (!t) {
-		t = malloc(sizeof(thread_t));
+		t = thread_struct_alloc();
 		if (!t)
 			return NULL;
 		flags |= THREAD_FLAG_FREE_STRUCT;
@@ -153,7 +534,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 
 	t->entry = entry;
 	t->arg = arg;
-	t->priority = priority;
+	t->priority = t->base_priority = priority;
 	t->saved_critical_section_count = 1; /* we always start inside a critical section */
 	t->state = THREAD_SUSPENDED;
 	t->blocking_wait_queue = NULL;
@@ -164,10 +545,15 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 
 	/* create the stack */
 	if (!stack) {
-		t->stack = malloc(stack_size);
+		t->stack = thread_stack_alloc(stack_size);
 		if (!t->stack) {
-			if (flags & THREAD_FLAG_FREE_STRUCT)
-				free(t);
+			if (flags & THREAD_FLAG_FREE_STRUCT) {
+				enter_critical_section();
+				bool cached = thread_struct_cache_put(t);
+				exit_critical_section();
+				if (!cached)
+					free(t);
+			}
 			return NULL;
 		}
 		flags |= THREAD_FLAG_FREE_STACK;
@@ -220,7 +606,7 @@ status_t thread_set_real_time(thread_t *t)
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	if (t == get_current_thread()) {
 		/* if we're currently running, cancel the preemption timer. */
-		timer_cancel(&preempt_timer);
+		timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
 	}
 #endif
 	t->flags |= THREAD_FLAG_REAL_TIME;
@@ -231,7 +617,47 @@ status_t thread_set_real_time(thread_t *t)
 
 static bool thread_is_real_time(thread_t *t)
 {
-	return !!(t->flags & THREAD_FLAG_REAL_TIME);
+	/* the deadline class has its own budget enforcement instead of the quantum */
+	return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_DEADLINE));
+}
+
+/**
+ * @brief Bind a thread to a cpu
+ *
+ * @param t    Thread to bind
+ * @param cpu  The cpu the thread may run on, or -1 to let it run on any cpu
+ *
+ * Takes effect the next time the thread is placed in a run queue.
+ */
+void thread_set_pinned_cpu(thread_t *t, int cpu)
+{
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+#endif
+	ASSERT(cpu >= -1 && cpu < SMP_MAX_CPUS);
+
+	enter_critical_section();
+	t->pinned_cpu = cpu;
+	exit_critical_section();
+}
+
+/**
+ * @brief Is a thread running on some cpu right now
+ *
+ * Doesn't take the thread lock, so the answer may be stale by the time
+ * it's returned.  Only good as a hint, e.g. for deciding whether to spin.
+ */
+bool thread_is_on_cpu(thread_t *t)
+{
+#if WITH_SMP
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (((thread_t * volatile *)cpu_current_thread)[i] == t)
+			return true;
+	}
+	return false;
+#else
+	return t == get_current_thread();
+#endif
 }
 
 /**
@@ -254,6 +680,7 @@ status_t thread_resume(thread_t *t)
 	enter_critical_section();
 	if (t->state == THREAD_SUSPENDED) {
 		t->state = THREAD_READY;
+		thread_deadline_wakeup(t);
 		insert_in_run_queue_head(t);
 		thread_yield();
 	}
@@ -311,14 +738,20 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 	/* clear the structure's magic */
 	t->magic = 0;
 
-	exit_critical_section();
+	/* recycle its stack and the thread structure itself, or free them if the caches are full.
+	 * once the struct is in the cache it's fair game, so don't touch it after */
+	void *stack = NULL;
+	if (t->flags & THREAD_FLAG_FREE_STACK && t->stack && !thread_stack_cache_put(t->stack, t->stack_size))
+		stack = t->stack;
 
-	/* free its stack and the thread structure itself */
-	if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-		free(t->stack);
+	void *free_struct = NULL;
+	if (t->flags & THREAD_FLAG_FREE_STRUCT && !thread_struct_cache_put(t))
+		free_struct = t;
 
-	if (t->flags & THREAD_FLAG_FREE_STRUCT)
-		free(t);
+	exit_critical_section();
+
+	free(stack);
+	free(free_struct);
 
 	return NO_ERROR;
 }
@@ -372,6 +805,10 @@ void thread_exit(int retcode)
 	current_thread->state = THREAD_DEATH;
 	current_thread->retcode = retcode;
 
+	/* give back whatever it had reserved in the deadline class */
+	if (thread_is_deadline(current_thread))
+		thread_deadline_leave(current_thread);
+
 	/* if we're detached, then do our teardown here */
 	if (current_thread->flags & THREAD_FLAG_DETACHED) {
 		/* remove it from the master thread list */
@@ -380,11 +817,13 @@ void thread_exit(int retcode)
 		/* clear the structure's magic */
 		current_thread->magic = 0;
 
-		/* free its stack and the thread structure itself */
-		if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack)
+		/* recycle its stack and the thread structure itself, or free them
+		 * once we're off of them if the caches are full */
+		if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack &&
+		        !thread_stack_cache_put(current_thread->stack, current_thread->stack_size))
 			heap_delayed_free(current_thread->stack);
 
-		if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
+		if (current_thread->flags & THREAD_FLAG_FREE_STRUCT && !thread_struct_cache_put(current_thread))
 			heap_delayed_free(current_thread);
 	} else {
 		/* signal if anyone is waiting */
@@ -419,6 +858,7 @@ void thread_resched(void)
 	thread_t *newthread;
 
 	thread_t *current_thread = get_current_thread();
+	uint cpu = arch_curr_cpu_num();
 
 //	printf("thread_resched: current %p: ", current_thread);
 //	dump_thread(current_thread);
@@ -431,21 +871,8 @@ void thread_resched(void)
 
 	oldthread = current_thread;
 
-	// at the moment, can't deal with more than 32 priority levels
-	ASSERT(NUM_PRIORITIES <= 32);
-
 	// should at least find the idle thread
-#if THREAD_CHECKS
-	ASSERT(run_queue_bitmap != 0);
-#endif
-
-	int next_queue = HIGHEST_PRIORITY - __builtin_clz(run_queue_bitmap) - (32 - NUM_PRIORITIES);
-	//dprintf(SPEW, "bitmap 0x%x, next %d\n", run_queue_bitmap, next_queue);
-
-	newthread = list_remove_head_type(&run_queue[next_queue], thread_t, queue_node);
-
-	if (list_is_empty(&run_queue[next_queue]))
-		run_queue_bitmap &= ~(1<<next_queue);
+	newthread = get_top_thread(cpu);
 
 #if THREAD_CHECKS
 	ASSERT(newthread);
@@ -456,24 +883,62 @@ void thread_resched(void)
 
 	newthread->state = THREAD_RUNNING;
 
-	if (newthread == oldthread)
+	/* charge the deadline thread that was running for its time, and start the
+	 * budget timer for the new one, even if it's the same thread continuing */
+	if (deadline_running[cpu] || thread_is_deadline(newthread)) {
+		lk_time_ns_t now = current_time_ns();
+		thread_deadline_stop(cpu, now);
+		if (thread_is_deadline(newthread))
+			thread_deadline_start(newthread, cpu, now);
+	}
+
+	if (newthread == oldthread) {
+#if PLATFORM_HAS_DYNAMIC_TIMER
+		/* we keep running, but if our quantum is used up we need a new one
+		 * or nothing will ever preempt us */
+		if (newthread->remaining_quantum <= 0) {
+			lk_time_t now = current_time();
+			thread_quantum_stop(newthread, cpu, now);
+			thread_quantum_start(newthread, cpu, now);
+		}
+#endif
 		return;
+	}
 
 	/* set up quantum for the new thread if it was consumed */
 	if (newthread->remaining_quantum <= 0) {
-		newthread->remaining_quantum = 5; // XXX make this smarter
+		newthread->remaining_quantum = THREAD_QUANTUM;
 	}
 
+	/* track which cpu the threads are on and whether this cpu has anything to do */
+	oldthread->curr_cpu = -1;
+	newthread->curr_cpu = cpu;
+	newthread->last_cpu = cpu;
+	if (thread_is_idle(newthread))
+		mp_set_cpu_idle(cpu);
+	else
+		mp_set_cpu_busy(cpu);
+#if WITH_SMP
+	cpu_current_thread[cpu] = newthread;
+#endif
+
 #if THREAD_STATS
 	THREAD_STATS_INC(context_switches);
 
-	if (oldthread == idle_thread) {
-		lk_bigtime_t now = current_time_hires();
-		thread_stats.idle_time += now - thread_stats.last_idle_timestamp;
+	lk_bigtime_t stats_now = current_time_hires();
+	if (thread_is_idle(oldthread)) {
+		thread_stats[cpu].idle_time += stats_now - thread_stats[cpu].last_idle_timestamp;
 	}
-	if (newthread == idle_thread) {
-		thread_stats.last_idle_timestamp = current_time_hires();
+	if (thread_is_idle(newthread)) {
+		thread_stats[cpu].last_idle_timestamp = stats_now;
 	}
+
+	/* per thread accounting, the idle threads never wait in a run queue */
+	oldthread->stats.total_run_time += stats_now - oldthread->stats.last_run_timestamp;
+	newthread->stats.last_run_timestamp = stats_now;
+	if (!thread_is_idle(newthread))
+		newthread->stats.total_wait_time += stats_now - newthread->stats.last_ready_timestamp;
+	newthread->stats.context_switches++;
 #endif
 
 	KEVLOG_THREAD_SWITCH(oldthread, newthread);
@@ -484,21 +949,16 @@ void thread_resched(void)
 #endif
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	if (thread_is_real_time(newthread)) {
-		if (!thread_is_real_time(oldthread)) {
-			/* if we're switching from a non real time to a real time, cancel
-			 * the preemption timer. */
-			timer_cancel(&preempt_timer);
-		}
-	} else if (thread_is_real_time(oldthread)) {
-		/* if we're switching from a real time (or idle thread) to a regular one,
-		 * set up a periodic timer to run our preemption tick. */
-		timer_set_periodic(&preempt_timer, 10, (timer_callback)thread_timer_tick, NULL);
-	}
+	/* charge the old thread for the time it actually ran and arm a one shot
+	 * timer for the end of the new thread's quantum. real time and idle threads
+	 * run without one, so an idle cpu is left alone until the next timer event. */
+	lk_time_t now = current_time();
+	thread_quantum_stop(oldthread, cpu, now);
+	thread_quantum_start(newthread, cpu, now);
 #endif
 
 	/* set some optional target debug leds */
-	target_set_debug_led(0, newthread != idle_thread);
+	target_set_debug_led(0, !thread_is_idle(newthread));
 
 	/* do the switch */
 	oldthread->saved_critical_section_count = critical_section_count;
@@ -564,8 +1024,10 @@ void thread_preempt(void)
 #endif
 
 #if THREAD_STATS
-	if (current_thread != idle_thread)
+	if (!thread_is_idle(current_thread)) {
 		THREAD_STATS_INC(preempts); /* only track when a meaningful preempt happens */
+		current_thread->stats.preempts++;
+	}
 #endif
 
 	KEVLOG_THREAD_PREEMPT(current_thread);
@@ -612,6 +1074,7 @@ void thread_unblock(thread_t *t, bool resched)
 #endif
 
 	t->state = THREAD_READY;
+	thread_deadline_wakeup(t);
 	insert_in_run_queue_head(t);
 	if (resched)
 		thread_resched();
@@ -632,6 +1095,366 @@ enum handler_return thread_timer_tick(void)
 	}
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* timer callback for the per cpu preemption timers, fires when the quantum runs out */
+static enum handler_return thread_preempt_timer_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+#if WITH_SMP
+	uint cpu = (uintptr_t)arg;
+
+	/* the timer may fire on a cpu other than the one it is for, in which
+	 * case expire the thread running over there and poke that cpu */
+	if (cpu != arch_curr_cpu_num()) {
+		thread_t *t = cpu_current_thread[cpu];
+
+		if (t && !thread_is_real_time(t)) {
+			t->remaining_quantum = 0;
+			mp_reschedule(1UL << cpu);
+		}
+
+		return INT_NO_RESCHEDULE;
+	}
+#endif
+
+	thread_t *current_thread = get_current_thread();
+	if (thread_is_real_time(current_thread))
+		return INT_NO_RESCHEDULE;
+
+	current_thread->remaining_quantum = 0;
+	return INT_RESCHEDULE;
+}
+
+/* stop the preemption timer and charge the thread for the part of its quantum it used */
+static void thread_quantum_stop(thread_t *t, uint cpu, lk_time_t now)
+{
+	if (thread_is_real_time(t))
+		return;
+
+	timer_cancel(&preempt_timer[cpu]);
+	t->remaining_quantum -= now - quantum_start[cpu];
+}
+
+/* arm the preemption timer for the rest of the thread's quantum */
+static void thread_quantum_start(thread_t *t, uint cpu, lk_time_t now)
+{
+	if (thread_is_real_time(t))
+		return;
+
+	if (t->remaining_quantum <= 0)
+		t->remaining_quantum = THREAD_QUANTUM;
+
+	quantum_start[cpu] = now;
+	timer_set_oneshot(&preempt_timer[cpu], t->remaining_quantum, thread_preempt_timer_tick, (void *)(uintptr_t)cpu);
+}
+#endif
+
+/* stop the budget timer and charge the running deadline thread for its time */
+static void thread_deadline_stop(uint cpu, lk_time_ns_t now)
+{
+	thread_t *t = deadline_running[cpu];
+
+	if (!t)
+		return;
+
+	timer_cancel(&deadline_budget_timer[cpu]);
+	t->dl.budget -= now - deadline_start[cpu];
+	deadline_running[cpu] = NULL;
+}
+
+/* start the next period of a deadline thread, skipping any it slept through entirely */
+static void thread_deadline_new_period(thread_t *t, lk_time_ns_t now)
+{
+	t->dl.release += t->dl.period;
+	if (t->dl.release + t->dl.period <= now)
+		t->dl.release += ((now - t->dl.release) / t->dl.period) * t->dl.period;
+
+	t->dl.abs_deadline = t->dl.release + t->dl.deadline;
+	t->dl.budget = t->dl.runtime;
+	t->dl.throttled = false;
+}
+
+/* a deadline thread coming off a wait queue or out of a sleep keeps its deadline
+ * and budget only if it can't get more than its reserved share out of them, ie
+ * if budget / (deadline - now) is within runtime / period. otherwise a new
+ * period starts now (the constant bandwidth server wakeup rule), or it would
+ * sort ahead of threads with current deadlines and run on a stale budget. */
+static void thread_deadline_wakeup(thread_t *t)
+{
+	if (!thread_is_deadline(t) || t->dl.throttled)
+		return;
+
+	lk_time_ns_t now = current_time_ns();
+	if (t->dl.abs_deadline <= now ||
+	        (unsigned long long)MAX(t->dl.budget, 0) * 1000000ULL >
+	        (t->dl.abs_deadline - now) * t->dl.utilization) {
+		t->dl.release = now;
+		t->dl.abs_deadline = now + t->dl.deadline;
+		t->dl.budget = t->dl.runtime;
+	}
+}
+
+/* timer callback at the start of a throttled deadline thread's next period */
+static enum handler_return thread_deadline_replenish(timer_t *timer, lk_time_t now, void *arg)
+{
+	thread_t *t = (thread_t *)arg;
+
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(thread_is_deadline(t));
+#endif
+
+	thread_deadline_new_period(t, current_time_ns());
+
+	/* it was either waiting for the period to start or preempted for overrunning */
+	if (t->state == THREAD_SLEEPING)
+		t->state = THREAD_READY;
+
+	if (t->state == THREAD_READY && !list_in_list(&t->queue_node) && t->curr_cpu < 0) {
+		insert_in_run_queue_head(t);
+		return INT_RESCHEDULE;
+	}
+
+	return INT_NO_RESCHEDULE;
+}
+
+/* take a deadline thread out of the running until its next period starts */
+static void thread_deadline_throttle(thread_t *t, lk_time_ns_t now)
+{
+	lk_time_ns_t next = t->dl.release + t->dl.period;
+
+	t->dl.throttled = true;
+	timer_cancel(&t->dl.timer);
+	timer_set_oneshot_ns(&t->dl.timer, (next > now) ? next - now : 1, thread_deadline_replenish, t);
+}
+
+/* timer callback for the per cpu budget timers, fires when a deadline thread overruns */
+static enum handler_return thread_deadline_budget_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+	uint cpu = (uintptr_t)arg;
+	thread_t *t = deadline_running[cpu];
+
+	if (!t)
+		return INT_NO_RESCHEDULE;
+
+	lk_time_ns_t now_ns = current_time_ns();
+	t->dl.budget -= now_ns - deadline_start[cpu];
+	deadline_start[cpu] = now_ns;
+	t->dl.overruns++;
+	thread_deadline_throttle(t, now_ns);
+
+#if WITH_SMP
+	/* the timer may fire on a cpu other than the one it is for */
+	if (cpu != arch_curr_cpu_num()) {
+		mp_reschedule(1UL << cpu);
+		return INT_NO_RESCHEDULE;
+	}
+#endif
+
+	return INT_RESCHEDULE;
+}
+
+/* arm the budget timer for what's left of the thread's runtime this period */
+static void thread_deadline_start(thread_t *t, uint cpu, lk_time_ns_t now)
+{
+	deadline_running[cpu] = t;
+	deadline_start[cpu] = now;
+	timer_set_oneshot_ns(&deadline_budget_timer[cpu], (t->dl.budget > 0) ? (lk_time_ns_t)t->dl.budget : 1,
+	                     thread_deadline_budget_tick, (void *)(uintptr_t)cpu);
+}
+
+/* drop a thread out of the deadline class, must be called in a critical section */
+static void thread_deadline_leave(thread_t *t)
+{
+	timer_cancel(&t->dl.timer);
+	deadline_utilization[t->dl.cpu] -= t->dl.utilization;
+
+	/* settle up with the budget it's been running on, if it's running now */
+	bool running = t->curr_cpu >= 0 && deadline_running[t->curr_cpu] == t;
+	if (running)
+		thread_deadline_stop(t->curr_cpu, current_time_ns());
+
+	/* a deadline thread in a queue or sitting out a period goes back to the run queues */
+	bool requeue = false;
+	if (t->state == THREAD_READY && t->curr_cpu < 0) {
+		if (list_in_list(&t->queue_node))
+			list_delete(&t->queue_node);
+		requeue = true;
+	} else if (t->state == THREAD_SLEEPING && t->dl.throttled) {
+		t->state = THREAD_READY;
+		requeue = true;
+	}
+
+	t->flags &= ~THREAD_FLAG_DEADLINE;
+	t->dl.throttled = false;
+
+	if (requeue)
+		insert_in_run_queue_head(t);
+
+	/* a thread that keeps running needs a fresh quantum, or nothing will preempt it */
+	if (running && t->state == THREAD_RUNNING) {
+		t->remaining_quantum = THREAD_QUANTUM;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+		thread_quantum_start(t, t->curr_cpu, current_time());
+#endif
+	}
+}
+
+/**
+ * @brief Put a thread in the earliest deadline first scheduling class
+ *
+ * Deadline threads run ahead of every priority based thread, in order of
+ * their absolute deadlines.  Each period the thread gets \a runtime ns of
+ * cpu, to be used by \a deadline ns into the period.  Running past the
+ * runtime counts as an overrun and the thread is held off until the next
+ * period.  Threads are admitted to the cpu with the most room left, as long
+ * as the total runtime / period stays within DEADLINE_MAX_UTILIZATION.
+ *
+ * @param t         Thread to change, typically the current or a suspended one
+ * @param runtime   Budget per period in ns, 0 to go back to the priority class
+ * @param deadline  Relative deadline in ns, 0 for the same as the period
+ * @param period    Period in ns, 0 for the same as the deadline
+ *
+ * @return NO_ERROR, ERR_INVALID_ARGS for nonsensical parameters or ERR_BUSY
+ * if no cpu has room for it.
+ */
+status_t thread_set_deadline(thread_t *t, lk_time_ns_t runtime, lk_time_ns_t deadline, lk_time_ns_t period)
+{
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+#endif
+
+	if (runtime == 0) {
+		enter_critical_section();
+		if (thread_is_deadline(t)) {
+			thread_deadline_leave(t);
+
+			/* it no longer runs ahead of the priority threads, let the scheduler decide */
+			if (t == get_current_thread()) {
+				t->state = THREAD_READY;
+				insert_in_run_queue_head(t);
+				thread_resched();
+			} else if (t->state == THREAD_RUNNING) {
+#if WITH_SMP
+				mp_reschedule(1UL << t->curr_cpu);
+#endif
+			}
+		}
+		exit_critical_section();
+		return NO_ERROR;
+	}
+
+	if (period == 0)
+		period = deadline;
+	if (deadline == 0)
+		deadline = period;
+	if (runtime > deadline || deadline > period)
+		return ERR_INVALID_ARGS;
+
+	uint utilization = (runtime * 1000000ULL) / period;
+
+	enter_critical_section();
+
+	/* its old reservation doesn't count against it */
+	if (thread_is_deadline(t))
+		deadline_utilization[t->dl.cpu] -= t->dl.utilization;
+
+	/* admit it to the cpu with the most room, or the one it's pinned to */
+	int cpu = -1;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!(mp_get_active_mask() & (1UL << i)))
+			continue;
+		if (t->pinned_cpu >= 0 && (uint)t->pinned_cpu != i)
+			continue;
+		if (cpu < 0 || deadline_utilization[i] < deadline_utilization[cpu])
+			cpu = i;
+	}
+
+	if (cpu < 0 || deadline_utilization[cpu] + utilization > DEADLINE_MAX_UTILIZATION) {
+		if (thread_is_deadline(t))
+			deadline_utilization[t->dl.cpu] += t->dl.utilization;
+		exit_critical_section();
+		return ERR_BUSY;
+	}
+
+	/* settle up with the budget it's been running on, if it's running now */
+	lk_time_ns_t now = current_time_ns();
+	if (t->curr_cpu >= 0 && deadline_running[t->curr_cpu] == t)
+		thread_deadline_stop(t->curr_cpu, now);
+
+	if (!thread_is_deadline(t)) {
+		timer_initialize(&t->dl.timer);
+		t->dl.overruns = t->dl.misses = 0;
+	}
+	timer_cancel(&t->dl.timer);
+
+	deadline_utilization[cpu] += utilization;
+	t->dl.cpu = cpu;
+	t->dl.utilization = utilization;
+	t->dl.runtime = runtime;
+	t->dl.deadline = deadline;
+	t->dl.period = period;
+	t->dl.release = now;
+	t->dl.abs_deadline = now + deadline;
+	t->dl.budget = runtime;
+
+	/* if it was sitting out a period, the new parameters start a fresh one */
+	if (t->state == THREAD_SLEEPING && t->dl.throttled)
+		t->state = THREAD_READY;
+	t->dl.throttled = false;
+	t->flags |= THREAD_FLAG_DEADLINE;
+
+	/* move it over to the deadline queue, or get it rescheduled wherever it's running */
+	if (t == get_current_thread()) {
+		t->state = THREAD_READY;
+		insert_in_run_queue_head(t);
+		thread_resched();
+	} else if (t->state == THREAD_READY && t->curr_cpu < 0) {
+		if (list_in_list(&t->queue_node))
+			remove_from_run_queue(t);
+		insert_in_run_queue_head(t);
+	} else if (t->state == THREAD_RUNNING) {
+#if WITH_SMP
+		mp_reschedule(1UL << t->curr_cpu);
+#endif
+	}
+
+	exit_critical_section();
+
+	return NO_ERROR;
+}
+
+/**
+ * @brief Finish the current period's work
+ *
+ * Called by a deadline thread when it's done for this period.  Counts a
+ * deadline miss if it's late, then sleeps until the next period starts.
+ *
+ * @return ERR_NOT_VALID if the current thread isn't in the deadline class.
+ */
+status_t thread_deadline_wait_next_period(void)
+{
+	thread_t *current_thread = get_current_thread();
+
+	enter_critical_section();
+
+	if (!thread_is_deadline(current_thread)) {
+		exit_critical_section();
+		return ERR_NOT_VALID;
+	}
+
+	lk_time_ns_t now = current_time_ns();
+	if (now > current_thread->dl.abs_deadline)
+		current_thread->dl.misses++;
+
+	current_thread->state = THREAD_SLEEPING;
+	thread_deadline_throttle(current_thread, now);
+	thread_resched();
+
+	exit_critical_section();
+
+	return NO_ERROR;
+}
+
 /* timer callback to wake up a sleeping thread */
 static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, void *arg)
 {
@@ -643,6 +1466,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
 #endif
 
 	t->state = THREAD_READY;
+	thread_deadline_wakeup(t);
 	insert_in_run_queue_head(t);
 
 	return INT_RESCHEDULE;
@@ -659,6 +1483,16 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
  * be placed at the head of the run queue.
  */
 void thread_sleep(lk_time_t delay)
+{
+	thread_sleep_ns(timer_ms_to_ns(delay));
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * Same as thread_sleep(), with the resolution of the platform's timer.
+ */
+void thread_sleep_ns(lk_time_ns_t delay)
 {
 	timer_t timer;
 
@@ -672,7 +1506,7 @@ void thread_sleep(lk_time_t delay)
 	timer_initialize(&timer);
 
 	enter_critical_section();
-	timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
+	timer_set_oneshot_ns(&timer, delay, thread_sleep_handler, (void *)current_thread);
 	current_thread->state = THREAD_SLEEPING;
 	thread_resched();
 	exit_critical_section();
@@ -685,27 +1519,38 @@ void thread_sleep(lk_time_t delay)
  */
 void thread_init_early(void)
 {
-	int i;
+	uint i, cpu;
 
 	/* initialize the run queues */
-	for (i=0; i < NUM_PRIORITIES; i++)
-		list_initialize(&run_queue[i]);
+	for (cpu=0; cpu < SMP_MAX_CPUS; cpu++)
+		for (i=0; i < NUM_PRIORITIES; i++)
+			list_initialize(&run_queue[cpu][i]);
 
 	/* initialize the thread list */
 	list_initialize(&thread_list);
 
+	for (i=0; i < THREAD_STACK_CACHE_BUCKETS; i++)
+		list_initialize(&thread_stack_cache[i].list);
+
+	for (cpu=0; cpu < SMP_MAX_CPUS; cpu++)
+		list_initialize(&deadline_queue[cpu]);
+
 	/* create a thread to cover the current running state */
 	thread_t *t = &bootstrap_thread;
 	init_thread_struct(t, "bootstrap");
 
 	/* half construct this thread, since we're already running */
-	t->priority = HIGHEST_PRIORITY;
+	t->priority = t->base_priority = HIGHEST_PRIORITY;
 	t->state = THREAD_RUNNING;
 	t->saved_critical_section_count = 1;
 	t->flags = THREAD_FLAG_DETACHED;
+	t->curr_cpu = t->last_cpu = arch_curr_cpu_num();
 	wait_queue_init(&t->retcode_wait_queue);
 	list_add_head(&thread_list, &t->thread_list_node);
 	set_current_thread(t);
+#if WITH_SMP
+	cpu_current_thread[t->curr_cpu] = t;
+#endif
 }
 
 /**
@@ -716,8 +1561,25 @@ void thread_init_early(void)
 void thread_init(void)
 {
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	timer_initialize(&preempt_timer);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		timer_initialize(&preempt_timer[i]);
 #endif
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		timer_initialize(&deadline_budget_timer[i]);
+
+	/* prime the caches so the first few threads don't have to go to the heap */
+	for (int i = 0; i < MIN(THREAD_CACHE_WARM, THREAD_CACHE_MAX); i++) {
+		thread_t *t = malloc(sizeof(thread_t));
+		void *stack = malloc(DEFAULT_STACK_SIZE);
+
+		enter_critical_section();
+		if (t)
+			thread_struct_cache_put(t);
+		if (stack)
+			thread_stack_cache_put(stack, DEFAULT_STACK_SIZE);
+		exit_critical_section();
+	}
 }
 
 /**
@@ -736,11 +1598,59 @@ void thread_set_name(const char *name)
  */
 void thread_set_priority(int priority)
 {
+	thread_t *t = get_current_thread();
+
 	if (priority < LOWEST_PRIORITY)
 		priority = LOWEST_PRIORITY;
 	if (priority > HIGHEST_PRIORITY)
 		priority = HIGHEST_PRIORITY;
-	get_current_thread()->priority = priority;
+
+	enter_critical_section();
+
+	/* don't drop below anything we've inherited from waiters on our mutexes */
+	t->base_priority = priority;
+	thread_set_effective_priority(t, MAX(priority, mutex_inherited_priority(t)));
+
+	exit_critical_section();
+}
+
+/**
+ * @brief Change the priority a thread is scheduled at, without touching its base priority
+ *
+ * Moves the thread to the right spot in whichever run queue or wait queue
+ * it's sitting in.  Used by the mutex code to implement priority inheritance.
+ * Must be called in a critical section.
+ */
+void thread_set_effective_priority(thread_t *t, int priority)
+{
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(in_critical_section());
+#endif
+
+	if (t->priority == priority)
+		return;
+
+	switch (t->state) {
+		case THREAD_READY:
+			/* the idle threads are ready without being in a run queue */
+			if (list_in_list(&t->queue_node)) {
+				remove_from_run_queue(t);
+				t->priority = priority;
+				insert_in_run_queue_head(t);
+			} else {
+				t->priority = priority;
+			}
+			break;
+		case THREAD_BLOCKED:
+			list_delete(&t->queue_node);
+			t->priority = priority;
+			insert_in_wait_queue(t->blocking_wait_queue, t);
+			break;
+		default:
+			t->priority = priority;
+			break;
+	}
 }
 
 /**
@@ -752,14 +1662,20 @@ void thread_set_priority(int priority)
  */
 void thread_become_idle(void)
 {
-	idle_thread = get_current_thread();
+	thread_t *t = get_current_thread();
+	uint cpu = arch_curr_cpu_num();
 
 	thread_set_name("idle");
 	thread_set_priority(IDLE_PRIORITY);
 
 	/* mark the idle thread as real time, to avoid running the preemption
 	 * timer when it is scheduled. */
-	thread_set_real_time(idle_thread);
+	thread_set_real_time(t);
+
+	/* take it out of circulation, it only runs on this cpu when nothing else will */
+	t->flags |= THREAD_FLAG_IDLE;
+	t->pinned_cpu = cpu;
+	idle_threads[cpu] = t;
 
 	/* release the implicit boot critical section and yield to the scheduler */
 	exit_critical_section();
@@ -768,6 +1684,66 @@ void thread_become_idle(void)
 	idle_thread_routine();
 }
 
+#if WITH_SMP
+/**
+ * @brief  Set up threading on a secondary cpu
+ *
+ * Builds the idle thread for the calling cpu out of its boot state. Called once
+ * per secondary cpu from lk_secondary_cpu_entry(), inside of the implicit boot
+ * critical section.
+ */
+void thread_secondary_cpu_init_early(void)
+{
+	uint cpu = arch_curr_cpu_num();
+	char name[16];
+
+	ASSERT(cpu > 0 && cpu < SMP_MAX_CPUS);
+	ASSERT(in_critical_section());
+
+	/* create a thread to cover the current running state */
+	thread_t *t = &secondary_bootstrap_threads[cpu - 1];
+	snprintf(name, sizeof(name), "idle %u", cpu);
+	init_thread_struct(t, name);
+
+	/* half construct this thread, since we're already running */
+	t->priority = t->base_priority = IDLE_PRIORITY;
+	t->state = THREAD_RUNNING;
+	t->saved_critical_section_count = 1;
+	t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE;
+	t->curr_cpu = t->last_cpu = t->pinned_cpu = cpu;
+	wait_queue_init(&t->retcode_wait_queue);
+	list_add_head(&thread_list, &t->thread_list_node);
+	set_current_thread(t);
+
+	idle_threads[cpu] = t;
+	cpu_current_thread[cpu] = t;
+
+#if THREAD_STATS
+	thread_stats[cpu].last_idle_timestamp = current_time_hires();
+#endif
+}
+
+/**
+ * @brief  Hand a secondary cpu over to the scheduler
+ *
+ * This function does not return, the calling thread becomes the cpu's idle thread.
+ */
+void thread_secondary_cpu_entry(void)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	/* the cpu is now fair game for the scheduler */
+	mp_set_curr_cpu_active(true);
+	mp_set_cpu_idle(cpu);
+
+	/* release the implicit boot critical section and yield to the scheduler */
+	exit_critical_section();
+	thread_yield();
+
+	idle_thread_routine();
+}
+#endif
+
 static const char *thread_state_to_str(enum thread_state state)
 {
 	switch (state) {
@@ -787,12 +1763,20 @@ static const char *thread_state_to_str(enum thread_state state)
 void dump_thread(thread_t *t)
 {
 	dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
-	dprintf(INFO, "\tstate %s, priority %d, remaining quantum %d, critical section %d\n",
-				  thread_state_to_str(t->state), t->priority, t->remaining_quantum,
+	dprintf(INFO, "\tstate %s, priority %d (base %d), remaining quantum %d, critical section %d\n",
+				  thread_state_to_str(t->state), t->priority, t->base_priority, t->remaining_quantum,
 				  t->saved_critical_section_count);
+	dprintf(INFO, "\tcurr cpu %d, last cpu %d, pinned cpu %d\n",
+				  t->curr_cpu, t->last_cpu, t->pinned_cpu);
 	dprintf(INFO, "\tstack %p, stack_size %zd\n", t->stack, t->stack_size);
 	dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
-	dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
+	dprintf(INFO, "\twait queue %p, wait queue ret %d, blocking mutex %p\n",
+				  t->blocking_wait_queue, t->wait_queue_block_ret, t->blocking_mutex);
+	if (thread_is_deadline(t)) {
+		dprintf(INFO, "\tdeadline cpu %u, runtime %llu, deadline %llu, period %llu, budget %lld%s\n",
+					  t->dl.cpu, t->dl.runtime, t->dl.deadline, t->dl.period, t->dl.budget,
+					  t->dl.throttled ? " (throttled)" : "");
+	}
 	dprintf(INFO, "\ttls:");
 	int i;
 	for (i=0; i < MAX_TLS_ENTRY; i++) {
@@ -815,6 +1799,72 @@ void dump_all_threads(void)
 	exit_critical_section();
 }
 
+#if THREAD_STATS
+/**
+ * @brief  Take a snapshot of every thread's cpu usage
+ *
+ * The running threads are charged for their current time slice up to now.
+ *
+ * @param usage  Array to fill in
+ * @param count  Number of entries in \a usage
+ *
+ * @return  The number of threads, which may be more than \a count
+ */
+size_t thread_get_usage(struct thread_usage *usage, size_t count)
+{
+	thread_t *t;
+	size_t i = 0;
+
+	enter_critical_section();
+	lk_bigtime_t now = current_time_hires();
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		if (i < count) {
+			struct thread_usage *u = &usage[i];
+
+			u->t = t;
+			strlcpy(u->name, t->name, sizeof(u->name));
+			u->priority = t->priority;
+			u->state = thread_state_to_str(t->state);
+			u->run_time = t->stats.total_run_time;
+			if (t->state == THREAD_RUNNING)
+				u->run_time += now - t->stats.last_run_timestamp;
+			u->wait_time = t->stats.total_wait_time;
+			u->context_switches = t->stats.context_switches;
+			u->preempts = t->stats.preempts;
+		}
+		i++;
+	}
+	exit_critical_section();
+
+	return i;
+}
+#endif
+
+/**
+ * @brief  Dump the deadline class: how much of each cpu is reserved and
+ * how each deadline thread is keeping up
+ */
+void dump_deadline_threads(void)
+{
+	thread_t *t;
+
+	enter_critical_section();
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (deadline_utilization[i] == 0)
+			continue;
+		dprintf(INFO, "deadline utilization cpu %u: %u.%02u%%\n", i,
+				  deadline_utilization[i] / 10000, (deadline_utilization[i] / 100) % 100);
+	}
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		if (!thread_is_deadline(t))
+			continue;
+		dprintf(INFO, "deadline thread %p (%s): cpu %u, runtime %llu, deadline %llu, period %llu (ns), overruns %u, misses %u\n",
+				  t, t->name, t->dl.cpu, t->dl.runtime, t->dl.deadline, t->dl.period,
+				  t->dl.overruns, t->dl.misses);
+	}
+	exit_critical_section();
+}
+
 /** @} */
 
 
@@ -860,6 +1910,16 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * value specified when the queue was woken by wait_queue_wake_one().
  */
 status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+{
+	return wait_queue_block_ns(wait, timer_ms_to_ns(timeout));
+}
+
+/**
+ * @brief  Block until a wait queue is notified, timeout specified in ns
+ *
+ * Same as wait_queue_block(), with INFINITE_TIME_NS to wait indefinitely.
+ */
+status_t wait_queue_block_ns(wait_queue_t *wait, lk_time_ns_t timeout)
 {
 	timer_t timer;
 
@@ -874,22 +1934,22 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 	if (timeout == 0)
 		return ERR_TIMED_OUT;
 
-	list_add_tail(&wait->list, &current_thread->queue_node);
+	insert_in_wait_queue(wait, current_thread);
 	wait->count++;
 	current_thread->state = THREAD_BLOCKED;
 	current_thread->blocking_wait_queue = wait;
 	current_thread->wait_queue_block_ret = NO_ERROR;
 
 	/* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
-	if (timeout != INFINITE_TIME) {
+	if (timeout != INFINITE_TIME_NS) {
 		timer_initialize(&timer);
-		timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
+		timer_set_oneshot_ns(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
 	}
 
 	thread_block();
 
 	/* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-	if (timeout != INFINITE_TIME) {
+	if (timeout != INFINITE_TIME_NS) {
 		timer_cancel(&timer);
 	}
 
@@ -931,6 +1991,7 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
 		t->state = THREAD_READY;
 		t->wait_queue_block_ret = wait_queue_error;
 		t->blocking_wait_queue = NULL;
+		thread_deadline_wakeup(t);
 
 		/* if we're instructed to reschedule, stick the current thread on the head
 		 * of the run queue first, so that the newly awakened thread gets a chance to run
@@ -994,6 +2055,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 		t->state = THREAD_READY;
 		t->wait_queue_block_ret = wait_queue_error;
 		t->blocking_wait_queue = NULL;
+		thread_deadline_wakeup(t);
 
 		insert_in_run_queue_head(t);
 		ret++;
@@ -1057,6 +2119,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 	t->blocking_wait_queue = NULL;
 	t->state = THREAD_READY;
 	t->wait_queue_block_ret = wait_queue_error;
+	thread_deadline_wakeup(t);
 	insert_in_run_queue_head(t);
 
 	return NO_ERROR;
@@ -32,12 +32,19 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Timers are kept in 64bit nanoseconds against current_time_ns(). The ms
+ * based calls are thin wrappers around the _ns ones.
+ *
+ * Pending timers are kept in a pairing heap keyed on their scheduled time,
+ * so arming a timer is O(1) and cancelling or expiring one is amortized
+ * O(log n), no matter how many timers are live.
+ *
  * @{
  */
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
-#include <list.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -46,7 +53,11 @@
 
 #define LOCAL_TRACE 0
 
-static struct list_node timer_queue;
+/* root of the timer queue heap, the next timer to expire */
+static timer_t *timer_queue;
+
+/* bumped for every timer queued, to break ties between equal scheduled times */
+static uint32_t timer_seq;
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
 
@@ -58,52 +69,160 @@ void timer_initialize(timer_t *timer)
 	*timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static bool timer_in_queue(const timer_t *timer)
+{
+	return timer->heap_prev || timer == timer_queue;
+}
+
+/* whether a is due before b. timers set for the same time fire in the order
+ * they were queued, like they did when the queue was a sorted list */
+static bool timer_before(const timer_t *a, const timer_t *b)
+{
+	if (a->scheduled_time != b->scheduled_time)
+		return a->scheduled_time < b->scheduled_time;
+
+	return (int32_t)(a->seq - b->seq) < 0;
+}
+
+/* merge two detached heaps, returning the new root */
+static timer_t *timer_heap_meld(timer_t *a, timer_t *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (timer_before(b, a)) {
+		timer_t *temp = a;
+		a = b;
+		b = temp;
+	}
+
+	/* b becomes the first child of a */
+	b->heap_prev = a;
+	b->heap_next = a->heap_child;
+	if (a->heap_child)
+		a->heap_child->heap_prev = b;
+	a->heap_child = b;
+
+	return a;
+}
+
+/* standard two pass merge of a list of sibling heaps into one */
+static timer_t *timer_heap_merge_pairs(timer_t *first)
+{
+	timer_t *pairs = NULL;
+
+	/* left to right, meld the siblings in pairs, stacking the results */
+	while (first) {
+		timer_t *a = first;
+		timer_t *b = a->heap_next;
+
+		first = b ? b->heap_next : NULL;
+
+		a->heap_next = a->heap_prev = NULL;
+		if (b)
+			b->heap_next = b->heap_prev = NULL;
+
+		a = timer_heap_meld(a, b);
+		a->heap_next = pairs;
+		pairs = a;
+	}
+
+	/* right to left, meld the pairs into the final heap */
+	timer_t *root = NULL;
+	while (pairs) {
+		timer_t *next = pairs->heap_next;
+
+		pairs->heap_next = NULL;
+		root = timer_heap_meld(root, pairs);
+		pairs = next;
+	}
+
+	return root;
+}
+
 static void insert_timer_in_queue(timer_t *timer)
 {
-	timer_t *entry;
+	LTRACEF("timer %p, scheduled %llu, periodic %llu\n", timer, timer->scheduled_time, timer->periodic_time);
 
-	LTRACEF("timer %p, scheduled %lu, periodic %lu\n", timer, timer->scheduled_time, timer->periodic_time);
+	timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+	timer->seq = timer_seq++;
+	timer_queue = timer_heap_meld(timer_queue, timer);
+}
 
-	list_for_every_entry(&timer_queue, entry, timer_t, node) {
-		if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-			list_add_before(&entry->node, &timer->node);
-			return;
-		}
+static void remove_timer_from_queue(timer_t *timer)
+{
+	DEBUG_ASSERT(timer_in_queue(timer));
+
+	if (timer == timer_queue) {
+		timer_queue = timer_heap_merge_pairs(timer->heap_child);
+	} else {
+		/* cut the timer and its children out of the heap */
+		if (timer->heap_prev->heap_child == timer)
+			timer->heap_prev->heap_child = timer->heap_next;
+		else
+			timer->heap_prev->heap_next = timer->heap_next;
+		if (timer->heap_next)
+			timer->heap_next->heap_prev = timer->heap_prev;
+
+		/* and put its children back */
+		timer_queue = timer_heap_meld(timer_queue, timer_heap_merge_pairs(timer->heap_child));
 	}
 
-	/* walked off the end of the list */
-	list_add_tail(&timer_queue, &timer->node);
+	timer->heap_child = timer->heap_next = timer->heap_prev = NULL;
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* longest delay handed to the platform timer. far off timers simply cause an
+ * early interrupt that finds nothing to do and rearms */
+#define MAX_HW_TIMER_DELAY_NS (60ULL * 1000 * 1000 * 1000)
+
+/* program the hardware timer for the timer at the head of the queue */
+static void timer_program_hw(const timer_t *head)
+{
+	lk_time_ns_t now = current_time_ns();
+	lk_time_ns_t delay = 0;
+
+	if (head->scheduled_time > now)
+		delay = MIN(head->scheduled_time - now, MAX_HW_TIMER_DELAY_NS);
+
+	LTRACEF("setting new timer for %llu nsecs for event %p\n", delay, head);
+	platform_set_oneshot_timer_ns(timer_tick, NULL, delay);
 }
+#endif
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
+static void timer_set(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t period, timer_callback callback, void *arg)
 {
-	lk_time_t now;
+	lk_time_ns_t now;
 
-	LTRACEF("timer %p, delay %lu, period %lu, callback %p, arg %p, now %lu\n", timer, delay, period, callback, arg, now);
+	LTRACEF("timer %p, delay %llu, period %llu, callback %p, arg %p\n", timer, delay, period, callback, arg);
 
 	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-	if (list_in_list(&timer->node)) {
-		panic("timer %p already in list\n", timer);
+	if (timer_in_queue(timer)) {
+		panic("timer %p already in queue\n", timer);
 	}
 
-	now = current_time();
-	timer->scheduled_time = now + delay;
+	now = current_time_ns();
+	if (delay == INFINITE_TIME_NS || delay > INFINITE_TIME_NS - now)
+		timer->scheduled_time = INFINITE_TIME_NS;
+	else
+		timer->scheduled_time = now + delay;
 	timer->periodic_time = period;
 	timer->callback = callback;
 	timer->arg = arg;
 
-	LTRACEF("scheduled time %lu\n", timer->scheduled_time);
+	LTRACEF("scheduled time %llu\n", timer->scheduled_time);
 
 	enter_critical_section();
 
 	insert_timer_in_queue(timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	if (list_peek_head_type(&timer_queue, timer_t, node) == timer) {
+	if (timer_queue == timer) {
 		/* we just modified the head of the timer queue */
-		LTRACEF("setting new timer for %u msecs\n", (uint)delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+		timer_program_hw(timer);
 	}
 #endif
 
@@ -128,7 +247,7 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 {
 	if (delay == 0)
 		delay = 1;
-	timer_set(timer, delay, 0, callback, arg);
+	timer_set(timer, timer_ms_to_ns(delay), 0, callback, arg);
 }
 
 /**
@@ -146,6 +265,39 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
  *   enum handler_return callback(struct timer *, lk_time_t now, void *arg) { ... }
  */
 void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callback, void *arg)
+{
+	if (period == 0)
+		period = 1;
+	timer_set(timer, timer_ms_to_ns(period), timer_ms_to_ns(period), callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, with nanosecond resolution
+ *
+ * Same as timer_set_oneshot(), but the delay is in ns and is not rounded up.
+ * How close to the deadline the callback runs depends on the platform's
+ * timer hardware; without PLATFORM_HAS_DYNAMIC_TIMER timers are only
+ * dispatched from the periodic tick.
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t delay, timer_callback callback, void *arg)
+{
+	timer_set(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes repeatedly, with nanosecond resolution
+ *
+ * @param  timer The timer to use
+ * @param  period The period, in ns, between executions of the timer
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_periodic_ns(timer_t *timer, lk_time_ns_t period, timer_callback callback, void *arg)
 {
 	if (period == 0)
 		period = 1;
@@ -162,11 +314,11 @@ void timer_cancel(timer_t *timer)
 	enter_critical_section();
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	timer_t *oldhead = list_peek_head_type(&timer_queue, timer_t, node);
+	timer_t *oldhead = timer_queue;
 #endif
 
-	if (list_in_list(&timer->node))
-		list_delete(&timer->node);
+	if (timer_in_queue(timer))
+		remove_timer_from_queue(timer);
 
 	/* to keep it from being reinserted into the queue if called from
 	 * periodic timer callback.
@@ -177,21 +329,12 @@ void timer_cancel(timer_t *timer)
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	/* see if we've just modified the head of the timer queue */
-	timer_t *newhead = list_peek_head_type(&timer_queue, timer_t, node);
+	timer_t *newhead = timer_queue;
 	if (newhead == NULL) {
 		LTRACEF("clearing old hw timer, nothing in the queue\n");
 		platform_stop_timer();
 	} else if (newhead != oldhead) {
-		lk_time_t delay;
-		lk_time_t now = current_time();
-
-		if (TIME_LT(newhead->scheduled_time, now))
-			delay = 0;
-		else
-			delay = newhead->scheduled_time - now;
-
-		LTRACEF("setting new timer to %u\n", (uint) delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+		timer_program_hw(newhead);
 	}
 #endif
 
@@ -203,6 +346,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 {
 	timer_t *timer;
 	enum handler_return ret = INT_NO_RESCHEDULE;
+	lk_time_ns_t now_ns = current_time_ns();
 
 	THREAD_STATS_INC(timer_ints);
 //	KEVLOG_TIMER_TICK(); // enable only if necessary
@@ -211,19 +355,19 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 	for (;;) {
 		/* see if there's an event to process */
-		timer = list_peek_head_type(&timer_queue, timer_t, node);
+		timer = timer_queue;
 		if (likely(timer == 0))
 			break;
-		LTRACEF("next item on timer queue %p at %lu now %lu (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-		if (likely(TIME_LT(now, timer->scheduled_time)))
+		LTRACEF("next item on timer queue %p at %llu now %llu (%p, arg %p)\n", timer, timer->scheduled_time, now_ns, timer->callback, timer->arg);
+		if (likely(now_ns < timer->scheduled_time))
 			break;
 
 		/* process it */
 		LTRACEF("timer %p\n", timer);
 		DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-		list_delete(&timer->node);
+		remove_timer_from_queue(timer);
 
-		LTRACEF("dequeued timer %p, scheduled %lu periodic %lu\n", timer, timer->scheduled_time, timer->periodic_time);
+		LTRACEF("dequeued timer %p, scheduled %llu periodic %llu\n", timer, timer->scheduled_time, timer->periodic_time);
 
 		THREAD_STATS_INC(timers);
 
@@ -235,26 +379,23 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 			ret = INT_RESCHEDULE;
 
 		/* if it was a periodic timer and it hasn't been requeued
-		 * by the callback put it back in the list
+		 * by the callback put it back in the queue
 		 */
-		if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-			LTRACEF("periodic timer, period %u\n", (uint)timer->periodic_time);
-			timer->scheduled_time = now + timer->periodic_time;
+		if (periodic && !timer_in_queue(timer) && timer->periodic_time > 0) {
+			LTRACEF("periodic timer, period %llu\n", timer->periodic_time);
+			timer->scheduled_time = now_ns + timer->periodic_time;
 			insert_timer_in_queue(timer);
 		}
 	}
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	/* reset the timer to the next event */
-	timer = list_peek_head_type(&timer_queue, timer_t, node);
+	timer = timer_queue;
 	if (timer) {
 		/* has to be the case or it would have fired already */
-		DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-		lk_time_t delay = timer->scheduled_time - now;
+		DEBUG_ASSERT(timer->scheduled_time > now_ns);
 
-		LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+		timer_program_hw(timer);
 	}
 #else
 	/* let the scheduler have a shot to do quantum expiration, etc */
@@ -269,7 +410,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 void timer_init(void)
 {
-	list_initialize(&timer_queue);
+	timer_queue = NULL;
 
 #if !PLATFORM_HAS_DYNAMIC_TIMER
 	/* register for a periodic timer tick */
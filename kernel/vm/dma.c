@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/dma.h>
+
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <arch/defines.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+
+#define LOCAL_TRACE 0
+
+void *dma_alloc_coherent(size_t size, paddr_t *pa)
+{
+    LTRACEF("size 0x%zx\n", size);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+    void *ptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "dma_coherent", size, &ptr, 0, 0, ARCH_MMU_FLAG_UNCACHED);
+    if (err < 0)
+        return NULL;
+
+    *pa = vaddr_to_paddr(ptr);
+
+    /* the pages are also mapped cached in the kernel's physical map, don't
+     * let a dirty line from there land on top of what a device writes */
+    void *kvaddr = paddr_to_kvaddr(*pa);
+    if (kvaddr)
+        arch_clean_invalidate_cache_range((addr_t)kvaddr, size);
+
+    LTRACEF("ptr %p pa 0x%lx\n", ptr, *pa);
+
+    return ptr;
+}
+
+void dma_free_coherent(void *ptr)
+{
+    LTRACEF("ptr %p\n", ptr);
+
+    if (!ptr)
+        return;
+
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+}
+
+/* walk a buffer a page at a time, merging physically contiguous pages into segments */
+static status_t dma_build_segments(vmm_aspace_t *aspace, vaddr_t va, size_t len, dma_segment_t *segments, uint max_segments, uint *count)
+{
+    uint n = 0;
+
+    while (len > 0) {
+        paddr_t pa;
+        if (arch_mmu_query(&aspace->arch_aspace, va, &pa, NULL) < 0)
+            return ERR_INVALID_ARGS;
+
+        size_t chunk = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+
+        if (n > 0 && segments[n - 1].paddr + segments[n - 1].len == pa) {
+            segments[n - 1].len += chunk;
+        } else {
+            if (n == max_segments)
+                return ERR_TOO_BIG;
+
+            segments[n].paddr = pa;
+            segments[n].len = chunk;
+            n++;
+        }
+
+        va += chunk;
+        len -= chunk;
+    }
+
+    *count = n;
+
+    return NO_ERROR;
+}
+
+static status_t dma_alloc_bounce(dma_map_t *map)
+{
+    uint count = ROUNDUP(map->len, PAGE_SIZE) / PAGE_SIZE;
+
+    paddr_t pa;
+    if (pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, &map->bounce_pages) < count)
+        return ERR_NO_MEMORY;
+
+    map->bounce = paddr_to_kvaddr(pa);
+    DEBUG_ASSERT(map->bounce);
+
+    map->segments[0].paddr = pa;
+    map->segments[0].len = map->len;
+    map->segment_count = 1;
+
+    return NO_ERROR;
+}
+
+status_t dma_map_buf(dma_map_t *map, void *buf, size_t len, uint dir, dma_segment_t *segments, uint max_segments)
+{
+    LTRACEF("buf %p len 0x%zx dir 0x%x max_segments %u\n", buf, len, dir, max_segments);
+
+    DEBUG_ASSERT(dir & DMA_BIDIRECTIONAL);
+
+    if (len == 0 || max_segments == 0 || (dir & ~DMA_BIDIRECTIONAL) || !(dir & DMA_BIDIRECTIONAL))
+        return ERR_INVALID_ARGS;
+
+    map->buf = buf;
+    map->len = len;
+    map->dir = dir;
+    map->bounce = NULL;
+    list_initialize(&map->bounce_pages);
+    map->segment_count = 0;
+    map->segments = segments;
+
+    vaddr_t va = (vaddr_t)buf;
+    vmm_aspace_t *aspace = is_kernel_address(va) ? vmm_get_kernel_aspace() : get_current_thread()->aspace;
+    if (!aspace)
+        return ERR_INVALID_ARGS;
+
+    /* the device writing a partial cache line would race with the cpu
+     * evicting whatever else lives in that line */
+    bool bounce = (dir & DMA_FROM_DEVICE) &&
+        (!IS_ALIGNED(va, CACHE_LINE) || !IS_ALIGNED(len, CACHE_LINE));
+
+    if (!bounce) {
+        status_t err = dma_build_segments(aspace, va, len, segments, max_segments, &map->segment_count);
+        if (err == ERR_TOO_BIG) {
+            /* too scattered for the device */
+            bounce = true;
+        } else if (err < 0) {
+            return err;
+        }
+    }
+
+    if (bounce) {
+        status_t err = dma_alloc_bounce(map);
+        if (err < 0)
+            return err;
+
+        if (dir & DMA_TO_DEVICE)
+            memcpy(map->bounce, buf, len);
+
+        va = (vaddr_t)map->bounce;
+    }
+
+    LTRACEF("%u segments, bounce %p\n", map->segment_count, map->bounce);
+
+    /* write back what the cpu put there, and when the device is going to
+     * write make sure no dirty line can get evicted on top of its data */
+    if (dir & DMA_FROM_DEVICE)
+        arch_clean_invalidate_cache_range(va, len);
+    else
+        arch_clean_cache_range(va, len);
+
+    return NO_ERROR;
+}
+
+void dma_unmap_buf(dma_map_t *map)
+{
+    LTRACEF("buf %p len 0x%zx dir 0x%x bounce %p\n", map->buf, map->len, map->dir, map->bounce);
+
+    vaddr_t va = map->bounce ? (vaddr_t)map->bounce : (vaddr_t)map->buf;
+
+    if (map->dir & DMA_FROM_DEVICE) {
+        /* drop anything the cpu speculatively pulled in while the device owned it */
+        arch_invalidate_cache_range(va, map->len);
+
+        if (map->bounce)
+            memcpy(map->buf, map->bounce, map->len);
+    }
+
+    if (map->bounce) {
+        pmm_free(&map->bounce_pages);
+        map->bounce = NULL;
+    }
+
+    map->segment_count = 0;
+}
+
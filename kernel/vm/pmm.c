@@ -31,10 +31,19 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <kernel/mutex.h>
+#include <kernel/shrinker.h>
 
 #define LOCAL_TRACE 0
 
+/* once fewer pages than this are left free, allocations ask the shrinkers
+ * to give some back, rather than waiting for one to fail outright */
+#if !defined(PMM_LOW_WATERMARK)
+#define PMM_LOW_WATERMARK 64
+#endif
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
+static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
@@ -44,7 +53,7 @@ static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
     (paddr_t)(((uintptr_t)page - (uintptr_t)a->page_array) / sizeof(vm_page_t)) * PAGE_SIZE + a->base;
 
 #define ADDRESS_IN_ARENA(address, arena) \
-    ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size)
+    ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
 static inline bool page_is_free(const vm_page_t *page)
 {
@@ -74,6 +83,175 @@ vm_page_t *address_to_page(paddr_t addr)
     return NULL;
 }
 
+/* Free pages are kept in naturally aligned power of two sized blocks, with a
+ * free list per block order. The first page of a free block carries
+ * VM_PAGE_FLAG_FREE_HEAD and the order, the rest of its pages are not on any
+ * list. Blocks are aligned on physical page frame numbers rather than arena
+ * offsets, so a block of order n is always 2^n pages aligned in physical
+ * memory, and a block's buddy is found by flipping bit n of its frame number.
+ */
+
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+static inline uintptr_t arena_pfn(const pmm_arena_t *a, size_t index)
+{
+    return (a->base / PAGE_SIZE) + index;
+}
+
+/* smallest order whose block holds count pages */
+static inline uint count_to_order(size_t count)
+{
+    return (count <= 1) ? 0 : log2_uint(count - 1) + 1;
+}
+
+static void buddy_insert(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(page_is_free(page));
+    DEBUG_ASSERT(index + ((size_t)1 << order) <= arena_page_count(a));
+
+    page->flags |= VM_PAGE_FLAG_FREE_HEAD;
+    page->order = order;
+    list_add_head(&a->free_lists[order], &page->node);
+}
+
+static void buddy_remove(vm_page_t *page)
+{
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_FREE_HEAD);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+}
+
+/* return a block to the free lists, merging it with its buddy for as long as
+ * the buddy is itself a whole free block */
+static void buddy_free(pmm_arena_t *a, size_t index, uint order)
+{
+    uintptr_t first_pfn = arena_pfn(a, 0);
+    uintptr_t end_pfn = arena_pfn(a, arena_page_count(a));
+    uintptr_t pfn = arena_pfn(a, index);
+
+    while (order < PMM_MAX_ORDER) {
+        uintptr_t buddy_pfn = pfn ^ ((uintptr_t)1 << order);
+        if (buddy_pfn < first_pfn || buddy_pfn >= end_pfn)
+            break;
+
+        vm_page_t *buddy = &a->page_array[buddy_pfn - first_pfn];
+        if (!(buddy->flags & VM_PAGE_FLAG_FREE_HEAD) || buddy->order != order)
+            break;
+
+        buddy_remove(buddy);
+        pfn &= ~((uintptr_t)1 << order);
+        order++;
+    }
+
+    buddy_insert(a, pfn - first_pfn, order);
+}
+
+/* free an arbitrary run of pages, carving it into the largest aligned blocks */
+static void buddy_free_range(pmm_arena_t *a, size_t index, size_t count)
+{
+    while (count > 0) {
+        uintptr_t pfn = arena_pfn(a, index);
+        uint order = 0;
+        while (order < PMM_MAX_ORDER &&
+                !(pfn & ((uintptr_t)1 << order)) &&
+                ((size_t)2 << order) <= count) {
+            order++;
+        }
+
+        buddy_free(a, index, order);
+
+        index += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+/* take a block of exactly this order off the free lists, splitting a larger
+ * one if needed. Returns the index of its first page, or -1. */
+static ssize_t buddy_alloc(pmm_arena_t *a, uint order)
+{
+    for (uint o = order; o <= PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_peek_head_type(&a->free_lists[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        buddy_remove(page);
+        size_t index = page - a->page_array;
+
+        /* give the upper halves back until the block is the right size */
+        while (o > order) {
+            o--;
+            buddy_insert(a, index + ((size_t)1 << o), o);
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* pull a single free page out of whichever free block holds it */
+static bool buddy_take_page(pmm_arena_t *a, size_t index)
+{
+    if (!page_is_free(&a->page_array[index]))
+        return false;
+
+    uintptr_t first_pfn = arena_pfn(a, 0);
+    uintptr_t pfn = arena_pfn(a, index);
+
+    for (uint order = 0; order <= PMM_MAX_ORDER; order++) {
+        uintptr_t head_pfn = pfn & ~(((uintptr_t)1 << order) - 1);
+        if (head_pfn < first_pfn)
+            break;
+
+        vm_page_t *head = &a->page_array[head_pfn - first_pfn];
+        if (!(head->flags & VM_PAGE_FLAG_FREE_HEAD) || head->order != order)
+            continue;
+
+        buddy_remove(head);
+
+        /* split it down, giving back the halves that don't hold the page */
+        size_t head_index = head_pfn - first_pfn;
+        while (order > 0) {
+            order--;
+            size_t half = (size_t)1 << order;
+            if (index >= head_index + half) {
+                buddy_insert(a, head_index, order);
+                head_index += half;
+            } else {
+                buddy_insert(a, head_index + half, order);
+            }
+        }
+        DEBUG_ASSERT(head_index == index);
+
+        return true;
+    }
+
+    panic("free page %zu in arena %p not in any free block\n", index, a);
+}
+
+/* mark a run of pages that are off the free lists as allocated */
+static void mark_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+        DEBUG_ASSERT(page_is_free(p));
+        DEBUG_ASSERT(!list_in_list(&p->node));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+
+    a->free_count -= count;
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%x\n", arena, arena->name, arena->base, arena->size);
@@ -82,6 +260,8 @@ status_t pmm_add_arena(pmm_arena_t *arena)
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->size));
     DEBUG_ASSERT(arena->size > 0);
 
+    mutex_acquire(&lock);
+
     /* walk the arena list and add arena based on priority order */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -98,7 +278,8 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_lists[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -107,47 +288,95 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
+    /* add them to the free lists */
+    buddy_free_range(arena, 0, page_count);
+    arena->free_count = page_count;
 
-        arena->free_count++;
-    }
+    mutex_release(&lock);
 
     return NO_ERROR;
 }
 
-uint pmm_alloc_pages(uint count, struct list_node *list)
+static size_t free_count_locked(void)
 {
-    LTRACEF("count %u\n", count);
+    size_t count = 0;
 
-    /* list must be initialized prior to calling this */
-    DEBUG_ASSERT(list);
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node)
+        count += a->free_count;
 
+    return count;
+}
+
+/* called with the lock dropped after an allocation that came up bytes short
+ * of what was asked for, and left free_count pages free. Returns true if the
+ * shrinkers gave anything back, in which case it's worth trying again. */
+static bool reclaim(size_t bytes, size_t free_count)
+{
+    if (free_count < PMM_LOW_WATERMARK)
+        bytes += (PMM_LOW_WATERMARK - free_count) * PAGE_SIZE;
+    if (bytes == 0)
+        return false;
+
+    LTRACEF("free pages %zu, reclaiming 0x%zx bytes\n", free_count, bytes);
+
+    return shrinker_reclaim(bytes) > 0;
+}
+
+static uint alloc_pages_locked(uint count, struct list_node *list)
+{
     uint allocated = 0;
-    if (count == 0)
-        return 0;
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    /* walk the arenas in order, allocating as many pages as we can from each.
+     * the pages need not be contiguous, so take the largest blocks that fit in
+     * what is left and fall back to smaller ones as the arena runs dry */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+        uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER);
 
-            a->free_count--;
+        while (allocated < count) {
+            order = MIN(order, log2_uint(count - allocated));
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            ssize_t index;
+            while ((index = buddy_alloc(a, order)) < 0 && order > 0)
+                order--;
+            if (index < 0)
+                break;
 
-            allocated++;
+            mark_allocated(a, index, (size_t)1 << order, list);
+            allocated += 1U << order;
         }
+
+        if (allocated == count)
+            break;
+    }
+
+    return allocated;
+}
+
+uint pmm_alloc_pages(uint count, struct list_node *list)
+{
+    LTRACEF("count %u\n", count);
+
+    /* list must be initialized prior to calling this */
+    DEBUG_ASSERT(list);
+
+    if (count == 0)
+        return 0;
+
+    mutex_acquire(&lock);
+    uint allocated = alloc_pages_locked(count, list);
+    size_t free_count = free_count_locked();
+    mutex_release(&lock);
+
+    /* came up short or took us under the watermark, see if the shrinkers
+     * can give some memory back and have another go at what's missing */
+    if (reclaim((size_t)(count - allocated) * PAGE_SIZE, free_count) && allocated < count) {
+        mutex_acquire(&lock);
+        allocated += alloc_pages_locked(count - allocated, list);
+        mutex_release(&lock);
     }
 
-done:
     return allocated;
 }
 
@@ -163,6 +392,8 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
     address = ROUNDDOWN(address, PAGE_SIZE);
 
+    mutex_acquire(&lock);
+
     /* walk through the arenas, looking to see if the physical page belongs to it */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -171,19 +402,13 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
             DEBUG_ASSERT(index < a->size / PAGE_SIZE);
 
-            vm_page_t *page = &a->page_array[index];
-            if (page->flags & VM_PAGE_FLAG_NONFREE) {
+            if (!buddy_take_page(a, index)) {
                 /* we hit an allocated page */
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
+            mark_allocated(a, index, 1, list);
 
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
-
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -192,6 +417,8 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
             break;
     }
 
+    mutex_release(&lock);
+
     return allocated;
 }
 
@@ -201,6 +428,8 @@ uint pmm_free(struct list_node *list)
 
     DEBUG_ASSERT(list);
 
+    mutex_acquire(&lock);
+
     uint count = 0;
     while (!list_is_empty(list)) {
         vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
@@ -214,7 +443,7 @@ uint pmm_free(struct list_node *list)
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
                 page->flags &= ~VM_PAGE_FLAG_NONFREE;
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free(a, page - a->page_array, 0);
                 a->free_count++;
                 count++;
                 break;
@@ -222,6 +451,8 @@ uint pmm_free(struct list_node *list)
         }
     }
 
+    mutex_release(&lock);
+
     return count;
 }
 
@@ -240,9 +471,6 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
-
     paddr_t pa;
     uint alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
     if (alloc_count == 0)
@@ -251,67 +479,103 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
     return paddr_to_kvaddr(pa);
 }
 
-uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
+uint pmm_free_kpages(void *_ptr, uint count)
 {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+    LTRACEF("ptr %p count %u\n", _ptr, count);
 
-    if (count == 0)
-        return 0;
-    if (alignment_log2 < PAGE_SIZE_SHIFT)
-        alignment_log2 = PAGE_SIZE_SHIFT;
+    uint8_t *ptr = (uint8_t *)_ptr;
+
+    struct list_node list;
+    list_initialize(&list);
+
+    while (count > 0) {
+        vm_page_t *p = address_to_page(vaddr_to_paddr(ptr));
+        DEBUG_ASSERT(p);
+        if (p)
+            list_add_tail(&list, &p->node);
+
+        ptr += PAGE_SIZE;
+        count--;
+    }
+
+    return pmm_free(&list);
+}
+
+/* find a free, aligned run by walking the page array. Used for runs too big
+ * for a single buddy block, and for ones no free block can hold by itself. */
+static ssize_t scan_for_run(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base >= a->base + a->size)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+retry:
+    while (start + count <= a->size / PAGE_SIZE) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (!page_is_free(p)) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        return start;
+    }
+
+    return -1;
+}
+
+static uint alloc_contiguous_locked(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
+{
+    /* a block of this order is big enough and aligned enough */
+    uint order = MAX(count_to_order(count), (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
         if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base >= a->base + a->size)
-                continue;
-
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-retry:
-            while (start < a->size / PAGE_SIZE) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                return count;
+            ssize_t start = -1;
+
+            if (order <= PMM_MAX_ORDER) {
+                start = buddy_alloc(a, order);
+
+                /* return the tail of the block beyond the run */
+                if (start >= 0)
+                    buddy_free_range(a, start + count, ((size_t)1 << order) - count);
+            }
+
+            /* no free block is big enough, but the run may still be there
+             * across smaller blocks or the boundary between two */
+            if (start < 0) {
+                start = scan_for_run(a, count, alignment_log2);
+                if (start < 0)
+                    continue;
+
+                for (uint i = start; i < start + count; i++)
+                    buddy_take_page(a, i);
             }
+
+            /* we found a run */
+            LTRACEF("found run from pn %zd to %zd\n", start, start + count);
+
+            mark_allocated(a, start, count, list);
+
+            if (pa)
+                *pa = a->base + start * PAGE_SIZE;
+
+            return count;
         }
     }
 
@@ -319,18 +583,50 @@ retry:
     return 0;
 }
 
+uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
+{
+    LTRACEF("count %u, align %u\n", count, alignment_log2);
+
+    if (count == 0)
+        return 0;
+    if (alignment_log2 < PAGE_SIZE_SHIFT)
+        alignment_log2 = PAGE_SIZE_SHIFT;
+
+    mutex_acquire(&lock);
+    uint allocated = alloc_contiguous_locked(count, alignment_log2, pa, list);
+    size_t free_count = free_count_locked();
+    mutex_release(&lock);
+
+    /* the shrinkers can't promise a run, but what they give back may fill
+     * in the gaps between free pages */
+    if (reclaim(allocated ? 0 : (size_t)count * PAGE_SIZE, free_count) && allocated == 0) {
+        mutex_acquire(&lock);
+        allocated = alloc_contiguous_locked(count, alignment_log2, pa, list);
+        mutex_release(&lock);
+    }
+
+    return allocated;
+}
+
 static void dump_page(const vm_page_t *page)
 {
     printf("page %p: address 0x%lx flags 0x%x\n", page, page_to_address(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
     printf("arena %p: name '%s' base 0x%lx size 0x%x priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    /* dump the number of free blocks of each order */
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        printf(" %zu", list_length(&arena->free_lists[i]));
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
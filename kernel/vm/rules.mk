@@ -2,8 +2,11 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += lib/kmem
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bootalloc.c \
+	$(LOCAL_DIR)/dma.c \
 	$(LOCAL_DIR)/pmm.c \
 	$(LOCAL_DIR)/vm.c \
 	$(LOCAL_DIR)/vmm.c \
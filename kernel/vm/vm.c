@@ -54,7 +54,7 @@ static void mark_pages_in_use(vaddr_t va, size_t len)
         uint flags;
         paddr_t pa;
 
-        status_t err = arch_mmu_query(va + offset, &pa, &flags);
+        status_t err = arch_mmu_query(&vmm_get_kernel_aspace()->arch_aspace, va + offset, &pa, &flags);
         if (err >= 0) {
             //LTRACEF("va 0x%x, pa 0x%x, flags 0x%x, err %d\n", va + offset, pa, flags, err);
 
@@ -68,6 +68,9 @@ static void vm_init_preheap(uint level)
 {
     LTRACE_ENTRY;
 
+    /* set up the kernel aspace early, the lookups below go through it */
+    vmm_init();
+
     /* mark all of the kernel pages in use */
     LTRACEF("marking all kernel pages as used\n");
     mark_pages_in_use((vaddr_t)&_start, ((uintptr_t)&_end - (uintptr_t)&_start));
@@ -84,8 +87,6 @@ static void vm_init_postheap(uint level)
 {
     LTRACE_ENTRY;
 
-    vmm_init();
-
     /* create vmm regions to cover what is already there from the initial mapping table */
     struct mmu_initial_mapping *map = mmu_initial_mappings;
     while (map->size > 0) {
@@ -112,6 +113,16 @@ void *paddr_to_kvaddr(paddr_t pa)
     return NULL;
 }
 
+paddr_t vaddr_to_paddr(void *ptr)
+{
+    paddr_t pa;
+    status_t rc = arch_mmu_query(&vmm_get_kernel_aspace()->arch_aspace, (vaddr_t)ptr, &pa, NULL);
+    if (rc)
+        return (paddr_t)NULL;
+
+    return pa;
+}
+
 static int cmd_vm(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
@@ -136,7 +147,7 @@ usage:
 
         paddr_t pa;
         uint flags;
-        status_t err = arch_mmu_query(argv[2].u, &pa, &flags);
+        status_t err = arch_mmu_query(&vmm_get_kernel_aspace()->arch_aspace, argv[2].u, &pa, &flags);
         printf("arch_mmu_query returns %d\n", err);
         if (err >= 0) {
             printf("\tpa 0x%lx, flags 0x%x\n", pa, flags);
@@ -144,12 +155,12 @@ usage:
     } else if (!strcmp(argv[1].str, "map")) {
         if (argc < 6) goto notenoughargs;
 
-        int err = arch_mmu_map(argv[3].u, argv[2].u, argv[4].u, argv[5].u);
+        int err = arch_mmu_map(&vmm_get_kernel_aspace()->arch_aspace, argv[3].u, argv[2].u, argv[4].u, argv[5].u);
         printf("arch_mmu_map returns %d\n", err);
     } else if (!strcmp(argv[1].str, "unmap")) {
         if (argc < 4) goto notenoughargs;
 
-        int err = arch_mmu_unmap(argv[2].u, argv[3].u);
+        int err = arch_mmu_unmap(&vmm_get_kernel_aspace()->arch_aspace, argv[2].u, argv[3].u);
         printf("arch_mmu_unmap returns %d\n", err);
     } else {
         printf("unknown command\n");
@@ -24,7 +24,11 @@
 #include <assert.h>
 #include <err.h>
 #include <string.h>
+#include <pow2.h>
 #include <lib/console.h>
+#include <lib/kmem.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
 #include <kernel/vm.h>
 #include "vm_priv.h"
 
@@ -34,6 +38,12 @@ static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
 
 vmm_aspace_t _kernel_aspace;
 
+/* protects the aspace list, the region lists and the page lists of demand committed regions */
+static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
+
+static kmem_cache_t region_cache = KMEM_CACHE_INITIAL_VALUE(region_cache, "vmm_region", sizeof(vmm_region_t), 0);
+static kmem_cache_t aspace_cache = KMEM_CACHE_INITIAL_VALUE(aspace_cache, "vmm_aspace", sizeof(vmm_aspace_t), 0);
+
 static void dump_aspace(const vmm_aspace_t *a);
 static void dump_region(const vmm_region_t *r);
 
@@ -41,10 +51,13 @@ void vmm_init(void)
 {
     /* initialize the kernel address space */
     strlcpy(_kernel_aspace.name, "kernel", sizeof(_kernel_aspace.name));
+    _kernel_aspace.flags = VMM_ASPACE_FLAG_KERNEL;
     _kernel_aspace.base = KERNEL_ASPACE_BASE,
     _kernel_aspace.size = KERNEL_ASPACE_SIZE,
     list_initialize(&_kernel_aspace.region_list);
 
+    arch_mmu_init_aspace(&_kernel_aspace.arch_aspace, KERNEL_ASPACE_BASE, KERNEL_ASPACE_SIZE, ARCH_ASPACE_FLAG_KERNEL);
+
     list_add_head(&aspace_list, &_kernel_aspace.node);
 }
 
@@ -102,7 +115,7 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
 {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = malloc(sizeof(vmm_region_t));
+    vmm_region_t *r = kmem_cache_alloc(&region_cache);
     if (!r)
         return NULL;
 
@@ -116,7 +129,158 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
-/* add a region to the appropriate spot in the address space list,
+/* region tree helpers. the tree is an avl tree keyed on region base, kept in
+ * step with the sorted region list. every node is augmented with the size of
+ * the free gap between it and the previous region, and the largest gap found
+ * anywhere in its subtree, so lookups and free spot searches are O(log n). */
+static inline uint region_tree_height(const vmm_region_t *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static inline size_t region_tree_max_gap(const vmm_region_t *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+static void region_tree_update(vmm_region_t *r)
+{
+    r->tree_height = 1 + MAX(region_tree_height(r->tree_left), region_tree_height(r->tree_right));
+    r->max_gap = MAX(r->gap_before, MAX(region_tree_max_gap(r->tree_left), region_tree_max_gap(r->tree_right)));
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_region_t *r)
+{
+    vmm_region_t *l = r->tree_left;
+
+    r->tree_left = l->tree_right;
+    l->tree_right = r;
+    region_tree_update(r);
+    region_tree_update(l);
+
+    return l;
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_region_t *r)
+{
+    vmm_region_t *rt = r->tree_right;
+
+    r->tree_right = rt->tree_left;
+    rt->tree_left = r;
+    region_tree_update(r);
+    region_tree_update(rt);
+
+    return rt;
+}
+
+/* recompute a node on the way back up from a modification and rotate it back into balance */
+static vmm_region_t *region_tree_balance(vmm_region_t *r)
+{
+    region_tree_update(r);
+
+    uint lh = region_tree_height(r->tree_left);
+    uint rh = region_tree_height(r->tree_right);
+
+    if (lh > rh + 1) {
+        if (region_tree_height(r->tree_left->tree_left) < region_tree_height(r->tree_left->tree_right))
+            r->tree_left = region_tree_rotate_left(r->tree_left);
+        return region_tree_rotate_right(r);
+    } else if (rh > lh + 1) {
+        if (region_tree_height(r->tree_right->tree_right) < region_tree_height(r->tree_right->tree_left))
+            r->tree_right = region_tree_rotate_right(r->tree_right);
+        return region_tree_rotate_left(r);
+    }
+
+    return r;
+}
+
+static vmm_region_t *region_tree_insert(vmm_region_t *root, vmm_region_t *r)
+{
+    if (!root) {
+        r->tree_left = r->tree_right = NULL;
+        region_tree_update(r);
+        return r;
+    }
+
+    if (r->base < root->base)
+        root->tree_left = region_tree_insert(root->tree_left, r);
+    else
+        root->tree_right = region_tree_insert(root->tree_right, r);
+
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove_min(vmm_region_t *root, vmm_region_t **min)
+{
+    if (!root->tree_left) {
+        *min = root;
+        return root->tree_right;
+    }
+
+    root->tree_left = region_tree_remove_min(root->tree_left, min);
+
+    return region_tree_balance(root);
+}
+
+static vmm_region_t *region_tree_remove(vmm_region_t *root, vmm_region_t *r)
+{
+    DEBUG_ASSERT(root);
+
+    if (r->base < root->base) {
+        root->tree_left = region_tree_remove(root->tree_left, r);
+    } else if (r->base > root->base) {
+        root->tree_right = region_tree_remove(root->tree_right, r);
+    } else {
+        DEBUG_ASSERT(root == r);
+
+        if (!r->tree_right)
+            return r->tree_left;
+
+        /* replace it with the next region up */
+        vmm_region_t *next;
+        vmm_region_t *right = region_tree_remove_min(r->tree_right, &next);
+        next->tree_left = r->tree_left;
+        next->tree_right = right;
+        root = next;
+    }
+
+    return region_tree_balance(root);
+}
+
+/* find the region that covers vaddr */
+static vmm_region_t *region_tree_find(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *r = aspace->region_tree;
+    while (r) {
+        if (vaddr < r->base)
+            r = r->tree_left;
+        else if (vaddr > r->base + r->size - 1)
+            r = r->tree_right;
+        else
+            return r;
+    }
+
+    return NULL;
+}
+
+/* find the lowest region that starts above vaddr */
+static vmm_region_t *region_tree_find_next(const vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    vmm_region_t *next = NULL;
+    vmm_region_t *r = aspace->region_tree;
+    while (r) {
+        if (r->base > vaddr) {
+            next = r;
+            r = r->tree_left;
+        } else {
+            r = r->tree_right;
+        }
+    }
+
+    return next;
+}
+
+/* add a region to the appropriate spot in the address space list and tree,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 {
@@ -134,34 +298,69 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
+    /* find our neighbors and make sure we fit between them */
+    vmm_region_t *next = region_tree_find_next(aspace, r->base);
+    vmm_region_t *prev;
+    if (next)
+        prev = list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node);
+    else
+        prev = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+
+    if ((prev && prev->base + prev->size - 1 >= r->base) || (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    /* fix up the gaps on either side. next is on the insertion path of r, so
+     * the tree insert below will fold its new gap back into the tree */
+    r->gap_before = r->base - (prev ? prev->base + prev->size : aspace->base);
+    if (next)
+        next->gap_before = next->base - (r_end + 1);
+
+    if (next)
+        list_add_before(&next->node, &r->node);
+    else
+        list_add_tail(&aspace->region_list, &r->node);
+
+    aspace->region_tree = region_tree_insert(aspace->region_tree, r);
+
+    return NO_ERROR;
+}
+
+static void remove_region_from_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    /* the space r took up joins the gap in front of the next region. next is
+     * either below r in the tree or above it, so on the removal path either way */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next)
+        next->gap_before += r->gap_before + r->size;
+
+    aspace->region_tree = region_tree_remove(aspace->region_tree, r);
+    list_delete(&r->node);
+}
+
+/* search a subtree for the lowest gap that can hold an aligned run of size bytes */
+static vaddr_t alloc_spot_in_tree(const vmm_region_t *r, size_t size, vaddr_t align)
+{
+    if (!r || r->max_gap < size)
+        return -1;
+
+    vaddr_t spot = alloc_spot_in_tree(r->tree_left, size, align);
+    if (spot != (vaddr_t)-1)
+        return spot;
+
+    if (r->gap_before >= size) {
+        vaddr_t gap_base = r->base - r->gap_before;
+
+        spot = ALIGN(gap_base, align);
+        if (spot >= gap_base && spot < r->base && r->base - spot >= size)
+            return spot;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    return alloc_spot_in_tree(r->tree_right, size, align);
 }
 
-static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2, struct list_node **before)
+static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2)
 {
     DEBUG_ASSERT(aspace);
     DEBUG_ASSERT(size > 0 && IS_PAGE_ALIGNED(size));
@@ -172,62 +371,20 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
         align_pow2 = PAGE_SIZE_SHIFT;
     vaddr_t align = 1UL << align_pow2;
 
-    /* start our search */
-    vaddr_t spot = ALIGN(aspace->base, align);
-    if (!is_inside_aspace(aspace, spot)) {
-        /* the alignment is so big, we can't even allocate in this address space */
+    /* the alignment may be so big, we can't even allocate in this address space */
+    if (!is_inside_aspace(aspace, ALIGN(aspace->base, align)))
         return -1;
-    }
-
-    vmm_region_t *r = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (r) {
-        /* does it fit before the first element? */
-        if (spot < r->base && r->base - spot >= size) {
-            if (before)
-                *before = &aspace->region_list;
-            return spot;
-        }
-    } else {
-        /* nothing is in the list, does it fit in the aspace? */
-        if (aspace->base + aspace->size - spot >= size) {
-            if (before)
-                *before = &aspace->region_list;
-            return spot;
-        }
-    }
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        /* calculate the aligned spot after r */
-        spot = ALIGN(r->base + r->size, align);
-        if (!is_inside_aspace(aspace, spot))
-            break;
+    /* look in the gaps in front of each region */
+    vaddr_t spot = alloc_spot_in_tree(aspace->region_tree, size, align);
+    if (spot != (vaddr_t)-1)
+        return spot;
 
-        /* get the next element in the list */
-        vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
-
-        if (next) {
-            /* see if the aligned spot is between current and next */
-            if (spot >= next->base)
-                continue;
-
-            /* see if it'll fit between the current item and the next */
-            if (next->base - spot >= size) {
-                /* it'll fit here */
-                if (before)
-                    *before = &r->node;
-                return spot;
-            }
-        } else {
-            /* we're at the end of the list, will it fit between us and the end of the aspace? */
-            if ((aspace->base + aspace->size) - spot >= size) {
-                /* it'll fit here */
-                if (before)
-                    *before = &r->node;
-                return spot;
-            }
-        }
-    }
+    /* will it fit between the last region and the end of the aspace? */
+    vmm_region_t *last = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    spot = ALIGN(last ? last->base + last->size : aspace->base, align);
+    if (is_inside_aspace(aspace, spot) && (aspace->base + aspace->size) - spot >= size)
+        return spot;
 
     /* couldn't find anything */
     return -1;
@@ -243,35 +400,37 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
     if (!r)
         return NULL;
 
+    mutex_acquire(&vmm_lock);
+
     /* if they ask us for a specific spot, put it there */
-    if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
-        /* stick it in the list, checking to see if it fits */
-        if (add_region_to_aspace(aspace, r) < 0) {
-            /* didn't fit */
-            free(r);
-            return NULL;
-        }
-    } else {
+    if (!(vmm_flags & VMM_FLAG_VALLOC_SPECIFIC)) {
         /* allocate a virtual slot for it */
-        struct list_node *before = NULL;
-        vaddr = alloc_spot(aspace, size, align_pow2, &before);
-        LTRACEF("alloc_spot returns 0x%lx, before %p\n", vaddr, before);
+        vaddr = alloc_spot(aspace, size, align_pow2);
+        LTRACEF("alloc_spot returns 0x%lx\n", vaddr);
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
-            return NULL;
+            goto fail;
         }
 
-        DEBUG_ASSERT(before != NULL);
-
         r->base = (vaddr_t)vaddr;
+    }
 
-        /* add it to the region list */
-        list_add_after(before, &r->node);
+    /* stick it in the list and tree, checking to see if it fits */
+    if (add_region_to_aspace(aspace, r) < 0) {
+        /* didn't fit */
+        DEBUG_ASSERT(vmm_flags & VMM_FLAG_VALLOC_SPECIFIC);
+        goto fail;
     }
 
+    mutex_release(&vmm_lock);
+
     return r;
+
+fail:
+    mutex_release(&vmm_lock);
+    kmem_cache_free(&region_cache, r);
+    return NULL;
 }
 
 status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size, vaddr_t vaddr)
@@ -300,7 +459,7 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
 
     /* lookup how it's already mapped */
     uint arch_mmu_flags = 0;
-    arch_mmu_query(vaddr, NULL, &arch_mmu_flags);
+    arch_mmu_query(&aspace->arch_aspace, vaddr, NULL, &arch_mmu_flags);
 
     /* build a new region structure */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, 0, VMM_FLAG_VALLOC_SPECIFIC, VMM_REGION_FLAG_RESERVED, arch_mmu_flags);
@@ -350,7 +509,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    int err = arch_mmu_map(r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
+    int err = arch_mmu_map(&aspace->arch_aspace, r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
     LTRACEF("arch_mmu_map returns %d\n", err);
 
     return NO_ERROR;
@@ -408,7 +567,7 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    arch_mmu_map(r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
+    arch_mmu_map(&aspace->arch_aspace, r->base, pa, size / PAGE_SIZE, arch_mmu_flags);
     // XXX deal with error mapping here
 
     vm_page_t *p;
@@ -450,11 +609,33 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
             goto err;
         }
         vaddr = (vaddr_t)*ptr;
+    } else if (!(vmm_flags & VMM_FLAG_COMMIT_ON_DEMAND)) {
+        /* the pmm hands back naturally aligned blocks, largest first. align the
+         * region to the biggest block we could get so each block also lands on a
+         * virtual boundary the arch can map with a large page */
+        uint8_t run_align = MIN(log2_uint(size / PAGE_SIZE), PMM_MAX_ORDER) + PAGE_SIZE_SHIFT;
+        if (align_pow2 < run_align)
+            align_pow2 = run_align;
+    }
+
+    if (vmm_flags & VMM_FLAG_COMMIT_ON_DEMAND) {
+        /* just carve out the address space, pages show up as they're touched */
+        vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                VMM_REGION_FLAG_PHYSICAL | VMM_REGION_FLAG_COMMIT_ON_DEMAND, arch_mmu_flags);
+        if (!r) {
+            err = ERR_NO_MEMORY;
+            goto err;
+        }
+
+        if (ptr)
+            *ptr = (void *)r->base;
+
+        return NO_ERROR;
     }
 
     /* allocate physical memory up front, in case it cant be satisfied */
 
-    /* allocate a random pile of pages */
+    /* allocate a pile of pages, in as few physically contiguous runs as possible */
     struct list_node page_list;
     list_initialize(&page_list);
 
@@ -477,25 +658,36 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     if (ptr)
         *ptr = (void *)r->base;
 
-    /* map all of the pages */
-    /* XXX use smarter algorithm that tries to build runs */
-    vm_page_t *p;
+    /* map the pages, one physically contiguous run at a time */
     vaddr_t va = r->base;
     DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
-    while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
-        DEBUG_ASSERT(va < r->base + r->size);
-
+    vm_page_t *p = list_peek_head_type(&page_list, vm_page_t, node);
+    while (p) {
         paddr_t pa = page_to_address(p);
         DEBUG_ASSERT(IS_PAGE_ALIGNED(pa));
 
-        arch_mmu_map(va, pa, 1, arch_mmu_flags);
-        // XXX deal with error mapping here
+        /* extend the run for as long as the next page follows on physically */
+        uint run = 1;
+        vm_page_t *next;
+        while ((next = list_next_type(&page_list, &p->node, vm_page_t, node)) &&
+                page_to_address(next) == pa + run * PAGE_SIZE) {
+            p = next;
+            run++;
+        }
 
-        list_add_tail(&r->page_list, &p->node);
+        DEBUG_ASSERT(va + run * PAGE_SIZE <= r->base + r->size);
+
+        arch_mmu_map(&aspace->arch_aspace, va, pa, run, arch_mmu_flags);
+        // XXX deal with error mapping here
 
-        va += PAGE_SIZE;
+        va += run * PAGE_SIZE;
+        p = next;
     }
 
+    /* hand the pages over to the region */
+    while ((p = list_remove_head_type(&page_list, vm_page_t, node)))
+        list_add_tail(&r->page_list, &p->node);
+
     return NO_ERROR;
 
 err1:
@@ -504,6 +696,289 @@ err:
     return err;
 }
 
+/* look up the demand committed region that fully covers a range, must hold vmm_lock */
+static status_t find_demand_region_locked(const vmm_aspace_t *aspace, vaddr_t vaddr, size_t size, vmm_region_t **out)
+{
+    vmm_region_t *r = region_tree_find(aspace, vaddr);
+    if (!r)
+        return ERR_NOT_FOUND;
+    if (!(r->flags & VMM_REGION_FLAG_COMMIT_ON_DEMAND))
+        return ERR_INVALID_ARGS;
+    if (size > r->base + r->size - vaddr)
+        return ERR_OUT_OF_RANGE;
+
+    *out = r;
+    return NO_ERROR;
+}
+
+/* back a single page of a demand committed region with a zeroed page, must hold vmm_lock */
+static status_t commit_page_locked(vmm_aspace_t *aspace, vmm_region_t *r, vaddr_t va)
+{
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
+
+    /* someone else may have beaten us to it */
+    if (arch_mmu_query(&aspace->arch_aspace, va, NULL, NULL) >= 0)
+        return NO_ERROR;
+
+    struct list_node page_list;
+    list_initialize(&page_list);
+
+    if (pmm_alloc_pages(1, &page_list) < 1)
+        return ERR_NO_MEMORY;
+
+    vm_page_t *p = list_peek_head_type(&page_list, vm_page_t, node);
+    paddr_t pa = page_to_address(p);
+
+    memset(paddr_to_kvaddr(pa), 0, PAGE_SIZE);
+
+    if (arch_mmu_map(&aspace->arch_aspace, va, pa, 1, r->arch_mmu_flags) < 1) {
+        pmm_free(&page_list);
+        return ERR_NO_MEMORY;
+    }
+
+    list_delete(&p->node);
+    list_add_tail(&r->page_list, &p->node);
+
+    return NO_ERROR;
+}
+
+status_t vmm_commit_range(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size)
+{
+    LTRACEF("aspace %p vaddr 0x%lx size 0x%zx\n", aspace, vaddr, size);
+
+    DEBUG_ASSERT(aspace);
+
+    size = ROUNDUP(size + (vaddr & (PAGE_SIZE - 1)), PAGE_SIZE);
+    vaddr = ROUNDDOWN(vaddr, PAGE_SIZE);
+    if (size == 0)
+        return NO_ERROR;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r;
+    status_t err = find_demand_region_locked(aspace, vaddr, size, &r);
+    if (err < 0)
+        goto out;
+
+    for (vaddr_t va = vaddr; va != vaddr + size; va += PAGE_SIZE) {
+        err = commit_page_locked(aspace, r, va);
+        if (err < 0)
+            break;
+    }
+
+out:
+    mutex_release(&vmm_lock);
+
+    return err;
+}
+
+status_t vmm_decommit_range(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size)
+{
+    LTRACEF("aspace %p vaddr 0x%lx size 0x%zx\n", aspace, vaddr, size);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(vaddr));
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(size));
+
+    /* only whole pages can be given back */
+    if (!IS_PAGE_ALIGNED(vaddr) || !IS_PAGE_ALIGNED(size))
+        return ERR_INVALID_ARGS;
+    if (size == 0)
+        return NO_ERROR;
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r;
+    status_t err = find_demand_region_locked(aspace, vaddr, size, &r);
+    if (err < 0)
+        goto out;
+
+    for (vaddr_t va = vaddr; va != vaddr + size; va += PAGE_SIZE) {
+        paddr_t pa;
+        if (arch_mmu_query(&aspace->arch_aspace, va, &pa, NULL) < 0)
+            continue;
+
+        arch_mmu_unmap(&aspace->arch_aspace, va, 1);
+
+        vm_page_t *p = address_to_page(pa);
+        DEBUG_ASSERT(p);
+
+        list_delete(&p->node);
+        pmm_free_page(p);
+    }
+
+out:
+    mutex_release(&vmm_lock);
+
+    return err;
+}
+
+status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
+{
+    LTRACEF("aspace %p vaddr 0x%lx\n", aspace, vaddr);
+
+    DEBUG_ASSERT(aspace);
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = region_tree_find(aspace, vaddr);
+    if (!r) {
+        mutex_release(&vmm_lock);
+        return ERR_NOT_FOUND;
+    }
+
+    /* reserved regions cover the kernel image and the mappings set up before
+     * the vmm, which were never ours to give back */
+    if (r->flags & VMM_REGION_FLAG_RESERVED) {
+        mutex_release(&vmm_lock);
+        return ERR_INVALID_ARGS;
+    }
+
+    remove_region_from_aspace(aspace, r);
+
+    /* tear down the mappings and hand back whatever pages we own. regions that
+     * map someone else's memory have an empty page list */
+    arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
+    mutex_release(&vmm_lock);
+
+    pmm_free(&r->page_list);
+    kmem_cache_free(&region_cache, r);
+
+    return NO_ERROR;
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint flags)
+{
+    LTRACEF("addr 0x%lx flags 0x%x\n", addr, flags);
+
+    /* anything outside the kernel's space belongs to the current thread's aspace */
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    if (!is_inside_aspace(aspace, addr)) {
+        aspace = get_current_thread()->aspace;
+        if (!aspace || !is_inside_aspace(aspace, addr))
+            return ERR_NOT_FOUND;
+    }
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = region_tree_find(aspace, addr);
+
+    status_t err;
+    if (!r || !(r->flags & VMM_REGION_FLAG_COMMIT_ON_DEMAND)) {
+        err = ERR_NOT_FOUND;
+    } else {
+        err = commit_page_locked(aspace, r, ROUNDDOWN(addr, PAGE_SIZE));
+    }
+
+    mutex_release(&vmm_lock);
+
+    return err;
+}
+
+status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
+{
+    LTRACEF("name '%s' flags 0x%x\n", name, flags);
+
+    DEBUG_ASSERT(_aspace);
+
+    /* there is only the one kernel aspace */
+    if (flags & VMM_ASPACE_FLAG_KERNEL)
+        return ERR_INVALID_ARGS;
+
+    vmm_aspace_t *aspace = kmem_cache_alloc(&aspace_cache);
+    if (!aspace)
+        return ERR_NO_MEMORY;
+
+    memset(aspace, 0, sizeof(*aspace));
+    strlcpy(aspace->name, name ? name : "unnamed", sizeof(aspace->name));
+    aspace->flags = flags;
+    aspace->base = USER_ASPACE_BASE;
+    aspace->size = USER_ASPACE_SIZE;
+    list_initialize(&aspace->region_list);
+
+    status_t err = arch_mmu_init_aspace(&aspace->arch_aspace, aspace->base, aspace->size, 0);
+    if (err < 0) {
+        kmem_cache_free(&aspace_cache, aspace);
+        return err;
+    }
+
+    mutex_acquire(&vmm_lock);
+    list_add_tail(&aspace_list, &aspace->node);
+    mutex_release(&vmm_lock);
+
+    *_aspace = aspace;
+
+    return NO_ERROR;
+}
+
+status_t vmm_free_aspace(vmm_aspace_t *aspace)
+{
+    LTRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(get_current_thread()->aspace != aspace);
+
+    if (aspace->flags & VMM_ASPACE_FLAG_KERNEL)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&vmm_lock);
+
+    list_delete(&aspace->node);
+
+    /* pull all of the regions out, the mappings go away with the translation
+     * tables below so there is no need to unmap them one at a time */
+    struct list_node region_list = LIST_INITIAL_VALUE(region_list);
+    vmm_region_t *r;
+    while ((r = list_peek_head_type(&aspace->region_list, vmm_region_t, node))) {
+        remove_region_from_aspace(aspace, r);
+        list_add_tail(&region_list, &r->node);
+    }
+
+    mutex_release(&vmm_lock);
+
+    arch_mmu_destroy_aspace(&aspace->arch_aspace);
+
+    while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
+        pmm_free(&r->page_list);
+        kmem_cache_free(&region_cache, r);
+    }
+
+    kmem_cache_free(&aspace_cache, aspace);
+
+    return NO_ERROR;
+}
+
+void vmm_set_active_aspace(vmm_aspace_t *aspace)
+{
+    LTRACEF("aspace %p\n", aspace);
+
+    /* the kernel's mappings are always there, threads only track a user aspace */
+    if (aspace == vmm_get_kernel_aspace())
+        aspace = NULL;
+
+    thread_t *t = get_current_thread();
+    DEBUG_ASSERT(t);
+
+    if (aspace == t->aspace)
+        return;
+
+    /* keep a context switch from landing between updating the thread and
+     * loading the new tables */
+    enter_critical_section();
+    vmm_aspace_t *old = t->aspace;
+    t->aspace = aspace;
+    vmm_context_switch(old, aspace);
+    exit_critical_section();
+}
+
+void vmm_context_switch(vmm_aspace_t *oldaspace, vmm_aspace_t *newaspace)
+{
+    DEBUG_ASSERT(in_critical_section());
+
+    arch_mmu_context_switch(newaspace ? &newaspace->arch_aspace : NULL);
+}
+
 static void dump_region(const vmm_region_t *r)
 {
     printf("\tregion %p: name '%s' range 0x%lx - 0x%lx size 0x%zx flags 0x%x mmu_flags 0x%x\n",
@@ -533,6 +1008,13 @@ usage:
         printf("%s alloc <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_physical <paddr> <size>\n", argv[0].str);
         printf("%s alloc_contig <size> <align_pow2>\n", argv[0].str);
+        printf("%s alloc_demand <size> <align_pow2>\n", argv[0].str);
+        printf("%s free <vaddr>\n", argv[0].str);
+        printf("%s commit <vaddr> <size>\n", argv[0].str);
+        printf("%s decommit <vaddr> <size>\n", argv[0].str);
+        printf("%s create_aspace\n", argv[0].str);
+        printf("%s free_aspace <aspace>\n", argv[0].str);
+        printf("%s set_aspace <aspace>\n", argv[0].str);
         return ERR_GENERIC;
     }
 
@@ -559,6 +1041,40 @@ usage:
         void *ptr = (void *)0x99;
         status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "contig test", argv[2].u, &ptr, argv[3].u, 0, 0);
         printf("vmm_alloc_contig returns %d, ptr %p\n", err, ptr);
+    } else if (!strcmp(argv[1].str, "alloc_demand")) {
+        if (argc < 4) goto notenoughargs;
+
+        void *ptr = (void *)0x99;
+        status_t err = vmm_alloc(vmm_get_kernel_aspace(), "demand test", argv[2].u, &ptr, argv[3].u, VMM_FLAG_COMMIT_ON_DEMAND, 0);
+        printf("vmm_alloc returns %d, ptr %p\n", err, ptr);
+    } else if (!strcmp(argv[1].str, "free")) {
+        if (argc < 3) goto notenoughargs;
+
+        status_t err = vmm_free_region(vmm_get_kernel_aspace(), argv[2].u);
+        printf("vmm_free_region returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "commit")) {
+        if (argc < 4) goto notenoughargs;
+
+        status_t err = vmm_commit_range(vmm_get_kernel_aspace(), argv[2].u, argv[3].u);
+        printf("vmm_commit_range returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "decommit")) {
+        if (argc < 4) goto notenoughargs;
+
+        status_t err = vmm_decommit_range(vmm_get_kernel_aspace(), argv[2].u, argv[3].u);
+        printf("vmm_decommit_range returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "create_aspace")) {
+        vmm_aspace_t *aspace;
+        status_t err = vmm_create_aspace(&aspace, "test", 0);
+        printf("vmm_create_aspace returns %d, aspace %p\n", err, err < 0 ? NULL : aspace);
+    } else if (!strcmp(argv[1].str, "free_aspace")) {
+        if (argc < 3) goto notenoughargs;
+
+        status_t err = vmm_free_aspace((vmm_aspace_t *)argv[2].u);
+        printf("vmm_free_aspace returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "set_aspace")) {
+        if (argc < 3) goto notenoughargs;
+
+        vmm_set_active_aspace((vmm_aspace_t *)argv[2].u);
     } else {
         printf("unknown command\n");
         goto usage;
@@ -26,7 +26,10 @@
 #include <string.h>
 #include <sys/types.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
+#include <kernel/mutex.h>
+#include <kernel/shrinker.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
@@ -37,7 +40,7 @@ struct bcache_block {
 	bnum_t blocknum;
 	int ref_count;
 	bool is_dirty;
-	void *ptr;
+	void *ptr; /* allocated on first use, NULL once the shrinker took it back */
 };
 
 struct bcache_stats {
@@ -54,12 +57,18 @@ struct bcache {
 	int count;
 	struct bcache_stats stats;
 
+	mutex_t lock;
+	shrinker_t shrinker;
+
 	struct list_node free_list;
 	struct list_node lru_list;
 
 	struct bcache_block *blocks;
 };
 
+static size_t bcache_shrinker_count(shrinker_t *s);
+static size_t bcache_shrinker_shrink(shrinker_t *s, size_t target);
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
 	struct bcache *cache;
@@ -71,6 +80,8 @@ bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 	cache->count = block_count;
 	memset(&cache->stats, 0, sizeof(cache->stats));
 
+	mutex_init(&cache->lock);
+
 	list_initialize(&cache->free_list);
 	list_initialize(&cache->lru_list);
 
@@ -79,11 +90,16 @@ bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 	for (i=0; i < block_count; i++) {
 		cache->blocks[i].ref_count = 0;
 		cache->blocks[i].is_dirty = false;
-		cache->blocks[i].ptr = malloc(block_size);
+		cache->blocks[i].ptr = NULL;
 		// add to the free list
 		list_add_head(&cache->free_list, &cache->blocks[i].node);
 	}
 
+	// let the clean blocks go when memory gets tight
+	cache->shrinker = (shrinker_t)SHRINKER_INITIAL_VALUE(cache->shrinker, "bcache",
+	                  &bcache_shrinker_count, &bcache_shrinker_shrink, cache);
+	shrinker_register(&cache->shrinker);
+
 	return (bcache_t)cache;
 }
 
@@ -109,6 +125,9 @@ void bcache_destroy(bcache_t _cache)
 	struct bcache *cache = _cache;
 	int i;
 
+	shrinker_unregister(&cache->shrinker);
+	mutex_destroy(&cache->lock);
+
 	for (i=0; i < cache->count; i++) {
 		DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -156,6 +175,14 @@ static struct bcache_block *alloc_block(struct bcache *cache)
 
 	/* pop one off the free list if it's present */
 	block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+	if (block && !block->ptr) {
+		block->ptr = malloc(cache->block_size);
+		if (!block->ptr) {
+			/* reuse one of the blocks we already have instead */
+			list_add_head(&cache->free_list, &block->node);
+			block = NULL;
+		}
+	}
 	if (block) {
 		block->ref_count = 0;
 		list_add_tail(&cache->lru_list, &block->node);
@@ -196,7 +223,8 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 
 		/* allocate a new block and fill it */
 		block = alloc_block(cache);
-		DEBUG_ASSERT(block);
+		if (block == NULL)
+			return NULL;
 
 		LTRACEF("wasn't allocated, new block %p\n", block);
 
@@ -204,6 +232,7 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 		err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
 		if (err < 0) {
 			/* free the block, return an error */
+			list_delete(&block->node);
 			list_add_tail(&cache->free_list, &block->node);
 			return NULL;
 		}
@@ -222,13 +251,18 @@ int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 
 	LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
+	mutex_acquire(&cache->lock);
+
 	struct bcache_block *block = find_or_fill_block(cache, blocknum);
 	if (block == NULL) {
 		/* error */
+		mutex_release(&cache->lock);
 		return -1;
 	}
 
 	memcpy(buf, block->ptr, cache->block_size);
+
+	mutex_release(&cache->lock);
 	return 0;
 }
 
@@ -240,9 +274,12 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 
 	DEBUG_ASSERT(ptr);
 
+	mutex_acquire(&cache->lock);
+
 	struct bcache_block *block = find_or_fill_block(cache, blocknum);
 	if (block == NULL) {
 		/* error */
+		mutex_release(&cache->lock);
 		return -1;
 	}
 
@@ -250,6 +287,7 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 	block->ref_count++;
 	*ptr = block->ptr;
 
+	mutex_release(&cache->lock);
 	return 0;
 }
 
@@ -259,6 +297,8 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
 	LTRACEF("blocknum %u\n", blocknum);
 
+	mutex_acquire(&cache->lock);
+
 	struct bcache_block *block = find_block(cache, blocknum);
 
 	/* be pretty hard on the caller for now */
@@ -267,6 +307,7 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
 	block->ref_count--;
 
+	mutex_release(&cache->lock);
 	return 0;
 }
 
@@ -276,6 +317,8 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
+	mutex_acquire(&cache->lock);
+
 	block = find_block(cache, blocknum);
 	if (!block) {
 		err = -1;
@@ -285,6 +328,7 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 	block->is_dirty = true;
 	err = 0;
 exit:
+	mutex_release(&cache->lock);
 	return (err);
 }
 
@@ -294,6 +338,8 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
+	mutex_acquire(&cache->lock);
+
 	block = find_block(cache, blocknum);
 	if (!block) {
 		block = alloc_block(cache);
@@ -309,6 +355,7 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 	block->is_dirty = true;
 	err = 0;
 exit:
+	mutex_release(&cache->lock);
 	return (err);
 }
 
@@ -318,6 +365,8 @@ int bcache_flush(bcache_t priv)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
+	mutex_acquire(&cache->lock);
+
 	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
 		if (block->is_dirty) {
 			err = flush_block(cache, block);
@@ -328,6 +377,7 @@ int bcache_flush(bcache_t priv)
 
 	err = 0;
 exit:
+	mutex_release(&cache->lock);
 	return (err);
 }
 
@@ -348,3 +398,77 @@ void bcache_dump(bcache_t priv, const char *name)
 	       cache->stats.reads,
 	       cache->stats.writes);
 }
+
+/* the shrinker runs in whatever thread ran out of memory, which may be in the
+ * middle of using the cache itself. Leave the cache alone if it's busy. */
+static bool bcache_shrinker_trylock(struct bcache *cache)
+{
+	if (mutex_holder(&cache->lock) == get_current_thread())
+		return false;
+
+	return mutex_acquire_timeout(&cache->lock, 0) == NO_ERROR;
+}
+
+static size_t bcache_shrinker_count(shrinker_t *s)
+{
+	struct bcache *cache = s->arg;
+	struct bcache_block *block;
+	size_t count = 0;
+
+	if (!bcache_shrinker_trylock(cache))
+		return 0;
+
+	list_for_every_entry(&cache->free_list, block, struct bcache_block, node) {
+		if (block->ptr)
+			count += cache->block_size;
+	}
+	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+		if (block->ref_count == 0 && !block->is_dirty)
+			count += cache->block_size;
+	}
+
+	mutex_release(&cache->lock);
+
+	return count;
+}
+
+static size_t bcache_shrinker_shrink(shrinker_t *s, size_t target)
+{
+	struct bcache *cache = s->arg;
+	struct bcache_block *block, *temp;
+	size_t freed = 0;
+
+	if (!bcache_shrinker_trylock(cache))
+		return 0;
+
+	/* blocks nobody is using first */
+	list_for_every_entry(&cache->free_list, block, struct bcache_block, node) {
+		if (freed >= target)
+			break;
+		if (block->ptr) {
+			free(block->ptr);
+			block->ptr = NULL;
+			freed += cache->block_size;
+		}
+	}
+
+	/* then clean, unreferenced blocks, least recently used first. dirty ones
+	 * would need writing back, which could want memory of its own */
+	list_for_every_entry_safe(&cache->lru_list, block, temp, struct bcache_block, node) {
+		if (freed >= target)
+			break;
+		if (block->ref_count == 0 && !block->is_dirty) {
+			list_delete(&block->node);
+			free(block->ptr);
+			block->ptr = NULL;
+			list_add_tail(&cache->free_list, &block->node);
+			freed += cache->block_size;
+		}
+	}
+
+	mutex_release(&cache->lock);
+
+	LTRACEF("freed 0x%zx of 0x%zx\n", freed, target);
+
+	return freed;
+}
@@ -12,40 +12,33 @@
 /* @(#) $Id$ */
 
 /*
-  Note on the use of DYNAMIC_CRC_TABLE: there is no mutex or semaphore
-  protection on the static variables used to control the first-use generation
-  of the crc tables.  Therefore, if you #define DYNAMIC_CRC_TABLE, you should
-  first call get_crc_table() to initialize the tables before allowing more than
-  one thread to use crc32().
-
-  DYNAMIC_CRC_TABLE and MAKECRCH can be #defined to write out crc32.h.
+  The zlib table generation and four-bytes-at-a-time code has been replaced
+  with slicing by 8 tables for both CRC-32 and CRC-32C, plus whatever crc
+  instructions the cpu has. The implementation is picked once at boot, see
+  crc_impls[] below.
  */
 
-#ifdef MAKECRCH
-#  include <stdio.h>
-#  ifndef DYNAMIC_CRC_TABLE
-#    define DYNAMIC_CRC_TABLE
-#  endif /* !DYNAMIC_CRC_TABLE */
-#endif /* MAKECRCH */
-
+#include <arch/cpu_features.h>
+#include <compiler.h>
+#include <endian.h>
+#include <lib/cksum.h>
 #include "zutil.h"      /* for STDC and FAR definitions */
+#include "crc32_priv.h"
 
 #define local static
 
-/* Definitions for doing the crc four data bytes at a time. */
-#if !defined(NOBYFOUR) && defined(Z_U4)
-#error
-#  define BYFOUR
+/* set to 0 in rules.mk to get by with the 1KB byte tables */
+#ifndef CRC_SLICE_BY_8
+#define CRC_SLICE_BY_8 1
 #endif
-#ifdef BYFOUR
-   local unsigned long crc32_little OF((unsigned long,
-                        const unsigned char FAR *, unsigned));
-   local unsigned long crc32_big OF((unsigned long,
-                        const unsigned char FAR *, unsigned));
-#  define TBLS 8
+
+#if CRC_SLICE_BY_8
+#define CRC_TABLES 8
+#define CRC_SW_METHOD "slice-by-8"
 #else
-#  define TBLS 1
-#endif /* BYFOUR */
+#define CRC_TABLES 1
+#define CRC_SW_METHOD "bytewise"
+#endif
 
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
@@ -53,274 +46,143 @@ local unsigned long gf2_matrix_times OF((unsigned long *mat,
 local void gf2_matrix_square OF((unsigned long *square, unsigned long *mat));
 local uLong crc32_combine_ OF((uLong crc1, uLong crc2, z_off64_t len2));
 
-
-#ifdef DYNAMIC_CRC_TABLE
-
-local volatile int crc_table_empty = 1;
-local z_crc_t FAR crc_table[TBLS][256];
-local void make_crc_table OF((void));
-#ifdef MAKECRCH
-   local void write_table OF((FILE *, const z_crc_t FAR *));
-#endif /* MAKECRCH */
-/*
-  Generate tables for a byte-wise 32-bit CRC calculation on the polynomial:
-  x^32+x^26+x^23+x^22+x^16+x^12+x^11+x^10+x^8+x^7+x^5+x^4+x^2+x+1.
-
-  Polynomials over GF(2) are represented in binary, one bit per coefficient,
-  with the lowest powers in the most significant bit.  Then adding polynomials
-  is just exclusive-or, and multiplying a polynomial by x is a right shift by
-  one.  If we call the above polynomial p, and represent a byte as the
-  polynomial q, also with the lowest power in the most significant bit (so the
-  byte 0xb1 is the polynomial x^7+x^3+x+1), then the CRC is (q*x^32) mod p,
-  where a mod b means the remainder after dividing a by b.
-
-  This calculation is done using the shift-register method of multiplying and
-  taking the remainder.  The register is initialized to zero, and for each
-  incoming bit, x^32 is added mod p to the register if the bit is a one (where
-  x^32 mod p is p+x^32 = x^26+...+1), and the register is multiplied mod p by
-  x (which is shifting right by one and adding x^32 mod p if the bit shifted
-  out is a one).  We start with the highest power (least significant bit) of
-  q and repeat for all eight bits of q.
-
-  The first table is simply the CRC of all possible eight bit values.  This is
-  all the information needed to generate CRCs on data a byte at a time for all
-  combinations of CRC register values and incoming bytes.  The remaining tables
-  allow for word-at-a-time CRC calculation for both big-endian and little-
-  endian machines, where a word is four bytes.
-*/
-local void make_crc_table()
-{
-    z_crc_t c;
-    int n, k;
-    z_crc_t poly;                       /* polynomial exclusive-or pattern */
-    /* terms of polynomial defining this crc (except x^32): */
-    static volatile int first = 1;      /* flag to limit concurrent making */
-    static const unsigned char p[] = {0,1,2,4,5,7,8,10,11,12,16,22,23,26};
-
-    /* See if another task is already doing this (not thread-safe, but better
-       than nothing -- significantly reduces duration of vulnerability in
-       case the advice about DYNAMIC_CRC_TABLE is ignored) */
-    if (first) {
-        first = 0;
-
-        /* make exclusive-or pattern from polynomial (0xedb88320UL) */
-        poly = 0;
-        for (n = 0; n < (int)(sizeof(p)/sizeof(unsigned char)); n++)
-            poly |= (z_crc_t)1 << (31 - p[n]);
-
-        /* generate a crc for every 8-bit value */
-        for (n = 0; n < 256; n++) {
-            c = (z_crc_t)n;
-            for (k = 0; k < 8; k++)
-                c = c & 1 ? poly ^ (c >> 1) : c >> 1;
-            crc_table[0][n] = c;
-        }
-
-#ifdef BYFOUR
-        /* generate crc for each value followed by one, two, and three zeros,
-           and then the byte reversal of those as well as the first table */
-        for (n = 0; n < 256; n++) {
-            c = crc_table[0][n];
-            crc_table[4][n] = ZSWAP32(c);
-            for (k = 1; k < 4; k++) {
-                c = crc_table[0][c & 0xff] ^ (c >> 8);
-                crc_table[k][n] = c;
-                crc_table[k + 4][n] = ZSWAP32(c);
-            }
-        }
-#endif /* BYFOUR */
-
-        crc_table_empty = 0;
-    }
-    else {      /* not first */
-        /* wait for the other guy to finish (not efficient, but rare) */
-        while (crc_table_empty)
-            ;
-    }
-
-#ifdef MAKECRCH
-    /* write out CRC tables to crc32.h */
-    {
-        FILE *out;
-
-        out = fopen("crc32.h", "w");
-        if (out == NULL) return;
-        fprintf(out, "/* crc32.h -- tables for rapid CRC calculation\n");
-        fprintf(out, " * Generated automatically by crc32.c\n */\n\n");
-        fprintf(out, "local const z_crc_t FAR ");
-        fprintf(out, "crc_table[TBLS][256] =\n{\n  {\n");
-        write_table(out, crc_table[0]);
-#  ifdef BYFOUR
-        fprintf(out, "#ifdef BYFOUR\n");
-        for (k = 1; k < 8; k++) {
-            fprintf(out, "  },\n  {\n");
-            write_table(out, crc_table[k]);
-        }
-        fprintf(out, "#endif\n");
-#  endif /* BYFOUR */
-        fprintf(out, "  }\n};\n");
-        fclose(out);
-    }
-#endif /* MAKECRCH */
-}
-
-#ifdef MAKECRCH
-local void write_table(out, table)
-    FILE *out;
-    const z_crc_t FAR *table;
-{
-    int n;
-
-    for (n = 0; n < 256; n++)
-        fprintf(out, "%s0x%08lxUL%s", n % 5 ? "" : "    ",
-                (unsigned long)(table[n]),
-                n == 255 ? "\n" : (n % 5 == 4 ? ",\n" : ", "));
-}
-#endif /* MAKECRCH */
-
-#else /* !DYNAMIC_CRC_TABLE */
 /* ========================================================================
- * Tables of CRC-32s of all single-byte values, made by make_crc_table().
+ * Tables of CRC-32s and CRC-32Cs of all single-byte values, followed by
+ * zero to seven zero bytes.
  */
 #include "crc32.h"
-#endif /* DYNAMIC_CRC_TABLE */
 
 /* =========================================================================
  * This function can be used by asm versions of crc32()
  */
-const z_crc_t FAR * ZEXPORT get_crc_table()
+const uint32_t FAR * ZEXPORT get_crc_table()
 {
-#ifdef DYNAMIC_CRC_TABLE
-    if (crc_table_empty)
-        make_crc_table();
-#endif /* DYNAMIC_CRC_TABLE */
-    return (const z_crc_t FAR *)crc_table;
+    return crc32_table[0];
 }
 
 /* ========================================================================= */
-#define DO1 crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8)
-#define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
+local uint32_t crc_bytes(const uint32_t table[][256], uint32_t c,
+                         const unsigned char *buf, size_t len)
+{
+    while (len--)
+        c = table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return c;
+}
 
+#if CRC_SLICE_BY_8
 /* ========================================================================= */
-unsigned long ZEXPORT crc32(crc, buf, len)
-    unsigned long crc;
-    const unsigned char FAR *buf;
-    uInt len;
+#define DOSLICE8(t, c, lo, hi) \
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ \
+            t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ \
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ \
+            t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24]
+
+/* eight bytes per step from aligned words, the tables do the rest */
+local uint32_t crc_slice8(const uint32_t table[][256], uint32_t c,
+                          const unsigned char *buf, size_t len)
 {
-    if (buf == Z_NULL) return 0UL;
-
-#ifdef DYNAMIC_CRC_TABLE
-    if (crc_table_empty)
-        make_crc_table();
-#endif /* DYNAMIC_CRC_TABLE */
+    const uint32_t *buf4;
+    uint32_t lo, hi;
 
-#ifdef BYFOUR
-    if (sizeof(void *) == sizeof(ptrdiff_t)) {
-        z_crc_t endian;
-
-        endian = 1;
-        if (*((unsigned char *)(&endian)))
-            return crc32_little(crc, buf, len);
-        else
-            return crc32_big(crc, buf, len);
+    while (len && ((uintptr_t)buf & 3)) {
+        c = table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+        len--;
     }
-#endif /* BYFOUR */
-    crc = crc ^ 0xffffffffUL;
+
+    buf4 = (const uint32_t *)(const void *)buf;
     while (len >= 8) {
-        DO8;
+        lo = LE32(buf4[0]) ^ c;
+        hi = LE32(buf4[1]);
+        DOSLICE8(table, c, lo, hi);
+        buf4 += 2;
         len -= 8;
     }
-    if (len) do {
-        DO1;
-    } while (--len);
-    return crc ^ 0xffffffffUL;
-}
 
-#ifdef BYFOUR
+    return crc_bytes(table, c, (const unsigned char *)buf4, len);
+}
+#else
+#define crc_slice8 crc_bytes
+#endif
 
 /* ========================================================================= */
-#define DOLIT4 c ^= *buf4++; \
-        c = crc_table[3][c & 0xff] ^ crc_table[2][(c >> 8) & 0xff] ^ \
-            crc_table[1][(c >> 16) & 0xff] ^ crc_table[0][c >> 24]
-#define DOLIT32 DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4; DOLIT4
+local uint32_t crc32_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return ~crc_slice8(crc32_table, ~crc, buf, len);
+}
+
+local uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return ~crc_slice8(crc32c_table, ~crc, buf, len);
+}
 
 /* ========================================================================= */
-local unsigned long crc32_little(crc, buf, len)
-    unsigned long crc;
-    const unsigned char FAR *buf;
-    unsigned len;
+/* Every implementation, portable ones first. The last one of each kind the
+ * cpu has the features for is what crc32() and crc32c() end up calling. */
+const struct crc_impl crc_impls[] = {
+    { CRC_SW_METHOD, false, 0, crc32_sw },
+#if ARCH_ARM64
+    { "armv8 crc32", false, CPU_FEATURE_BIT(CPU_FEATURE_CRC32), crc32_armv8 },
+#endif
+    { CRC_SW_METHOD, true, 0, crc32c_sw },
+#if ARCH_ARM64
+    { "armv8 crc32", true, CPU_FEATURE_BIT(CPU_FEATURE_CRC32), crc32c_armv8 },
+#endif
+#if ARCH_X86_64
+    { "sse4.2 crc32", true, CPU_FEATURE_BIT(CPU_FEATURE_CRC32), crc32c_sse42 },
+#endif
+};
+
+const size_t crc_impl_count = countof(crc_impls);
+
+local crc_func crc_resolve(bool castagnoli, uint32_t features)
 {
-    register z_crc_t c;
-    register const z_crc_t FAR *buf4;
+    crc_func func = NULL;
 
-    c = (z_crc_t)crc;
-    c = ~c;
-    while (len && ((ptrdiff_t)buf & 3)) {
-        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
-        len--;
+    for (size_t i = 0; i < crc_impl_count; i++) {
+        const struct crc_impl *impl = &crc_impls[i];
+        if (impl->castagnoli == castagnoli && (impl->features & features) == impl->features)
+            func = impl->func;
     }
+    return func;
+}
 
-    buf4 = (const z_crc_t FAR *)(const void FAR *)buf;
-    while (len >= 32) {
-        DOLIT32;
-        len -= 32;
-    }
-    while (len >= 4) {
-        DOLIT4;
-        len -= 4;
-    }
-    buf = (const unsigned char FAR *)buf4;
+local crc_func crc32_resolve(uint32_t features)
+{
+    return crc_resolve(false, features);
+}
 
-    if (len) do {
-        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
-    } while (--len);
-    c = ~c;
-    return (unsigned long)c;
+local crc_func crc32c_resolve(uint32_t features)
+{
+    return crc_resolve(true, features);
 }
 
-/* ========================================================================= */
-#define DOBIG4 c ^= *++buf4; \
-        c = crc_table[4][c & 0xff] ^ crc_table[5][(c >> 8) & 0xff] ^ \
-            crc_table[6][(c >> 16) & 0xff] ^ crc_table[7][c >> 24]
-#define DOBIG32 DOBIG4; DOBIG4; DOBIG4; DOBIG4; DOBIG4; DOBIG4; DOBIG4; DOBIG4
+local crc_func crc32_func = crc32_sw;
+local crc_func crc32c_func = crc32c_sw;
+
+CPU_DISPATCH(crc32, crc32_func, crc32_resolve);
+CPU_DISPATCH(crc32c, crc32c_func, crc32c_resolve);
 
 /* ========================================================================= */
-local unsigned long crc32_big(crc, buf, len)
+unsigned long ZEXPORT crc32(crc, buf, len)
     unsigned long crc;
     const unsigned char FAR *buf;
-    unsigned len;
+    uInt len;
 {
-    register z_crc_t c;
-    register const z_crc_t FAR *buf4;
-
-    c = ZSWAP32((z_crc_t)crc);
-    c = ~c;
-    while (len && ((ptrdiff_t)buf & 3)) {
-        c = crc_table[4][(c >> 24) ^ *buf++] ^ (c << 8);
-        len--;
-    }
+    if (buf == Z_NULL) return 0UL;
 
-    buf4 = (const z_crc_t FAR *)(const void FAR *)buf;
-    buf4--;
-    while (len >= 32) {
-        DOBIG32;
-        len -= 32;
-    }
-    while (len >= 4) {
-        DOBIG4;
-        len -= 4;
-    }
-    buf4++;
-    buf = (const unsigned char FAR *)buf4;
-
-    if (len) do {
-        c = crc_table[4][(c >> 24) ^ *buf++] ^ (c << 8);
-    } while (--len);
-    c = ~c;
-    return (unsigned long)(ZSWAP32(c));
+    return crc32_func((uint32_t)crc, buf, len);
 }
 
-#endif /* BYFOUR */
+/* ========================================================================= */
+unsigned long ZEXPORT crc32c(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    uInt len;
+{
+    if (buf == Z_NULL) return 0UL;
+
+    return crc32c_func((uint32_t)crc, buf, len);
+}
 
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
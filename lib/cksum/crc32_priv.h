@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint32_t (*crc_func)(uint32_t crc, const unsigned char *buf, size_t len);
+
+/* one way of computing a crc, see crc_impls[] in crc32.c */
+struct crc_impl {
+    const char *method;
+    bool castagnoli;        /* crc32c rather than crc32 */
+    uint32_t features;      /* CPU_FEATURE_BIT()s it needs to run */
+    crc_func func;
+};
+
+extern const struct crc_impl crc_impls[];
+extern const size_t crc_impl_count;
+
+/* arch/<arch>/crc32.S, same calling convention as crc32() */
+uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len);
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char *buf, size_t len);
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len);
@@ -29,11 +29,15 @@
 #include <kernel/thread.h>
 #include <platform.h>
 #include <lib/cksum.h>
+#include <arch/cpu_features.h>
 
 #include <lib/console.h>
 
+#include "crc32_priv.h"
+
 static int cmd_crc16(int argc, const cmd_args *argv);
 static int cmd_crc32(int argc, const cmd_args *argv);
+static int cmd_crc32c(int argc, const cmd_args *argv);
 static int cmd_adler32(int argc, const cmd_args *argv);
 static int cmd_cksum_bench(int argc, const cmd_args *argv);
 
@@ -41,6 +45,7 @@ STATIC_COMMAND_START
 #if LK_DEBUGLEVEL > 0
 	{ "crc16", "crc16", &cmd_crc16 },
 	{ "crc32", "crc32", &cmd_crc32 },
+	{ "crc32c", "crc32c", &cmd_crc32c },
 	{ "adler32", "adler32", &cmd_adler32 },
 #endif
 #if LK_DEBUGLEVEL > 1
@@ -78,6 +83,21 @@ static int cmd_crc32(int argc, const cmd_args *argv)
 	return 0;
 }
 
+static int cmd_crc32c(int argc, const cmd_args *argv)
+{
+	if (argc < 3) {
+		printf("not enough arguments\n");
+		printf("usage: %s <address> <size>\n", argv[0].str);
+		return -1;
+	}
+
+	uint32_t crc = crc32c(0, (void *)argv[1].u, argv[2].u);
+
+	printf("0x%x\n", crc);
+
+	return 0;
+}
+
 static int cmd_adler32(int argc, const cmd_args *argv)
 {
 	if (argc < 3) {
@@ -123,6 +143,28 @@ static int cmd_cksum_bench(int argc, const cmd_args *argv)
 
 	printf("took %llu usecs to adler32 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
 
+	/* every crc implementation this cpu can run, not just the ones picked */
+	uint32_t features = arch_cpu_features();
+	for (size_t i = 0; i < crc_impl_count; i++) {
+		const struct crc_impl *impl = &crc_impls[i];
+
+		if ((impl->features & features) != impl->features)
+			continue;
+
+		thread_sleep(500);
+
+		t = current_time_hires();
+		crc = 0;
+		for (int j = 0; j < ITER; j++) {
+			crc = impl->func(crc, buf, BUFSIZE);
+		}
+		t = current_time_hires() - t;
+
+		printf("took %llu usecs to %s %d bytes with %s (%lld bytes/sec)\n", t,
+		       impl->castagnoli ? "crc32c" : "crc32", BUFSIZE * ITER, impl->method,
+		       (BUFSIZE * ITER) * 1000000ULL / t);
+	}
+
 	free(buf);
 	return 0;
 }
@@ -8,6 +8,23 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/crc32.c \
 	$(LOCAL_DIR)/debug.c
 
+# the slicing by 8 tables are 8KB per polynomial instead of 1KB, which is
+# too much for the smaller microcontrollers
+ifeq ($(SUBARCH),arm-m)
+CKSUM_CRC_SLICE_BY_8 ?= 0
+endif
+CKSUM_CRC_SLICE_BY_8 ?= 1
+
+MODULE_DEFINES += CRC_SLICE_BY_8=$(CKSUM_CRC_SLICE_BY_8)
+
+# crc instructions, picked at runtime if the cpu has them
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += $(LOCAL_DIR)/arch/arm64/crc32.S
+endif
+ifeq ($(ARCH),x86-64)
+MODULE_SRCS += $(LOCAL_DIR)/arch/x86-64/crc32.S
+endif
+
 MODULE_CFLAGS += -Wno-strict-prototypes
 
 include make/module.mk
@@ -23,9 +23,9 @@
 #include <debug.h>
 #include <stddef.h>
 #include <list.h>
-#include <malloc.h>
 #include <err.h>
 #include <lib/dpc.h>
+#include <lib/kmem.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <lk/init.h>
@@ -37,6 +37,7 @@ struct dpc {
 	void *arg;
 };
 
+static kmem_cache_t dpc_cache = KMEM_CACHE_INITIAL_VALUE(dpc_cache, "dpc", sizeof(struct dpc), 0);
 static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
 static event_t dpc_event;
 
@@ -46,7 +47,7 @@ status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 {
 	struct dpc *dpc;
 
-	dpc = malloc(sizeof(struct dpc));
+	dpc = kmem_cache_alloc(&dpc_cache);
 
 	if (dpc == NULL)
 		return ERR_NO_MEMORY;
@@ -76,7 +77,7 @@ static int dpc_thread_routine(void *arg)
 //			dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
 			dpc->cb(dpc->arg);
 
-			free(dpc);
+			kmem_cache_free(&dpc_cache, dpc);
 		}
 	}
 
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2008-2009,2012,2014 Travis Geiselbrecht
+ * Copyright (c) 2009 Corey Tabaka
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arch/defines.h>
+#include "heap_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* Address ordered first fit free list. Simple and compact, but allocation
+ * time grows with the number of free chunks.
+ */
+
+struct free_heap_chunk {
+	struct list_node node;
+	size_t len;
+};
+
+static struct list_node free_list = LIST_INITIAL_VALUE(free_list);
+static size_t remaining;
+
+static void dump_free_chunk(struct free_heap_chunk *chunk)
+{
+	dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
+}
+
+// try to insert this free chunk into the free list, consuming the chunk by merging it with
+// nearby ones if possible. Returns base of whatever chunk it became in the list.
+static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+{
+#if LK_DEBUGLEVEL > INFO
+	vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
+#endif
+
+	LTRACEF("chunk ptr %p, size 0x%zx\n", chunk, chunk->len);
+
+	struct free_heap_chunk *next_chunk;
+	struct free_heap_chunk *last_chunk;
+
+	remaining += chunk->len;
+
+	// walk through the list, finding the node to insert before
+	list_for_every_entry(&free_list, next_chunk, struct free_heap_chunk, node) {
+		if (chunk < next_chunk) {
+			DEBUG_ASSERT(chunk_end <= (vaddr_t)next_chunk);
+
+			list_add_before(&next_chunk->node, &chunk->node);
+
+			goto try_merge;
+		}
+	}
+
+	// walked off the end of the list, add it at the tail
+	list_add_tail(&free_list, &chunk->node);
+
+	// try to merge with the previous chunk
+try_merge:
+	last_chunk = list_prev_type(&free_list, &chunk->node, struct free_heap_chunk, node);
+	if (last_chunk) {
+		if ((vaddr_t)last_chunk + last_chunk->len == (vaddr_t)chunk) {
+			// easy, just extend the previous chunk
+			last_chunk->len += chunk->len;
+
+			// remove ourself from the list
+			list_delete(&chunk->node);
+
+			// set the chunk pointer to the newly extended chunk, in case
+			// it needs to merge with the next chunk below
+			chunk = last_chunk;
+		}
+	}
+
+	// try to merge with the next chunk
+	if (next_chunk) {
+		if ((vaddr_t)chunk + chunk->len == (vaddr_t)next_chunk) {
+			// extend our chunk
+			chunk->len += next_chunk->len;
+
+			// remove them from the list
+			list_delete(&next_chunk->node);
+		}
+	}
+
+	return chunk;
+}
+
+static struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len)
+{
+	DEBUG_ASSERT((len % sizeof(void *)) == 0); // size must be aligned on pointer boundary
+
+	struct free_heap_chunk *chunk = (struct free_heap_chunk *)ptr;
+	chunk->len = len;
+
+	return chunk;
+}
+
+void heap_backend_init(void)
+{
+}
+
+void heap_backend_add(void *ptr, size_t len)
+{
+	heap_insert_free_chunk(heap_create_free_chunk(ptr, len));
+}
+
+void *heap_backend_alloc(size_t size, size_t *len)
+{
+	// make sure we allocate at least the size of a struct free_heap_chunk so that
+	// when we free it, we can create a struct free_heap_chunk struct and stick it
+	// in the spot
+	if (size < sizeof(struct free_heap_chunk))
+		size = sizeof(struct free_heap_chunk);
+
+	// walk through the list
+	struct free_heap_chunk *chunk;
+	list_for_every_entry(&free_list, chunk, struct free_heap_chunk, node) {
+		DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
+
+		// is it big enough to service our allocation?
+		if (chunk->len >= size) {
+			// remove it from the list
+			struct list_node *next_node = list_next(&free_list, &chunk->node);
+			list_delete(&chunk->node);
+
+			if (chunk->len > size + sizeof(struct free_heap_chunk)) {
+				// there's enough space in this chunk to create a new one after the allocation
+				struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)chunk + size, chunk->len - size);
+
+				// truncate this chunk
+				chunk->len -= chunk->len - size;
+
+				// add the new one where chunk used to be
+				if (next_node)
+					list_add_before(next_node, &newchunk->node);
+				else
+					list_add_tail(&free_list, &newchunk->node);
+			}
+
+			// the allocated size is actually the length of this chunk, not the size requested
+			DEBUG_ASSERT(chunk->len >= size);
+			*len = chunk->len;
+			remaining -= chunk->len;
+
+			return chunk;
+		}
+	}
+
+	return NULL;
+}
+
+void heap_backend_free(void *ptr, size_t len)
+{
+	heap_insert_free_chunk(heap_create_free_chunk(ptr, len));
+}
+
+size_t heap_backend_grow_size(size_t size)
+{
+	return size;
+}
+
+size_t heap_backend_remaining(void)
+{
+	return remaining;
+}
+
+size_t heap_backend_trim(size_t keep, void (*release)(void *ptr, size_t len))
+{
+	size_t trimmed = 0;
+
+	struct free_heap_chunk *chunk, *temp;
+	list_for_every_entry_safe(&free_list, chunk, temp, struct free_heap_chunk, node) {
+		if (remaining < keep + PAGE_SIZE)
+			break;
+
+		vaddr_t start = (vaddr_t)chunk;
+		vaddr_t end = start + chunk->len;
+
+		// whatever is left on either side of the hole has to be able to stand as a chunk
+		vaddr_t hole_start = ROUNDUP(start, PAGE_SIZE);
+		if (hole_start != start && hole_start - start < sizeof(struct free_heap_chunk))
+			hole_start += PAGE_SIZE;
+		vaddr_t hole_end = ROUNDDOWN(end, PAGE_SIZE);
+		if (hole_end != end && end - hole_end < sizeof(struct free_heap_chunk))
+			hole_end -= PAGE_SIZE;
+
+		if (hole_end <= hole_start || hole_start < start)
+			continue;
+
+		// don't dig below what we were asked to keep
+		size_t hole_len = MIN(hole_end - hole_start, ROUNDDOWN(remaining - keep, PAGE_SIZE));
+		hole_end = hole_start + hole_len;
+
+		LTRACEF("chunk %p len 0x%zx, hole 0x%lx - 0x%lx\n", chunk, chunk->len, hole_start, hole_end);
+
+		list_delete(&chunk->node);
+		remaining -= chunk->len;
+
+		if (hole_start != start)
+			heap_insert_free_chunk(heap_create_free_chunk(chunk, hole_start - start));
+		if (hole_end != end)
+			heap_insert_free_chunk(heap_create_free_chunk((void *)hole_end, end - hole_end));
+
+		release((void *)hole_start, hole_len);
+		trimmed += hole_len;
+	}
+
+	return trimmed;
+}
+
+void heap_backend_stats(size_t *free, size_t *max_chunk)
+{
+	struct free_heap_chunk *chunk;
+
+	*free = 0;
+	*max_chunk = 0;
+	list_for_every_entry(&free_list, chunk, struct free_heap_chunk, node) {
+		*free += chunk->len;
+
+		if (chunk->len > *max_chunk) {
+			*max_chunk = chunk->len;
+		}
+	}
+}
+
+void heap_backend_dump(void)
+{
+	dprintf(INFO, "\tfree list:\n");
+
+	struct free_heap_chunk *chunk;
+	list_for_every_entry(&free_list, chunk, struct free_heap_chunk, node) {
+		dump_free_chunk(chunk);
+	}
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
@@ -32,7 +32,9 @@
 #include <string.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/shrinker.h>
 #include <lib/heap.h>
+#include "heap_priv.h"
 
 #define LOCAL_TRACE 0
 
@@ -54,6 +56,18 @@
 
 STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 
+/* once more than HEAP_TRIM_THRESHOLD is sitting free, hand everything beyond
+ * HEAP_TRIM_KEEP back to the pmm. The gap between the two keeps a heap that
+ * hovers around one size from growing and trimming over and over. */
+#if !defined(HEAP_TRIM_THRESHOLD)
+#define HEAP_TRIM_THRESHOLD (2 * HEAP_GROW_SIZE)
+#endif
+#if !defined(HEAP_TRIM_KEEP)
+#define HEAP_TRIM_KEEP HEAP_GROW_SIZE
+#endif
+
+STATIC_ASSERT(HEAP_TRIM_KEEP < HEAP_TRIM_THRESHOLD);
+
 #elif WITH_STATIC_HEAP
 
 #if !defined(HEAP_START) || !defined(HEAP_LEN)
@@ -74,7 +88,8 @@ uintptr_t _heap_end = (uintptr_t)&_end_of_ram;
 #define HEAP_LEN ((uintptr_t)_heap_end - HEAP_START)
 #endif
 
-struct free_heap_chunk {
+/* a freed allocation waiting on the delayed free list, laid over the chunk */
+struct delayed_free_chunk {
 	struct list_node node;
 	size_t len;
 };
@@ -82,10 +97,9 @@ struct free_heap_chunk {
 struct heap {
 	void *base;
 	size_t len;
-	size_t remaining;
 	size_t low_watermark;
+	size_t trimmed; /* bytes handed back to the pmm */
 	mutex_t lock;
-	struct list_node free_list;
 	struct list_node delayed_free_list;
 };
 
@@ -106,28 +120,24 @@ struct alloc_struct_begin {
 };
 
 static ssize_t heap_grow(size_t len);
-
-static void dump_free_chunk(struct free_heap_chunk *chunk)
-{
-	dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
-}
+static size_t heap_trim_locked(size_t keep);
 
 static void heap_dump(void)
 {
 	dprintf(INFO, "Heap dump:\n");
 	dprintf(INFO, "\tbase %p, len 0x%zx\n", theheap.base, theheap.len);
-	dprintf(INFO, "\tfree list:\n");
 
 	mutex_acquire(&theheap.lock);
 
-	struct free_heap_chunk *chunk;
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		dump_free_chunk(chunk);
-	}
+	dprintf(INFO, "\tfree 0x%zx, low watermark 0x%zx, trimmed 0x%zx\n",
+	        heap_backend_remaining(), theheap.low_watermark, theheap.trimmed);
+
+	heap_backend_dump();
 
 	dprintf(INFO, "\tdelayed free list:\n");
-	list_for_every_entry(&theheap.delayed_free_list, chunk, struct free_heap_chunk, node) {
-		dump_free_chunk(chunk);
+	struct delayed_free_chunk *chunk;
+	list_for_every_entry(&theheap.delayed_free_list, chunk, struct delayed_free_chunk, node) {
+		dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
 	}
 	mutex_release(&theheap.lock);
 }
@@ -184,83 +194,36 @@ static void heap_test(void)
 	heap_dump();
 }
 
-// try to insert this free chunk into the free list, consuming the chunk by merging it with
-// nearby ones if possible. Returns base of whatever chunk it became in the list.
-static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+static void heap_insert_free_chunk(void *ptr, size_t len, bool allow_debug)
 {
-#if LK_DEBUGLEVEL > INFO
-	vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
-#endif
+	DEBUG_ASSERT((len % sizeof(void *)) == 0); // size must be aligned on pointer boundary
 
-	LTRACEF("chunk ptr %p, size 0x%zx\n", chunk, chunk->len);
+	LTRACEF("chunk ptr %p, size 0x%zx\n", ptr, len);
 
-	struct free_heap_chunk *next_chunk;
-	struct free_heap_chunk *last_chunk;
+#if DEBUG_HEAP
+	if (allow_debug)
+		memset(ptr, FREE_FILL, len);
+#endif
 
 	mutex_acquire(&theheap.lock);
-
-	theheap.remaining += chunk->len;
-
-	// walk through the list, finding the node to insert before
-	list_for_every_entry(&theheap.free_list, next_chunk, struct free_heap_chunk, node) {
-		if (chunk < next_chunk) {
-			DEBUG_ASSERT(chunk_end <= (vaddr_t)next_chunk);
-
-			list_add_before(&next_chunk->node, &chunk->node);
-
-			goto try_merge;
-		}
-	}
-
-	// walked off the end of the list, add it at the tail
-	list_add_tail(&theheap.free_list, &chunk->node);
-
-	// try to merge with the previous chunk
-try_merge:
-	last_chunk = list_prev_type(&theheap.free_list, &chunk->node, struct free_heap_chunk, node);
-	if (last_chunk) {
-		if ((vaddr_t)last_chunk + last_chunk->len == (vaddr_t)chunk) {
-			// easy, just extend the previous chunk
-			last_chunk->len += chunk->len;
-
-			// remove ourself from the list
-			list_delete(&chunk->node);
-
-			// set the chunk pointer to the newly extended chunk, in case
-			// it needs to merge with the next chunk below
-			chunk = last_chunk;
-		}
-	}
-
-	// try to merge with the next chunk
-	if (next_chunk) {
-		if ((vaddr_t)chunk + chunk->len == (vaddr_t)next_chunk) {
-			// extend our chunk
-			chunk->len += next_chunk->len;
-
-			// remove them from the list
-			list_delete(&next_chunk->node);
-		}
-	}
-
+	heap_backend_free(ptr, len);
+#if WITH_KERNEL_VM
+	if (unlikely(heap_backend_remaining() > HEAP_TRIM_THRESHOLD))
+		heap_trim_locked(HEAP_TRIM_KEEP);
+#endif
 	mutex_release(&theheap.lock);
-
-	return chunk;
 }
 
-static struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len, bool allow_debug)
+static void heap_add_free_range(void *ptr, size_t len, bool allow_debug)
 {
-	DEBUG_ASSERT((len % sizeof(void *)) == 0); // size must be aligned on pointer boundary
-
 #if DEBUG_HEAP
 	if (allow_debug)
 		memset(ptr, FREE_FILL, len);
 #endif
 
-	struct free_heap_chunk *chunk = (struct free_heap_chunk *)ptr;
-	chunk->len = len;
-
-	return chunk;
+	mutex_acquire(&theheap.lock);
+	heap_backend_add(ptr, len);
+	mutex_release(&theheap.lock);
 }
 
 static void heap_free_delayed_list(void)
@@ -271,15 +234,15 @@ static void heap_free_delayed_list(void)
 
 	enter_critical_section();
 
-	struct free_heap_chunk *chunk;
-	while ((chunk = list_remove_head_type(&theheap.delayed_free_list, struct free_heap_chunk, node))) {
+	struct delayed_free_chunk *chunk;
+	while ((chunk = list_remove_head_type(&theheap.delayed_free_list, struct delayed_free_chunk, node))) {
 		list_add_head(&list, &chunk->node);
 	}
 	exit_critical_section();
 
-	while ((chunk = list_remove_head_type(&list, struct free_heap_chunk, node))) {
+	while ((chunk = list_remove_head_type(&list, struct delayed_free_chunk, node))) {
 		LTRACEF("freeing chunk %p\n", chunk);
-		heap_insert_free_chunk(chunk);
+		heap_insert_free_chunk(chunk, chunk->len, false);
 	}
 }
 
@@ -307,11 +270,10 @@ void *heap_alloc(size_t size, unsigned int alignment)
 	size += PADDING_SIZE;
 #endif
 
-	// make sure we allocate at least the size of a struct free_heap_chunk so that
-	// when we free it, we can create a struct free_heap_chunk struct and stick it
-	// in the spot
-	if (size < sizeof(struct free_heap_chunk))
-		size = sizeof(struct free_heap_chunk);
+	// make sure we allocate at least the size of a struct delayed_free_chunk so that
+	// a delayed free can stick one in the spot
+	if (size < sizeof(struct delayed_free_chunk))
+		size = sizeof(struct delayed_free_chunk);
 
 	// round up size to a multiple of native pointer size
 	size = ROUNDUP(size, sizeof(void *));
@@ -327,75 +289,49 @@ void *heap_alloc(size_t size, unsigned int alignment)
 
 #if WITH_KERNEL_VM
 	int retry_count = 0;
-retry:
 #endif
+	bool reclaimed = false;
+retry:
 	mutex_acquire(&theheap.lock);
 
-	// walk through the list
-	ptr = NULL;
-	struct free_heap_chunk *chunk;
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
-
-		// is it big enough to service our allocation?
-		if (chunk->len >= size) {
-			ptr = chunk;
-
-			// remove it from the list
-			struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
-			list_delete(&chunk->node);
-
-			if (chunk->len > size + sizeof(struct free_heap_chunk)) {
-				// there's enough space in this chunk to create a new one after the allocation
-				struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)ptr + size, chunk->len - size, true);
-
-				// truncate this chunk
-				chunk->len -= chunk->len - size;
-
-				// add the new one where chunk used to be
-				if (next_node)
-					list_add_before(next_node, &newchunk->node);
-				else
-					list_add_tail(&theheap.free_list, &newchunk->node);
-			}
-
-			// the allocated size is actually the length of this chunk, not the size requested
-			DEBUG_ASSERT(chunk->len >= size);
-			size = chunk->len;
+	size_t len;
+	void *chunk = heap_backend_alloc(size, &len);
+	ptr = chunk;
+	if (ptr) {
+		// the allocated size is actually the length of this chunk, not the size requested
+		DEBUG_ASSERT(len >= size);
+		size = len;
 
 #if DEBUG_HEAP
-			memset(ptr, ALLOC_FILL, size);
+		memset(ptr, ALLOC_FILL, size);
 #endif
 
-			ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
+		ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
 
-			// align the output if requested
-			if (alignment > 0) {
-				ptr = (void *)ROUNDUP((addr_t)ptr, alignment);
-			}
+		// align the output if requested
+		if (alignment > 0) {
+			ptr = (void *)ROUNDUP((addr_t)ptr, alignment);
+		}
 
-			struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
-			as--;
+		struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+		as--;
 #if LK_DEBUGLEVEL > 1
-			as->magic = HEAP_MAGIC;
+		as->magic = HEAP_MAGIC;
 #endif
-			as->ptr = (void *)chunk;
-			as->size = size;
-			theheap.remaining -= size;
+		as->ptr = chunk;
+		as->size = size;
 
-			if (theheap.remaining < theheap.low_watermark) {
-				theheap.low_watermark = theheap.remaining;
-			}
+		size_t remaining = heap_backend_remaining();
+		if (remaining < theheap.low_watermark) {
+			theheap.low_watermark = remaining;
+		}
 #if DEBUG_HEAP
-			as->padding_start = ((uint8_t *)ptr + original_size);
-			as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
-//			printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
+		as->padding_start = ((uint8_t *)ptr + original_size);
+		as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
+//		printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
 
-			memset(as->padding_start, PADDING_FILL, as->padding_size);
+		memset(as->padding_start, PADDING_FILL, as->padding_size);
 #endif
-
-			break;
-		}
 	}
 
 	mutex_release(&theheap.lock);
@@ -403,7 +339,7 @@ retry:
 #if WITH_KERNEL_VM
 	/* try to grow the heap if we can */
 	if (ptr == NULL && retry_count == 0) {
-		size_t growby = MAX(HEAP_GROW_SIZE, ROUNDUP(size, PAGE_SIZE));
+		size_t growby = MAX(HEAP_GROW_SIZE, ROUNDUP(heap_backend_grow_size(size), PAGE_SIZE));
 
 		ssize_t err = heap_grow(growby);
 		if (err >= 0) {
@@ -413,6 +349,13 @@ retry:
 	}
 #endif
 
+	/* last resort, see if anyone sitting on memory can give some back */
+	if (ptr == NULL && !reclaimed) {
+		reclaimed = true;
+		if (shrinker_reclaim(size) > 0)
+			goto retry;
+	}
+
 	LTRACEF("returning ptr %p\n", ptr);
 
 	return ptr;
@@ -448,8 +391,8 @@ void heap_free(void *ptr)
 
 	LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
-	// looks good, create a free chunk and add it to the pool
-	heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
+	// looks good, hand the chunk back to the pool
+	heap_insert_free_chunk(as->ptr, as->size, true);
 }
 
 void heap_delayed_free(void *ptr)
@@ -462,7 +405,8 @@ void heap_delayed_free(void *ptr)
 
 	DEBUG_ASSERT(as->magic == HEAP_MAGIC);
 
-	struct free_heap_chunk *chunk = heap_create_free_chunk(as->ptr, as->size, false);
+	struct delayed_free_chunk *chunk = (struct delayed_free_chunk *)as->ptr;
+	chunk->len = as->size;
 
 	enter_critical_section();
 	list_add_head(&theheap.delayed_free_list, &chunk->node);
@@ -471,8 +415,6 @@ void heap_delayed_free(void *ptr)
 
 void heap_get_stats(struct heap_stats *ptr)
 {
-	struct free_heap_chunk *chunk;
-
 	if ((struct heap_stats*)NULL==ptr) {
 		return;
 	}
@@ -483,18 +425,10 @@ void heap_get_stats(struct heap_stats *ptr)
 
 	ptr->heap_start = theheap.base;
 	ptr->heap_len = theheap.len;
-	ptr->heap_free=0;
-	ptr->heap_max_chunk = 0;
 
 	mutex_acquire(&theheap.lock);
 
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		ptr->heap_free += chunk->len;
-
-		if (chunk->len > ptr->heap_max_chunk) {
-			ptr->heap_max_chunk = chunk->len;
-		}
-	}
+	heap_backend_stats(&ptr->heap_free, &ptr->heap_max_chunk);
 
 	ptr->heap_low_watermark = theheap.low_watermark;
 
@@ -512,7 +446,7 @@ static ssize_t heap_grow(size_t size)
 
 	LTRACEF("growing heap by 0x%zx bytes, new ptr %p\n", size, ptr);
 
-	heap_insert_free_chunk(heap_create_free_chunk(ptr, size, true));
+	heap_add_free_range(ptr, size, true);
 
 	/* change the heap start and end variables */
 	if ((uintptr_t)ptr < (uintptr_t)theheap.base)
@@ -529,6 +463,73 @@ static ssize_t heap_grow(size_t size)
 #endif
 }
 
+#if WITH_KERNEL_VM
+static void heap_release_pages(void *ptr, size_t len)
+{
+	LTRACEF("releasing 0x%zx bytes at %p\n", len, ptr);
+
+	DEBUG_ASSERT(IS_PAGE_ALIGNED((uintptr_t)ptr));
+	DEBUG_ASSERT(IS_PAGE_ALIGNED(len));
+
+	pmm_free_kpages(ptr, len / PAGE_SIZE);
+}
+#endif
+
+static size_t heap_trim_locked(size_t keep)
+{
+#if WITH_KERNEL_VM
+	size_t trimmed = heap_backend_trim(keep, &heap_release_pages);
+
+	theheap.trimmed += trimmed;
+
+	return trimmed;
+#else
+	/* the heap sits on memory nobody else can use */
+	return 0;
+#endif
+}
+
+#if WITH_KERNEL_VM
+/* hands the pmm free pages out of the heap when it runs low */
+static size_t heap_shrinker_count(shrinker_t *s)
+{
+	return heap_backend_remaining();
+}
+
+static size_t heap_shrinker_shrink(shrinker_t *s, size_t target)
+{
+	/* someone ran out of memory with the heap locked */
+	if (mutex_holder(&theheap.lock) == get_current_thread())
+		return 0;
+
+	mutex_acquire(&theheap.lock);
+	size_t remaining = heap_backend_remaining();
+	size_t trimmed = heap_trim_locked((remaining > target) ? remaining - target : 0);
+	mutex_release(&theheap.lock);
+
+	return trimmed;
+}
+
+static shrinker_t heap_shrinker = SHRINKER_INITIAL_VALUE(heap_shrinker, "heap",
+		&heap_shrinker_count, &heap_shrinker_shrink, NULL);
+#endif
+
+size_t heap_trim(size_t keep)
+{
+	LTRACEF("keep 0x%zx\n", keep);
+
+	// deal with the pending free list
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+		heap_free_delayed_list();
+	}
+
+	mutex_acquire(&theheap.lock);
+	size_t trimmed = heap_trim_locked(keep);
+	mutex_release(&theheap.lock);
+
+	return trimmed;
+}
+
 void heap_init(void)
 {
 	LTRACE_ENTRY;
@@ -536,8 +537,8 @@ void heap_init(void)
 	// create a mutex
 	mutex_init(&theheap.lock);
 
-	// initialize the free list
-	list_initialize(&theheap.free_list);
+	// initialize the free chunk allocator
+	heap_backend_init();
 
 	// initialize the delayed free list
 	list_initialize(&theheap.delayed_free_list);
@@ -554,18 +555,21 @@ void heap_init(void)
 	theheap.base = (void *)HEAP_START;
 	theheap.len = HEAP_LEN;
 #endif
-	theheap.remaining = 0; // will get set by heap_insert_free_chunk()
 	theheap.low_watermark = theheap.len;
 	LTRACEF("base %p size %zd bytes\n", theheap.base, theheap.len);
 
 	// create an initial free chunk
-	heap_insert_free_chunk(heap_create_free_chunk(theheap.base, theheap.len, false));
+	heap_add_free_range(theheap.base, theheap.len, false);
+
+#if WITH_KERNEL_VM
+	shrinker_register(&heap_shrinker);
+#endif
 }
 
 /* add a new block of memory to the heap */
 void heap_add_block(void *ptr, size_t len)
 {
-	heap_insert_free_chunk(heap_create_free_chunk(ptr, len, false));
+	heap_add_free_range(ptr, len, false);
 }
 
 #if LK_DEBUGLEVEL > 1
@@ -589,6 +593,7 @@ usage:
 		printf("\t%s info\n", argv[0].str);
 		printf("\t%s alloc <size> [alignment]\n", argv[0].str);
 		printf("\t%s free <address>\n", argv[0].str);
+		printf("\t%s trim [bytes to keep]\n", argv[0].str);
 		return -1;
 	}
 
@@ -603,6 +608,9 @@ usage:
 		if (argc < 2) goto notenoughargs;
 
 		heap_free((void *)argv[2].u);
+	} else if (strcmp(argv[1].str, "trim") == 0) {
+		size_t trimmed = heap_trim((argc >= 3) ? argv[2].u : 0);
+		printf("heap_trim released 0x%zx bytes\n", trimmed);
 	} else {
 		printf("unrecognized command\n");
 		goto usage;
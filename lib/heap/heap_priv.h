@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <sys/types.h>
+
+/* Interface between the heap front end in heap.c and the free chunk
+ * allocator behind it. Exactly one backend is compiled in, selected with
+ * HEAP_IMPLEMENTATION in rules.mk. Every call except heap_backend_init()
+ * is made with the heap lock held.
+ */
+
+/* set up the empty free chunk structures */
+void heap_backend_init(void);
+
+/* donate a new range of memory to the free pool */
+void heap_backend_add(void *ptr, size_t len);
+
+/* return the base of a free chunk of at least size bytes, or NULL if there
+ * is none. The usable length of the chunk is returned in *len and must be
+ * passed back to heap_backend_free() when it is released.
+ */
+void *heap_backend_alloc(size_t size, size_t *len);
+void heap_backend_free(void *ptr, size_t len);
+
+/* how much memory heap_grow() must donate to be sure a following
+ * heap_backend_alloc() of size bytes succeeds */
+size_t heap_backend_grow_size(size_t size);
+
+/* bytes currently sitting in the free pool */
+size_t heap_backend_remaining(void);
+
+/* pull whole pages out of free chunks, from anywhere in the pool, until no
+ * more than keep bytes are left free. Every page aligned run taken out is
+ * passed to release(). Returns the number of bytes taken out.
+ */
+size_t heap_backend_trim(size_t keep, void (*release)(void *ptr, size_t len));
+
+/* walks the free pool, used for heap_get_stats() and debugging */
+void heap_backend_stats(size_t *free, size_t *max_chunk);
+void heap_backend_dump(void);
+
@@ -2,7 +2,20 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+# free chunk allocator behind heap_alloc/heap_free:
+#   firstfit - address ordered first fit list, smallest footprint
+#   tlsf     - two level segregated fit, constant time alloc and free
+HEAP_IMPLEMENTATION ?= firstfit
+
 MODULE_SRCS += \
 	$(LOCAL_DIR)/heap.c
 
+ifeq ($(HEAP_IMPLEMENTATION),tlsf)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/tlsf.c
+else
+MODULE_SRCS += \
+	$(LOCAL_DIR)/firstfit.c
+endif
+
 include make/module.mk
@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <compiler.h>
+#include <arch/defines.h>
+#include "heap_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* Two level segregated fit (TLSF) free chunk allocator.
+ *
+ * Free blocks are binned by size into a two level table. The first level
+ * splits sizes by power of two, the second level splits each power of two
+ * range into SL_INDEX_COUNT linear classes. A bitmap per level records which
+ * bins are non empty, so finding a suitable block is a couple of find first
+ * set operations, and every block carries a pointer to its physical
+ * predecessor so freeing can coalesce with both neighbors without a search.
+ * Allocation and free are O(1) regardless of fragmentation.
+ */
+
+#if __SIZEOF_POINTER__ == 8
+#define ALIGN_SIZE_LOG2 3
+#define FL_INDEX_MAX 38
+#else
+#define ALIGN_SIZE_LOG2 2
+#define FL_INDEX_MAX 31
+#endif
+
+#define ALIGN_SIZE ((size_t)1 << ALIGN_SIZE_LOG2)
+
+/* number of linear subdivisions of each power of two size range */
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1U << SL_INDEX_COUNT_LOG2)
+
+/* sizes below SMALL_BLOCK_SIZE all land in the first level 0 bins, which are
+ * ALIGN_SIZE apart */
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1U << FL_INDEX_SHIFT)
+
+STATIC_ASSERT(FL_INDEX_COUNT <= 32);
+STATIC_ASSERT(SL_INDEX_COUNT <= 32);
+
+struct tlsf_block {
+	/* physically preceding block, NULL for the first block of an area */
+	struct tlsf_block *prev_phys;
+
+	/* payload size, with BLOCK_FREE in the low bit */
+	size_t size;
+
+	/* only valid while the block is free, these overlay the payload */
+	struct tlsf_block *next_free;
+	struct tlsf_block *prev_free;
+};
+
+#define BLOCK_FREE ((size_t)1)
+
+#define BLOCK_HEADER_SIZE (offsetof(struct tlsf_block, next_free))
+#define BLOCK_SIZE_MIN (sizeof(struct tlsf_block) - BLOCK_HEADER_SIZE)
+#define BLOCK_SIZE_MAX ((size_t)1 << FL_INDEX_MAX)
+
+static struct {
+	uint32_t fl_bitmap;
+	uint32_t sl_bitmap[FL_INDEX_COUNT];
+	struct tlsf_block *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+	/* sum of the payload of every free block */
+	size_t remaining;
+} tlsf;
+
+static inline size_t block_size(const struct tlsf_block *block)
+{
+	return block->size & ~BLOCK_FREE;
+}
+
+static inline bool block_is_free(const struct tlsf_block *block)
+{
+	return block->size & BLOCK_FREE;
+}
+
+static inline void *block_to_ptr(struct tlsf_block *block)
+{
+	return (uint8_t *)block + BLOCK_HEADER_SIZE;
+}
+
+static inline struct tlsf_block *ptr_to_block(void *ptr)
+{
+	return (struct tlsf_block *)((uint8_t *)ptr - BLOCK_HEADER_SIZE);
+}
+
+/* every area ends in a zero sized, never free sentinel block, so this is
+ * always safe to call on a real block */
+static inline struct tlsf_block *block_next(struct tlsf_block *block)
+{
+	return (struct tlsf_block *)((uint8_t *)block_to_ptr(block) + block_size(block));
+}
+
+static inline int tlsf_fls(size_t word)
+{
+	DEBUG_ASSERT(word != 0);
+	return (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(word);
+}
+
+static inline int tlsf_ffs(uint32_t word)
+{
+	DEBUG_ASSERT(word != 0);
+	return __builtin_ctz(word);
+}
+
+/* bin that a free block of this size is filed under */
+static void mapping_insert(size_t size, int *fli, int *sli)
+{
+	int fl, sl;
+
+	if (size < SMALL_BLOCK_SIZE) {
+		fl = 0;
+		sl = (int)(size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT));
+	} else {
+		fl = tlsf_fls(size);
+		sl = (int)(size >> (fl - SL_INDEX_COUNT_LOG2)) ^ (int)SL_INDEX_COUNT;
+		fl -= (FL_INDEX_SHIFT - 1);
+	}
+
+	*fli = fl;
+	*sli = sl;
+}
+
+/* first bin whose blocks are all at least this size */
+static void mapping_search(size_t size, int *fli, int *sli)
+{
+	if (size >= SMALL_BLOCK_SIZE) {
+		size += ((size_t)1 << (tlsf_fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+	}
+
+	mapping_insert(size, fli, sli);
+}
+
+static struct tlsf_block *search_suitable_block(int *fli, int *sli)
+{
+	int fl = *fli;
+	int sl = *sli;
+
+	/* look for a non empty bin at this first level index */
+	uint32_t sl_map = tlsf.sl_bitmap[fl] & (~0U << sl);
+	if (!sl_map) {
+		/* fall back to the smallest non empty larger first level */
+		if (fl + 1 >= (int)FL_INDEX_COUNT)
+			return NULL;
+
+		uint32_t fl_map = tlsf.fl_bitmap & (~0U << (fl + 1));
+		if (!fl_map)
+			return NULL;
+
+		fl = tlsf_ffs(fl_map);
+		sl_map = tlsf.sl_bitmap[fl];
+		DEBUG_ASSERT(sl_map);
+	}
+	sl = tlsf_ffs(sl_map);
+
+	*fli = fl;
+	*sli = sl;
+
+	return tlsf.blocks[fl][sl];
+}
+
+static void remove_free_block(struct tlsf_block *block, int fl, int sl)
+{
+	struct tlsf_block *prev = block->prev_free;
+	struct tlsf_block *next = block->next_free;
+
+	if (next)
+		next->prev_free = prev;
+	if (prev)
+		prev->next_free = next;
+
+	if (tlsf.blocks[fl][sl] == block) {
+		tlsf.blocks[fl][sl] = next;
+
+		if (!next) {
+			tlsf.sl_bitmap[fl] &= ~(1U << sl);
+			if (!tlsf.sl_bitmap[fl])
+				tlsf.fl_bitmap &= ~(1U << fl);
+		}
+	}
+
+	block->size &= ~BLOCK_FREE;
+	tlsf.remaining -= block_size(block);
+}
+
+static void insert_free_block(struct tlsf_block *block, int fl, int sl)
+{
+	struct tlsf_block *head = tlsf.blocks[fl][sl];
+
+	block->next_free = head;
+	block->prev_free = NULL;
+	if (head)
+		head->prev_free = block;
+	tlsf.blocks[fl][sl] = block;
+
+	tlsf.fl_bitmap |= 1U << fl;
+	tlsf.sl_bitmap[fl] |= 1U << sl;
+
+	block->size |= BLOCK_FREE;
+	tlsf.remaining += block_size(block);
+}
+
+static void block_remove(struct tlsf_block *block)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(block), &fl, &sl);
+	remove_free_block(block, fl, sl);
+}
+
+static void block_insert(struct tlsf_block *block)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(block), &fl, &sl);
+	insert_free_block(block, fl, sl);
+}
+
+void heap_backend_init(void)
+{
+}
+
+void heap_backend_add(void *ptr, size_t len)
+{
+	LTRACEF("ptr %p, len 0x%zx\n", ptr, len);
+
+	uintptr_t base = ROUNDUP((uintptr_t)ptr, ALIGN_SIZE);
+	if (base - (uintptr_t)ptr >= len)
+		return;
+	len = ROUNDDOWN(len - (base - (uintptr_t)ptr), ALIGN_SIZE);
+
+	/* carve the range into areas no larger than the biggest block we can
+	 * bin, each made of one free block followed by a sentinel header */
+	while (len >= BLOCK_HEADER_SIZE * 2 + BLOCK_SIZE_MIN) {
+		size_t area = MIN(len, ROUNDDOWN(BLOCK_SIZE_MAX - 1, ALIGN_SIZE));
+
+		struct tlsf_block *block = (struct tlsf_block *)base;
+		block->prev_phys = NULL;
+		block->size = area - BLOCK_HEADER_SIZE * 2;
+
+		struct tlsf_block *sentinel = block_next(block);
+		sentinel->prev_phys = block;
+		sentinel->size = 0;
+
+		block_insert(block);
+
+		base += area;
+		len -= area;
+	}
+}
+
+void *heap_backend_alloc(size_t size, size_t *len)
+{
+	size = ROUNDUP(size, ALIGN_SIZE);
+	if (size < BLOCK_SIZE_MIN)
+		size = BLOCK_SIZE_MIN;
+	if (size >= BLOCK_SIZE_MAX)
+		return NULL;
+
+	int fl, sl;
+	mapping_search(size, &fl, &sl);
+	if (fl >= (int)FL_INDEX_COUNT)
+		return NULL;
+
+	struct tlsf_block *block = search_suitable_block(&fl, &sl);
+	if (!block)
+		return NULL;
+
+	DEBUG_ASSERT(block_size(block) >= size);
+	remove_free_block(block, fl, sl);
+
+	/* trim off the tail if it is big enough to stand as a block of its own */
+	if (block_size(block) >= size + sizeof(struct tlsf_block)) {
+		struct tlsf_block *rest = (struct tlsf_block *)((uint8_t *)block_to_ptr(block) + size);
+
+		rest->prev_phys = block;
+		rest->size = block_size(block) - size - BLOCK_HEADER_SIZE;
+		block->size = size;
+		block_next(rest)->prev_phys = rest;
+
+		block_insert(rest);
+	}
+
+	LTRACEF("size 0x%zx: block %p, len 0x%zx\n", size, block, block_size(block));
+
+	*len = block_size(block);
+	return block_to_ptr(block);
+}
+
+void heap_backend_free(void *ptr, size_t len)
+{
+	struct tlsf_block *block = ptr_to_block(ptr);
+
+	LTRACEF("ptr %p, len 0x%zx\n", ptr, len);
+
+	DEBUG_ASSERT(!block_is_free(block));
+	DEBUG_ASSERT(block_size(block) == len);
+
+	/* coalesce with the physical neighbors */
+	struct tlsf_block *prev = block->prev_phys;
+	if (prev && block_is_free(prev)) {
+		block_remove(prev);
+		prev->size += BLOCK_HEADER_SIZE + block_size(block);
+		block = prev;
+		block_next(block)->prev_phys = block;
+	}
+
+	struct tlsf_block *next = block_next(block);
+	if (block_is_free(next)) {
+		block_remove(next);
+		block->size += BLOCK_HEADER_SIZE + block_size(next);
+		block_next(block)->prev_phys = block;
+	}
+
+	block_insert(block);
+}
+
+size_t heap_backend_grow_size(size_t size)
+{
+	/* the search rounds up to the next bin boundary, and the new area
+	 * carries a block header and a sentinel */
+	size = MAX(ROUNDUP(size, ALIGN_SIZE), BLOCK_SIZE_MIN);
+
+	return size + (size >> SL_INDEX_COUNT_LOG2) + BLOCK_HEADER_SIZE * 2 + ALIGN_SIZE;
+}
+
+size_t heap_backend_remaining(void)
+{
+	return tlsf.remaining;
+}
+
+/* cut the page aligned run of whole pages out of a free block, if it has one
+ * that leaves valid blocks on either side. Returns the length of the hole,
+ * which starts at *hole. */
+static size_t block_trim(struct tlsf_block *block, size_t max, uintptr_t *hole)
+{
+	uintptr_t start = (uintptr_t)block;
+	struct tlsf_block *next = block_next(block);
+
+	/* if next is the area's sentinel, the hole can take it too */
+	bool last = block_size(next) == 0;
+	uintptr_t end = (uintptr_t)next + (last ? BLOCK_HEADER_SIZE : 0);
+
+	/* what stays in front of the hole is either nothing, if the block starts
+	 * its area, a sentinel ending the area at the block's header, or a
+	 * smaller free block plus a sentinel */
+	uintptr_t hole_start = ROUNDUP(start, PAGE_SIZE);
+	for (;;) {
+		size_t head = hole_start - start;
+		if ((head == 0 && !block->prev_phys) || head == BLOCK_HEADER_SIZE ||
+		        head >= BLOCK_HEADER_SIZE * 2 + BLOCK_SIZE_MIN)
+			break;
+		hole_start += PAGE_SIZE;
+	}
+
+	/* what stays behind it is either nothing, the area ending with the hole
+	 * or next then starting its own area, or a new free block starting the
+	 * area in front of next */
+	uintptr_t hole_end = ROUNDDOWN(end, PAGE_SIZE);
+	if (hole_end != end && end - hole_end < BLOCK_HEADER_SIZE * (last ? 2 : 1) + BLOCK_SIZE_MIN)
+		hole_end -= PAGE_SIZE;
+
+	if (hole_end <= hole_start || hole_start < start)
+		return 0;
+
+	size_t len = MIN(hole_end - hole_start, max);
+	hole_end = hole_start + len;
+
+	LTRACEF("block %p len 0x%zx, hole 0x%lx - 0x%lx\n", block, block_size(block), hole_start, hole_end);
+
+	block_remove(block);
+
+	size_t head = hole_start - start;
+	if (head == BLOCK_HEADER_SIZE) {
+		/* the block's own header becomes the sentinel */
+		block->size = 0;
+	} else if (head > 0) {
+		block->size = head - BLOCK_HEADER_SIZE * 2;
+
+		struct tlsf_block *sentinel = block_next(block);
+		sentinel->prev_phys = block;
+		sentinel->size = 0;
+
+		block_insert(block);
+	}
+
+	if (hole_end == end) {
+		if (!last)
+			next->prev_phys = NULL;
+	} else {
+		struct tlsf_block *tail = (struct tlsf_block *)hole_end;
+		tail->prev_phys = NULL;
+		tail->size = (uintptr_t)next - hole_end - BLOCK_HEADER_SIZE;
+		next->prev_phys = tail;
+
+		block_insert(tail);
+	}
+
+	*hole = hole_start;
+	return len;
+}
+
+size_t heap_backend_trim(size_t keep, void (*release)(void *ptr, size_t len))
+{
+	size_t trimmed = 0;
+
+	/* walk the bins from the largest blocks down to the ones too small to
+	 * give up a page, the smallest being a page sized area with just a
+	 * header and sentinel to spare. rescan a level after every cut since
+	 * the pieces can land back in it. blocks that can't give up a page are
+	 * skipped the same way every time, so this always makes progress. */
+	int fl = FL_INDEX_COUNT - 1;
+	while (fl > 0 && ((size_t)1 << (fl + FL_INDEX_SHIFT)) > PAGE_SIZE - BLOCK_HEADER_SIZE * 2 &&
+	        tlsf.remaining >= keep + PAGE_SIZE) {
+		bool cut = false;
+
+		for (uint sl = SL_INDEX_COUNT; sl-- > 0 && !cut; ) {
+			for (struct tlsf_block *block = tlsf.blocks[fl][sl]; block; block = block->next_free) {
+				uintptr_t hole;
+				size_t len = block_trim(block, ROUNDDOWN(tlsf.remaining - keep, PAGE_SIZE), &hole);
+				if (len > 0) {
+					release((void *)hole, len);
+					trimmed += len;
+					cut = true;
+					break;
+				}
+			}
+		}
+
+		if (!cut)
+			fl--;
+	}
+
+	return trimmed;
+}
+
+void heap_backend_stats(size_t *free, size_t *max_chunk)
+{
+	*free = 0;
+	*max_chunk = 0;
+
+	for (uint fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		for (uint sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			for (struct tlsf_block *block = tlsf.blocks[fl][sl]; block; block = block->next_free) {
+				*free += block_size(block);
+
+				if (block_size(block) > *max_chunk) {
+					*max_chunk = block_size(block);
+				}
+			}
+		}
+	}
+}
+
+void heap_backend_dump(void)
+{
+	dprintf(INFO, "\ttlsf bins: fl bitmap 0x%x, remaining 0x%zx\n", tlsf.fl_bitmap, tlsf.remaining);
+
+	for (uint fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		if (!(tlsf.fl_bitmap & (1U << fl)))
+			continue;
+
+		for (uint sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			for (struct tlsf_block *block = tlsf.blocks[fl][sl]; block; block = block->next_free) {
+				dprintf(INFO, "\t\t[%u][%u] base %p, end 0x%lx, len 0x%zx\n", fl, sl,
+				        block, (vaddr_t)block_next(block), block_size(block));
+			}
+		}
+	}
+}
+
+/* vim: set ts=4 sw=4 noexpandtab: */
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/kmem.h>
+
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <list.h>
+#include <pow2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/defines.h>
+#include <kernel/mutex.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+#define KMEM_SLAB_SIZE PAGE_SIZE
+
+/* header at the base of every slab, the objects follow it. Slabs are page
+ * aligned, so the slab an object belongs to is found by rounding down. */
+struct kmem_slab {
+	struct list_node node; /* in one of the cache's slab lists */
+	kmem_cache_t *cache;
+	void *free_list;       /* free objects, linked through their first word */
+	uint inuse;
+#if WITH_KERNEL_VM
+	vm_page_t *page;
+#endif
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+/* compute the layout and publish the cache, called with the cache lock
+ * held for statically declared caches */
+static status_t kmem_cache_setup(kmem_cache_t *cache)
+{
+	if (cache->align == 0)
+		cache->align = sizeof(void *);
+	if (!ispow2(cache->align))
+		return ERR_INVALID_ARGS;
+
+	cache->obj_size = ROUNDUP(MAX(cache->size, sizeof(void *)), cache->align);
+
+#if WITH_KERNEL_VM
+	size_t offset = ROUNDUP(sizeof(struct kmem_slab), cache->align);
+	if (offset + cache->obj_size > KMEM_SLAB_SIZE)
+		return ERR_INVALID_ARGS;
+
+	cache->obj_per_slab = (KMEM_SLAB_SIZE - offset) / cache->obj_size;
+#else
+	cache->obj_per_slab = 0;
+#endif
+
+	LTRACEF("cache %p '%s' size %zu obj_size %zu per slab %u\n", cache, cache->name,
+	        cache->size, cache->obj_size, cache->obj_per_slab);
+
+	mutex_acquire(&cache_list_lock);
+	list_add_tail(&cache_list, &cache->node);
+	mutex_release(&cache_list_lock);
+
+	cache->initialized = true;
+
+	return NO_ERROR;
+}
+
+status_t kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size, size_t align)
+{
+	DEBUG_ASSERT(cache);
+
+	memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->size = size;
+	cache->align = align;
+	mutex_init(&cache->lock);
+	list_initialize(&cache->partial_list);
+	list_initialize(&cache->full_list);
+	list_initialize(&cache->empty_list);
+
+	return kmem_cache_setup(cache);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	kmem_cache_t *cache = malloc(sizeof(kmem_cache_t));
+	if (!cache)
+		return NULL;
+
+	if (kmem_cache_init(cache, name, size, align) < 0) {
+		free(cache);
+		return NULL;
+	}
+	cache->allocated = true;
+
+	return cache;
+}
+
+#if WITH_KERNEL_VM
+static struct kmem_slab *kmem_slab_create(kmem_cache_t *cache)
+{
+	struct list_node pages = LIST_INITIAL_VALUE(pages);
+
+	uint8_t *base = pmm_alloc_kpages(1, &pages);
+	if (!base)
+		return NULL;
+
+	struct kmem_slab *slab = (struct kmem_slab *)base;
+	slab->page = list_remove_head_type(&pages, vm_page_t, node);
+	slab->cache = cache;
+	slab->inuse = 0;
+	list_clear_node(&slab->node);
+
+	/* thread the objects onto the free list in address order */
+	void **link = &slab->free_list;
+	uint8_t *obj = base + ROUNDUP(sizeof(struct kmem_slab), cache->align);
+	for (uint i = 0; i < cache->obj_per_slab; i++) {
+		*link = obj;
+		link = (void **)obj;
+		obj += cache->obj_size;
+	}
+	*link = NULL;
+
+	cache->slab_count++;
+
+	LTRACEF("cache '%s' new slab %p\n", cache->name, slab);
+
+	return slab;
+}
+
+static void kmem_slab_destroy(struct kmem_slab *slab)
+{
+	LTRACEF("cache '%s' slab %p\n", slab->cache->name, slab);
+
+	DEBUG_ASSERT(slab->inuse == 0);
+
+	pmm_free_page(slab->page);
+}
+#endif
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+	void *obj = NULL;
+
+	DEBUG_ASSERT(cache);
+
+	mutex_acquire(&cache->lock);
+
+	if (unlikely(!cache->initialized)) {
+		if (kmem_cache_setup(cache) < 0)
+			goto done;
+	}
+
+#if WITH_KERNEL_VM
+	/* fill up partially used slabs before dipping into empty ones */
+	struct kmem_slab *slab = list_peek_head_type(&cache->partial_list, struct kmem_slab, node);
+	if (!slab) {
+		slab = list_remove_head_type(&cache->empty_list, struct kmem_slab, node);
+		if (slab) {
+			cache->empty_count--;
+		} else {
+			slab = kmem_slab_create(cache);
+			if (!slab)
+				goto done;
+		}
+		list_add_head(&cache->partial_list, &slab->node);
+	}
+
+	obj = slab->free_list;
+	DEBUG_ASSERT(obj);
+	slab->free_list = *(void **)obj;
+
+	if (++slab->inuse == cache->obj_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->full_list, &slab->node);
+	}
+#else
+	if (cache->align > sizeof(void *))
+		obj = memalign(cache->align, cache->obj_size);
+	else
+		obj = malloc(cache->obj_size);
+	if (!obj)
+		goto done;
+#endif
+
+	cache->alloc_count++;
+	if (++cache->active_objs > cache->peak_objs)
+		cache->peak_objs = cache->active_objs;
+
+done:
+	if (!obj)
+		cache->fail_count++;
+
+	mutex_release(&cache->lock);
+
+	LTRACEF("cache '%s' obj %p\n", cache->name, obj);
+
+	return obj;
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cache)
+{
+	void *obj = kmem_cache_alloc(cache);
+	if (obj)
+		memset(obj, 0, cache->size);
+
+	return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+	if (!obj)
+		return;
+
+	LTRACEF("cache '%s' obj %p\n", cache->name, obj);
+
+	DEBUG_ASSERT(cache->initialized);
+
+#if WITH_KERNEL_VM
+	struct kmem_slab *slab = (struct kmem_slab *)ROUNDDOWN((uintptr_t)obj, KMEM_SLAB_SIZE);
+	struct kmem_slab *release = NULL;
+
+	DEBUG_ASSERT(slab->cache == cache);
+
+	mutex_acquire(&cache->lock);
+
+	DEBUG_ASSERT(slab->inuse > 0);
+
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+
+	if (slab->inuse-- == cache->obj_per_slab) {
+		list_delete(&slab->node);
+		list_add_head(&cache->partial_list, &slab->node);
+	}
+
+	if (slab->inuse == 0) {
+		/* keep one spare empty slab around so a cache that hovers on a slab
+		 * boundary doesn't churn pages through the pmm */
+		list_delete(&slab->node);
+		if (cache->empty_count == 0) {
+			list_add_head(&cache->empty_list, &slab->node);
+			cache->empty_count++;
+		} else {
+			cache->slab_count--;
+			release = slab;
+		}
+	}
+#else
+	mutex_acquire(&cache->lock);
+
+	free(obj);
+#endif
+
+	cache->free_count++;
+	cache->active_objs--;
+
+	mutex_release(&cache->lock);
+
+#if WITH_KERNEL_VM
+	if (release)
+		kmem_slab_destroy(release);
+#endif
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	DEBUG_ASSERT(cache->active_objs == 0);
+
+	if (cache->initialized) {
+		mutex_acquire(&cache_list_lock);
+		list_delete(&cache->node);
+		mutex_release(&cache_list_lock);
+
+#if WITH_KERNEL_VM
+		struct kmem_slab *slab;
+		while ((slab = list_remove_head_type(&cache->empty_list, struct kmem_slab, node)))
+			kmem_slab_destroy(slab);
+#endif
+	}
+
+	mutex_destroy(&cache->lock);
+
+	if (cache->allocated)
+		free(cache);
+}
+
+void kmem_cache_dump(void)
+{
+	printf("%-16s %8s %6s %6s %8s %8s %10s %10s %6s\n",
+	       "name", "objsize", "slabs", "empty", "active", "peak", "allocs", "frees", "fails");
+
+	mutex_acquire(&cache_list_lock);
+
+	kmem_cache_t *cache;
+	list_for_every_entry(&cache_list, cache, kmem_cache_t, node) {
+		printf("%-16s %8zu %6u %6u %8u %8u %10lu %10lu %6lu\n",
+		       cache->name, cache->obj_size, cache->slab_count, cache->empty_count,
+		       cache->active_objs, cache->peak_objs, cache->alloc_count,
+		       cache->free_count, cache->fail_count);
+	}
+
+	mutex_release(&cache_list_lock);
+}
+
+#if LK_DEBUGLEVEL > 1
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_kmem(int argc, const cmd_args *argv)
+{
+	kmem_cache_dump();
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("kmem", "dump kmem cache stats", &cmd_kmem)
+STATIC_COMMAND_END(kmem);
+
+#endif
+#endif
+
+/* vim: set ts=4 sw=4 noexpandtab: */
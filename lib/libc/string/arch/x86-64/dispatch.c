@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/cpu_features.h>
+
+/* the rep string variants in memcpy.S and memset.S. They follow the
+ * internal register convention of those files, so are only ever jumped to
+ * from there. */
+typedef void (*rep_func)(void);
+
+extern rep_func __x86_memcpy_rep;
+extern rep_func __x86_memset_rep;
+
+void __x86_memcpy_rep_movsb(void);
+void __x86_memcpy_rep_movsq(void);
+void __x86_memset_rep_stosb(void);
+void __x86_memset_rep_stosq(void);
+
+/* rep movsb/stosb are only faster than the quadword versions with ERMS */
+static rep_func memcpy_rep_resolve(uint32_t features)
+{
+	if (features & CPU_FEATURE_BIT(CPU_FEATURE_ERMS))
+		return __x86_memcpy_rep_movsb;
+	return __x86_memcpy_rep_movsq;
+}
+
+static rep_func memset_rep_resolve(uint32_t features)
+{
+	if (features & CPU_FEATURE_BIT(CPU_FEATURE_ERMS))
+		return __x86_memset_rep_stosb;
+	return __x86_memset_rep_stosq;
+}
+
+CPU_DISPATCH(x86_memcpy_rep, __x86_memcpy_rep, memcpy_rep_resolve);
+CPU_DISPATCH(x86_memset_rep, __x86_memset_rep, memset_rep_resolve);
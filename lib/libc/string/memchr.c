@@ -26,20 +26,34 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_priv.h"
 
 void *
 memchr(void const *buf, int c, size_t len)
 {
-	size_t i;
 	unsigned char const *b= buf;
 	unsigned char        x= (c&0xff);
 
-	for (i= 0; i< len; i++) {
-		if (b[i]== x) {
-			return (void*)(b+i);
+	for (; len > 0 && !IS_WORD_ALIGNED(b); b++, len--) {
+		if (*b == x)
+			return (void*)b;
+	}
+
+	if (len >= WORD_SIZE) {
+		const word_t *w = (const word_t *)b;
+		word_t mask = WORD_REPEAT(x);
+
+		for (; len >= WORD_SIZE; w++, len -= WORD_SIZE) {
+			if (WORD_HAS_ZERO(*w ^ mask))
+				break;
 		}
+		b = (unsigned char const *)w;
+	}
+
+	for (; len > 0; b++, len--) {
+		if (*b == x)
+			return (void*)b;
 	}
 
 	return NULL;
 }
-
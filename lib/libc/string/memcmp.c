@@ -26,15 +26,32 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_priv.h"
 
 int
 memcmp(const void *cs, const void *ct, size_t count)
 {
-	const unsigned char *su1, *su2;
-	signed char res = 0;
+	const unsigned char *su1 = cs, *su2 = ct;
 
-	for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-		if ((res = *su1 - *su2) != 0)
-			break;
-	return res;
+	/* only compare a word at a time if both sides can be aligned together */
+	if (count >= WORD_SIZE && IS_WORD_ALIGNED((uintptr_t)su1 ^ (uintptr_t)su2)) {
+		const word_t *w1, *w2;
+
+		for (; !IS_WORD_ALIGNED(su1); ++su1, ++su2, count--)
+			if (*su1 != *su2)
+				return *su1 - *su2;
+
+		/* stop on the first differing word, the byte loop finds the byte */
+		w1 = (const word_t *)su1;
+		w2 = (const word_t *)su2;
+		for (; count >= WORD_SIZE && *w1 == *w2; w1++, w2++)
+			count -= WORD_SIZE;
+		su1 = (const unsigned char *)w1;
+		su2 = (const unsigned char *)w2;
+	}
+
+	for (; 0 < count; ++su1, ++su2, count--)
+		if (*su1 != *su2)
+			return *su1 - *su2;
+	return 0;
 }
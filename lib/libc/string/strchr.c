@@ -26,11 +26,26 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_priv.h"
 
 char *
 strchr(const char *s, int c)
 {
-	for (; *s != (char) c; ++s)
+	const word_t *w;
+	word_t mask;
+
+	for (; !IS_WORD_ALIGNED(s); ++s) {
+		if (*s == (char) c)
+			return (char *) s;
+		if (*s == '\0')
+			return NULL;
+	}
+
+	mask = WORD_REPEAT(c);
+	for (w = (const word_t *)s; !WORD_HAS_ZERO(*w) && !WORD_HAS_ZERO(*w ^ mask); w++)
+		;
+
+	for (s = (const char *)w; *s != (char) c; ++s)
 		if (*s == '\0')
 			return NULL;
 	return (char *) s;
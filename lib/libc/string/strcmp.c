@@ -26,16 +26,32 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_priv.h"
 
 int
 strcmp(char const *cs, char const *ct)
 {
-	signed char __res;
+	const unsigned char *su1 = (const unsigned char *)cs;
+	const unsigned char *su2 = (const unsigned char *)ct;
 
-	while (1) {
-		if ((__res = *cs - *ct++) != 0 || !*cs++)
-			break;
+	/* only compare a word at a time if both sides can be aligned together */
+	if (IS_WORD_ALIGNED((uintptr_t)su1 ^ (uintptr_t)su2)) {
+		const word_t *w1, *w2;
+
+		for (; !IS_WORD_ALIGNED(su1); su1++, su2++)
+			if (*su1 != *su2 || *su1 == '\0')
+				return *su1 - *su2;
+
+		/* stop on the first word that differs or holds the terminator */
+		w1 = (const word_t *)su1;
+		w2 = (const word_t *)su2;
+		for (; *w1 == *w2 && !WORD_HAS_ZERO(*w1); w1++, w2++)
+			;
+		su1 = (const unsigned char *)w1;
+		su2 = (const unsigned char *)w2;
 	}
 
-	return __res;
+	for (; *su1 == *su2 && *su1 != '\0'; su1++, su2++)
+		;
+	return *su1 - *su2;
 }
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014 The LK Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Helpers for the word at a time C string routines.
+ *
+ * A word is only ever loaded from a naturally aligned address, so it never
+ * straddles a page: once the first byte of a word is known to be readable,
+ * reading the rest of it cannot fault, even past the end of the string.
+ * The routines use this to scan a word at a time and fall back to bytes
+ * to pick out the exact position once a word looks interesting.
+ */
+typedef unsigned long __MAY_ALIAS word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+
+#define WORD_ONES ((word_t)-1 / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+#define IS_WORD_ALIGNED(p) (((uintptr_t)(p) & WORD_MASK) == 0)
+
+/* nonzero if any byte of x is zero. The exact bits set above the first
+ * zero byte are not meaningful, only the result being nonzero is. */
+#define WORD_HAS_ZERO(x) (((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+
+/* c replicated into every byte of a word */
+#define WORD_REPEAT(c) (WORD_ONES * (unsigned char)(c))
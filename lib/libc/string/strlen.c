@@ -26,16 +26,24 @@
  */
 #include <string.h>
 #include <sys/types.h>
+#include "string_priv.h"
 
 size_t
 strlen(char const *s)
 {
-	size_t i;
+	const char *p = s;
+	const word_t *w;
 
-	i= 0;
-	while (s[i]) {
-		i+= 1;
+	for (; !IS_WORD_ALIGNED(p); p++) {
+		if (*p == '\0')
+			return p - s;
 	}
 
-	return i;
+	for (w = (const word_t *)p; !WORD_HAS_ZERO(*w); w++)
+		;
+
+	for (p = (const char *)w; *p; p++)
+		;
+
+	return p - s;
 }
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/kmem.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
@@ -141,6 +142,7 @@ typedef struct tcp_socket {
 
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+static kmem_cache_t tcp_socket_cache = KMEM_CACHE_INITIAL_VALUE(tcp_socket_cache, "tcp_socket", sizeof(tcp_socket_t), 0);
 
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
@@ -307,7 +309,7 @@ static bool dec_socket_ref(tcp_socket_t *s)
         free(s->rx_buffer_raw);
         free(s->tx_buffer);
 
-        free(s);
+        kmem_cache_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -898,7 +900,7 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
 {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = kmem_cache_zalloc(&tcp_socket_cache);
     if (!s)
         return NULL;
 
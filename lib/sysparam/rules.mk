@@ -4,7 +4,8 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS += \
 	lib/bio \
-	lib/cksum
+	lib/cksum \
+	lib/kmem
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/sysparam.c
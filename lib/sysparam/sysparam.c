@@ -31,6 +31,7 @@
 #include <list.h>
 #include <lib/bio.h>
 #include <lib/cksum.h>
+#include <lib/kmem.h>
 #include <lib/sysparam.h>
 #include <lk/init.h>
 
@@ -83,6 +84,8 @@ static struct {
     size_t len;
 } params;
 
+static kmem_cache_t sysparam_cache = KMEM_CACHE_INITIAL_VALUE(sysparam_cache, "sysparam", sizeof(struct sysparam), 0);
+
 static void sysparam_init(uint level)
 {
     list_initialize(&params.list);
@@ -118,7 +121,7 @@ static inline uint32_t sysparam_crc32(const struct sysparam_phys *sp)
 
 static struct sysparam *sysparam_create(const char *name, size_t namelen, const void *data, size_t datalen, uint32_t flags)
 {
-    struct sysparam *param = malloc(sizeof(struct sysparam));
+    struct sysparam *param = kmem_cache_alloc(&sysparam_cache);
     if (!param)
         return NULL;
 
@@ -127,7 +130,7 @@ static struct sysparam *sysparam_create(const char *name, size_t namelen, const
 
     param->name = malloc(namelen + 1);
     if (!param->name) {
-        free(param);
+        kmem_cache_free(&sysparam_cache, param);
         return NULL;
     }
     param->memlen += namelen + 1;
@@ -140,7 +143,7 @@ static struct sysparam *sysparam_create(const char *name, size_t namelen, const
     param->data = malloc(alloclen);
     if (!param->data) {
         free(param->name);
-        free(param);
+        kmem_cache_free(&sysparam_cache, param);
         return NULL;
     }
     param->memlen += alloclen;
@@ -264,7 +267,7 @@ status_t sysparam_reload(void)
 
         free(param->name);
         free(param->data);
-        free(param);
+        kmem_cache_free(&sysparam_cache, param);
     }
 
     /* reset the list back to scratch */
@@ -438,7 +441,7 @@ status_t sysparam_remove(const char *name)
 
     free(param->name);
     free(param->data);
-    free(param);
+    kmem_cache_free(&sysparam_cache, param);
 
     params.dirty = true;
 
@@ -90,7 +90,12 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval)
 {
-    LTRACEF("callback %p, arg %p, interval %lu\n", callback, arg, interval);
+    return platform_set_oneshot_timer_ns(callback, arg, (lk_time_ns_t)interval * 1000000);
+}
+
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval)
+{
+    LTRACEF("callback %p, arg %p, interval %llu ns\n", callback, arg, interval);
 
     enter_critical_section();
 
@@ -102,8 +107,9 @@ status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg
     /* set the countdown register to max */
     ARM64_WRITE_SYSREG(CNTP_TVAL_EL0, INT32_MAX);
 
-    /* calculate the interval */
-    uint64_t ticks = (uint64_t)timer_freq * interval / 1000U;
+    /* calculate the interval, split to keep the multiply from overflowing */
+    uint64_t ticks = interval / 1000000000U * timer_freq +
+                     (interval % 1000000000U) * timer_freq / 1000000000U;
 
     /* set the comparison register */
     uint64_t counter = read_counter();
@@ -142,6 +148,14 @@ lk_time_t current_time(void)
     return read_counter() / msec_ratio;
 }
 
+lk_time_ns_t current_time_ns(void)
+{
+    uint64_t counter = read_counter();
+
+    return counter / timer_freq * 1000000000U +
+           (counter % timer_freq) * 1000000000U / timer_freq;
+}
+
 static enum handler_return platform_tick(void *arg)
 {
     /* reset the compare register ahead of the physical counter
@@ -41,6 +41,16 @@ __WEAK void platform_init(void)
 {
 }
 
+__WEAK void platform_init_secondary_cpu(void)
+{
+}
+
+/* platforms with a finer grained timebase should override this */
+__WEAK lk_time_ns_t current_time_ns(void)
+{
+	return current_time_hires() * 1000;
+}
+
 __WEAK void platform_quiesce(void)
 {
 }
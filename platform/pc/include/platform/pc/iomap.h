@@ -26,6 +26,10 @@
 /* i8253/i8254 programmable interval timer registers */
 #define I8253_CONTROL_REG   0x43
 #define I8253_DATA_REG      0x40
+#define I8253_DATA_REG_2    0x42
+
+/* system control port b, gates pit channel 2 */
+#define SYS_CONTROL_B_REG   0x61
 
 /* i8042 keyboard controller registers */
 #define I8042_COMMAND_REG   0x64
@@ -44,6 +44,10 @@ static uint64_t timer_current_time;
 
 static uint16_t divisor;
 
+/* the tsc is the fine grained timebase, calibrated against the pit at boot */
+static uint64_t tsc_freq;
+static uint64_t tsc_base;
+
 #define INTERNAL_FREQ 1193182ULL
 #define INTERNAL_FREQ_3X 3579546ULL
 
@@ -83,6 +87,58 @@ lk_bigtime_t current_time_hires(void)
 
 	return time;
 }
+
+static uint64_t read_tsc(void)
+{
+	uint32_t low, high;
+
+	rdtsc(low, high);
+	return ((uint64_t)high << 32) | low;
+}
+
+lk_time_ns_t current_time_ns(void)
+{
+	/* fall back to the pit if the tsc couldn't be calibrated */
+	if (!tsc_freq)
+		return current_time_hires() * 1000;
+
+	uint64_t delta = read_tsc() - tsc_base;
+
+	/* split the conversion to keep the multiply from overflowing */
+	return delta / tsc_freq * 1000000000ULL + (delta % tsc_freq) * 1000000000ULL / tsc_freq;
+}
+
+/* time the tsc against a 10ms one shot countdown of pit channel 2 */
+static void calibrate_tsc(void)
+{
+	const uint16_t count = INTERNAL_FREQ / 100;
+	uint32_t timeout = 10000000;
+
+	/* gate channel 2 on, with the speaker output disabled */
+	outp(SYS_CONTROL_B_REG, (inp(SYS_CONTROL_B_REG) & ~0x02) | 0x01);
+
+	/* timer 2, mode 0, binary counter, LSB followed by MSB */
+	outp(I8253_CONTROL_REG, 0xb0);
+	outp(I8253_DATA_REG_2, count & 0xff);
+	outp(I8253_DATA_REG_2, count >> 8);
+
+	uint64_t start = read_tsc();
+
+	/* OUT2 goes high when the count reaches zero */
+	while (!(inp(SYS_CONTROL_B_REG) & 0x20)) {
+		if (--timeout == 0) {
+			dprintf(INFO, "tsc calibration timed out, using the pit as the timebase\n");
+			return;
+		}
+	}
+
+	uint64_t end = read_tsc();
+
+	tsc_freq = (end - start) * INTERNAL_FREQ / count;
+	tsc_base = end;
+
+	dprintf(SPEW, "tsc frequency %llu Hz\n", tsc_freq);
+}
 static enum handler_return os_timer_tick(void *arg)
 {
 	uint64_t delta;
@@ -153,6 +209,8 @@ void platform_init_timer(void)
 {
 	timer_current_time = 0;
 
+	calibrate_tsc();
+
 	set_pit_frequency(1000); // ~1ms granularity
 
 	register_int_handler(INT_PIT, &os_timer_tick, NULL);
@@ -46,6 +46,7 @@
 #define SDRAM_APERTURE_SIZE (0x40000000)
 
 /* most of the peripherals live on the motherboard CS7 */
+#define SYSREGS_BASE (MOTHERBOARD_CS7_VIRT + 0x0000)
 #define UART0_BASE  (MOTHERBOARD_CS7_VIRT + 0x9000)
 #define UART1_BASE  (MOTHERBOARD_CS7_VIRT + 0xa000)
 #define UART2_BASE  (MOTHERBOARD_CS7_VIRT + 0xb000)
@@ -32,6 +32,7 @@
 #include <lk/init.h>
 #include <kernel/vm.h>
 #include <platform.h>
+#include <reg.h>
 #include <platform/gic.h>
 #include <platform/interrupts.h>
 #include <platform/vexpress-a9.h>
@@ -90,6 +91,28 @@ void platform_init_mmu_mappings(void)
 {
 }
 
+#if WITH_SMP
+/* offsets into the motherboard system registers */
+#define SYS_FLAGSSET (0x30)
+#define SYS_FLAGSCLR (0x34)
+
+static void platform_start_secondary_cpus(void)
+{
+    /* the boot monitor parks the secondary cpus in wfi. once poked with an
+     * ipi they branch to whatever physical address is in SYS_FLAGS */
+    *REG32(SYSREGS_BASE + SYS_FLAGSCLR) = 0xffffffff;
+    *REG32(SYSREGS_BASE + SYS_FLAGSSET) = MEMBASE + KERNEL_LOAD_OFFSET;
+    DSB;
+
+    arm_gic_sgi(0, ARM_GIC_SGI_FLAG_TARGET_FILTER_NOT_SENDER, 0);
+}
+
+void platform_init_secondary_cpu(void)
+{
+    arm_gic_init_secondary_cpu();
+}
+#endif
+
 void platform_early_init(void)
 {
     /* initialize the interrupt controller */
@@ -100,6 +123,11 @@ void platform_early_init(void)
 
     uart_init_early();
 
+#if WITH_SMP
+    /* the secondaries wait in start.S until the kernel is far enough along */
+    platform_start_secondary_cpus();
+#endif
+
     /* add the main memory arena */
     pmm_add_arena(&arena);
 }
@@ -16,6 +16,9 @@ MODULE_SRCS += \
 MEMBASE := 0x60000000
 MEMSIZE := 0x20000000	# 512MB
 
+WITH_SMP ?= 1
+SMP_MAX_CPUS ?= 4
+
 MODULE_DEPS += \
 	lib/cbuf \
 	dev/interrupt/arm_gic \
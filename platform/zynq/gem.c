@@ -333,7 +333,7 @@ status_t gem_init(uintptr_t base, uint32_t dmasize)
 
     /* get the physical address */
     paddr_t dmabase_phys;
-    ret = arch_mmu_query(dmabase, &dmabase_phys, NULL);
+    ret = arch_mmu_query(&vmm_get_kernel_aspace()->arch_aspace, dmabase, &dmabase_phys, NULL);
     if (ret < 0)
         return ret;
 
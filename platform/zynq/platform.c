@@ -253,6 +253,15 @@ struct mmu_initial_mapping mmu_initial_mappings[] = {
       .flags = MMU_INITIAL_MAPPING_FLAG_DEVICE,
       .name = "hw-fc000000" },
 
+#if WITH_SMP
+    /* high ocm, the bootrom parks the second cpu up here */
+    { .phys = 0xfff00000,
+      .virt = 0xfff00000,
+      .size = MB,
+      .flags = MMU_INITIAL_MAPPING_FLAG_DEVICE,
+      .name = "ocm-high" },
+#endif
+
     /* identity map to let the boot code run */
     { .phys = SRAM_BASE,
       .virt = SRAM_BASE,
@@ -284,6 +293,26 @@ void platform_init_mmu_mappings(void)
 {
 }
 
+#if WITH_SMP
+/* the bootrom spins the second cpu in a wfe loop until this holds an entry point */
+#define CPU1_START_ADDR (0xfffffff0)
+
+static void platform_start_secondary_cpus(void)
+{
+    /* make sure the scu is keeping the l1 caches coherent */
+    *REG32(SCU_CONTROL_BASE) |= 1;
+
+    *REG32(CPU1_START_ADDR) = MEMBASE + KERNEL_LOAD_OFFSET;
+    DSB;
+    __asm__ volatile("sev");
+}
+
+void platform_init_secondary_cpu(void)
+{
+    arm_gic_init_secondary_cpu();
+}
+#endif
+
 void platform_early_init(void)
 {
     zynq_mio_init();
@@ -314,6 +343,11 @@ void platform_early_init(void)
     /* initialize the timer block */
     arm_cortex_a9_timer_init(CPUPRIV_BASE, zynq_get_arm_timer_freq());
 
+#if WITH_SMP
+    /* the second cpu waits in start.S until the kernel is far enough along */
+    platform_start_secondary_cpus();
+#endif
+
     /* add the main memory arena */
 #if !ZYNQ_CODE_IN_SDRAM && SDRAM_SIZE != 0
     /* In the case of running from SRAM, and we are using SDRAM,
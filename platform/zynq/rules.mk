@@ -45,6 +45,11 @@ KERNEL_LOAD_OFFSET := 0x00100000 # loaded 1MB into physical space
 # set a #define so system code can decide if it needs to reinitialize dram or not
 GLOBAL_DEFINES += \
 	ZYNQ_CODE_IN_SDRAM=1
+
+# bring up the second cpu. it is parked by the bootrom in the top bank of
+# ocm, which is remapped when running out of sram
+WITH_SMP ?= 1
+SMP_MAX_CPUS ?= 2
 endif
 
 # put our kernel at 0xc0000000 so we can have axi bus 1 mapped at 0x80000000
@@ -134,3 +134,19 @@ static int bootstrap2(void *arg)
 	return 0;
 }
 
+#if WITH_SMP
+void lk_secondary_cpu_entry(void)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	/* secondary cpus start out in the same implicit critical section the boot cpu did */
+	inc_critical_section();
+
+	// get us into some sort of thread context
+	thread_secondary_cpu_init_early();
+
+	dprintf(SPEW, "entering scheduler on cpu %u\n", cpu);
+	thread_secondary_cpu_entry();
+}
+#endif
+